@@ -34,6 +34,11 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include <afs/stds.h>
 #include <rx/rxkad.h>
@@ -47,6 +52,9 @@
 #include "dumpscan_errs.h"
 
 #define COPYBUFSIZE (256*1024)
+#define MAXJOBS     1024        /* Copies queued for workers (-j) */
+#define SPARSEBLOCK 4096        /* Zero blocks this size become holes (-S) */
+#define METABATCH   64          /* Metadata entries a worker takes at once */
 
 extern int optind;
 extern char *optarg;
@@ -54,15 +62,21 @@ extern char *optarg;
 char *argv0;
 static char **file_names;
 static afs_uint32 *file_vnums;
-static int name_count, vnum_count;
+static int name_count, vnum_count, pattern_count, include_count;
+static path_selector *sel;
 
-static char *input_path, *target;
+static char *input_path, *index_path, *target;
 static int quiet, verbose, error_count, dirs_done, extract_all;
-static int nomode, use_realpath, use_vnum, rawmode;
+static int nomode, use_realpath, use_vnum, rawmode, streaming, nworkers;
+static int sparse, do_meta, tarmode;
 static int do_acls, do_headers;
+static int error_keep, error_every;
 
 static path_hashinfo phi;
 static dump_parser dp;
+static error_summary es;
+static XFILE input_file;
+static XFILE tar_out;           /* With -T, where the archive goes */
 
 /* Print a usage message and exit */
 static void usage(int status, char *msg)
@@ -71,70 +85,139 @@ static void usage(int status, char *msg)
   fprintf(stderr, "Usage: %s [options] dumpfile [dest [files...]]\n", argv0);
   fprintf(stderr, "  -A     Save ACL's\n");
   fprintf(stderr, "  -H     Save headers\n");
+  fprintf(stderr, "  -I idx Use vnode index idx (see afsdump_index)\n");
+  fprintf(stderr, "  -K n   With -k, report progress every n unprinted errors\n");
+  fprintf(stderr, "  -S     Make sparse files, skipping blocks of zeros\n");
+  fprintf(stderr, "  -T     Write a tar archive to stdout, instead of files\n");
+  fprintf(stderr, "  -X re  Exclude paths matching regex re\n");
+  fprintf(stderr, "  -e re  Extract paths matching regex re\n");
+  fprintf(stderr, "  -g pat Extract paths matching glob pat\n");
   fprintf(stderr, "  -h     Print this help message\n");
   fprintf(stderr, "  -i     Use vnode numbers\n");
+  fprintf(stderr, "  -j n   Copy file data with n threads (not with -s, -T)\n");
+  fprintf(stderr, "  -k n   Print only n errors of each kind, then a summary\n");
+  fprintf(stderr, "  -m     Restore modes, owners and times\n");
   fprintf(stderr, "  -n     Don't actually create files\n");
   fprintf(stderr, "  -p     Use real pathnames internally\n");
   fprintf(stderr, "  -q     Quiet mode (don't print errors)\n");
   fprintf(stderr, "  -r     Extract raw vnode contents (implies -i)\n");
+  fprintf(stderr, "  -s     Extract in one pass, without a prescan\n");
   fprintf(stderr, "  -v     Verbose mode\n");
+  fprintf(stderr, "  -x pat Exclude paths matching glob pat\n");
   fprintf(stderr, "The destination directory defaults to .\n");
   fprintf(stderr, "Files may be vnode numbers or volume-relative paths;\n");
   fprintf(stderr, "If vnode numbers are used, files will be extracted\n");
   fprintf(stderr, "a name generated from the vnode number and uniqifier.\n");
   fprintf(stderr, "If paths are used, -p is implied and files will be\n");
   fprintf(stderr, "into correctly-named files.\n");
+  fprintf(stderr, "Paths containing *, ? or [ are taken as globs, as with -g.\n");
+  fprintf(stderr, "Globs starting with / match from the volume root; others\n");
+  fprintf(stderr, "match at any level.  Excluding a directory excludes\n");
+  fprintf(stderr, "everything in it.\n");
+  fprintf(stderr, "Dumps that can't be seeked (such as pipes) are always\n");
+  fprintf(stderr, "extracted in one pass, as with -s, which ignores -j.\n");
+  fprintf(stderr, "-j is also ignored for a dump read from standard input.\n");
+  fprintf(stderr, "With -T, there is no destination; files follow the dump\n");
+  fprintf(stderr, "name, the archive is extracted in one pass, and the list\n");
+  fprintf(stderr, "of files goes to stderr.\n");
   exit(status);
 }
 
 
+/* Add a pattern to the selector, or complain and exit */
+static void add_pattern(char *pattern, int flags)
+{
+  afs_uint32 r;
+
+  if (r = PathSel_AddPattern(sel, pattern, flags)) {
+    if (r != EINVAL) {
+      com_err(argv0, r, "adding pattern %s", pattern);
+      exit(1);
+    }
+    fprintf(stderr, "%s: Invalid pattern %s\n", argv0, pattern);
+    usage(1, 0);
+  }
+  if (!(flags & PSEL_EXCLUDE)) include_count++;
+  pattern_count++;
+  use_realpath = 1;
+}
+
+
 /* Parse the command-line options */
 static void parse_options(int argc, char **argv)
 {
-  int c, i, i_name, i_vnum;
+  int c, i, i_name, i_vnum, nfixed;
+  afs_uint32 r;
 
   /* Set the program name */
   if (argv0 = strrchr(argv[0], '/')) argv0++;
   else argv0 = argv[0];
 
   /* Initialize options */
-  input_path = 0;
+  input_path = index_path = 0;
   quiet = verbose = nomode = 0;
   use_realpath = use_vnum = do_acls = do_headers = extract_all = rawmode = 0;
+  streaming = sparse = do_meta = tarmode = 0;
+  nworkers = 1;
+  error_keep = -1;
+  error_every = 0;
 
   /* Initialize other stuff */
-  error_count = 0;
+  error_count = pattern_count = include_count = 0;
+  if (r = PathSel_Init(&sel)) {
+    com_err(argv0, r, "initializing");
+    exit(1);
+  }
 
   /* Parse the options */
-  while ((c = getopt(argc, argv, "AHhinpqrv")) != EOF) {
+  while ((c = getopt(argc, argv, "AHI:K:STX:e:g:hij:k:mnpqrsvx:")) != EOF) {
     switch (c) {
       case 'A': do_acls      = 1;                         continue;
       case 'H': do_headers   = 1;                         continue;
+      case 'I': index_path   = optarg;                    continue;
+      case 'K': error_every  = atoi(optarg);              continue;
+      case 'S': sparse       = 1;                         continue;
+      case 'T': tarmode      = 1;                         continue;
+      case 'X': add_pattern(optarg, PSEL_REGEX | PSEL_EXCLUDE); continue;
+      case 'e': add_pattern(optarg, PSEL_REGEX);          continue;
+      case 'g': add_pattern(optarg, PSEL_GLOB);           continue;
       case 'i': use_vnum     = 1;                         continue;
+      case 'j': nworkers     = atoi(optarg);              continue;
+      case 'k': error_keep   = atoi(optarg);              continue;
+      case 'm': do_meta      = 1;                         continue;
       case 'n': nomode       = 1;                         continue;
       case 'p': use_realpath = 1;                         continue;
       case 'q': quiet        = 1;                         continue;
       case 'r': rawmode = use_vnum = 1;                   continue;
+      case 's': streaming    = 1;                         continue;
       case 'v': verbose      = 1;                         continue;
+      case 'x': add_pattern(optarg, PSEL_GLOB | PSEL_EXCLUDE); continue;
       case 'h': usage(0, 0);
       default:  usage(1, "Invalid option!");
     }
   }
 
   if (quiet && verbose) usage(1, "Can't specify both -q and -v");
+  if (error_every && error_keep < 0) usage(1, "-K requires -k");
+
+  if (tarmode && rawmode) usage(1, "Can't specify both -T and -r");
+  if (tarmode) streaming = 1, sparse = 0;
 
   /* Parse non-option arguments */
   if (argc - optind < 1) usage(1, "Dumpfile name required!");
   input_path = argv[optind];
 
-  if (argc - optind < 2) target = ".";
-  target = argv[optind + 1];
+  /* With -T, there is no destination */
+  nfixed = tarmode ? 1 : 2;
+  if (tarmode) target = 0;
+  else if (argc - optind < 2) target = ".";
+  else target = argv[optind + 1];
 
   vnum_count = name_count = 0;
-  if (argc - optind < 3) extract_all = 1;
+  if (argc - optind <= nfixed) extract_all = !pattern_count;
   else {
-    argv += optind + 2;
-    argc -= optind + 2;
+    argv += optind + nfixed;
+    argc -= optind + nfixed;
     for (i = 0; i < argc; i++) {
       if (argv[i][0] == '/') name_count++;
       else                   vnum_count++;
@@ -145,8 +228,21 @@ static void parse_options(int argc, char **argv)
 
     i_name = i_vnum = 0;
     for (i = 0; i < argc; i++) {
-      if (argv[i][0] == '/') file_names[i_name++] = argv[i];
-      else                   file_vnums[i_vnum++] = strtol(argv[i], 0, 0);
+      if (argv[i][0] == '/' && strpbrk(argv[i], "*?[")) {
+        add_pattern(argv[i], PSEL_GLOB);
+        name_count--;
+        continue;
+      } else if (argv[i][0] == '/') {
+        file_names[i_name++] = argv[i];
+        r = PathSel_AddPath(sel, argv[i]);
+      } else {
+        file_vnums[i_vnum] = strtol(argv[i], 0, 0);
+        r = PathSel_AddVnode(sel, file_vnums[i_vnum++]);
+      }
+      if (r) {
+        com_err(argv0, r, "selecting %s", argv[i]);
+        exit(1);
+      }
     }
     file_names[i_name] = 0;
     file_vnums[i_vnum] = 0;
@@ -227,42 +323,88 @@ static char *datestr(time_t date)
  */
 static int usevnode(XFILE *X, afs_uint32 vnum, char *vnodepath)
 {
-  int vl, vpl, r, i;
-
   if (extract_all) return 1;
+  return PathSel_Match(sel, vnum, vnodepath);
+}
 
-  for (i = 0; i < vnum_count; i++)
-    if (vnum == file_vnums[i]) return 2;
 
-  if (!vnodepath) return 0;
+/* Can we pass over this vnode without even finding its path?
+ * True if it is in a directory that wasn't used.
+ */
+static int skipvnode(afs_vnode *v)
+{
+  if (extract_all || use_vnum || !(v->field_mask & F_VNODE_PARENT))
+    return 0;
+  /* It may have another name somewhere that is used */
+  if (v->type == vFile && (v->field_mask & F_VNODE_NLINKS) && v->nlinks > 1)
+    return 0;
+  return PathSel_Skip(sel, v->vnode, v->parent);
+}
 
-  /* Special case */
-  if (!strcmp(vnodepath, "/"))
-    return 1;
 
-  vl = strlen(vnodepath);
-/*fprintf(stderr, "++ checking %s\n", vnodepath);*/
-  for (i = 0; i < name_count; i++) {
-    vpl = strlen(file_names[i]);
-/*  fprintf(stderr, "   %s\n", file_names[i]);*/
+/* Check whether a block is all zeros */
+static int all_zero(char *buf, afs_uint32 len)
+{
+#ifdef __SSE2__
+  __m128i zero = _mm_setzero_si128();
 
-    if (vl > vpl) {
-      r = !strncmp(file_names[i], vnodepath, vpl) && vnodepath[vpl] == '/';
-    } else if (vl < vpl) {
-      r = !strncmp(file_names[i], vnodepath, vl) && file_names[i][vl] == '/';
-    } else {
-      r = !strcmp(file_names[i], vnodepath);
+  for (; len >= 16; buf += 16, len -= 16)
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(
+          _mm_loadu_si128((__m128i *)buf), zero)) != 0xffff)
+      return 0;
+#endif
+  while (len--)
+    if (*buf++) return 0;
+  return 1;
+}
+
+
+/* Write file data.  In sparse mode (-S), runs of zero blocks are
+ * skipped over instead of written, leaving holes in the output file;
+ * *hole is set if what has been written so far ends in one.
+ */
+static afs_uint32 write_data(XFILE *out, char *buf, afs_uint32 len, int *hole)
+{
+  afs_uint32 n, step, r;
+  int zero, z;
+
+  if (!sparse) return xfwrite(out, buf, len);
+  while (len) {
+    /* Find a run of blocks that are all zero, or all not */
+    for (zero = -1, n = 0; n < len; n += step) {
+      step = (len - n > SPARSEBLOCK) ? SPARSEBLOCK : len - n;
+      z = all_zero(buf + n, step);
+      if (zero < 0) zero = z;
+      else if (z != zero) break;
     }
-    if (r) return 1;
+    if (r = zero ? xfskip(out, n) : xfwrite(out, buf, n)) return r;
+    *hole = zero;
+    buf += n;
+    len -= n;
   }
   return 0;
 }
 
 
-static int copyfile(XFILE *in, XFILE *out, u_int64 size)
+/* Finish a sparse file.  If it ends in a hole, the file isn't that long
+ * yet, so write its last byte.
+ */
+static afs_uint32 end_data(XFILE *out, int hole)
 {
-  static char buf[COPYBUFSIZE];
-  int nr, r;
+  u_int64 where, tmp64;
+  afs_uint32 r;
+
+  if (!hole) return 0;
+  if (r = xftell(out, &where)) return r;
+  sub64_32(tmp64, where, 1);
+  if (r = xfseek(out, &tmp64)) return r;
+  return xfwrite(out, "", 1);
+}
+
+
+static int copyfile(XFILE *in, XFILE *out, u_int64 size, char *buf)
+{
+  int nr, r, hole = 0;
   u_int64 zero64, bufsize64, tmp64;
   mk64(zero64, 0, 0);
   mk64(bufsize64, 0, COPYBUFSIZE);
@@ -270,25 +412,30 @@ static int copyfile(XFILE *in, XFILE *out, u_int64 size)
   while (ne64(size, zero64)) {
     nr = (gt64(size, bufsize64)) ? COPYBUFSIZE : get64(size);
     if (r = xfread(in, buf, nr)) return r;
-    if (r = xfwrite(out, buf, nr)) return r;
+    if (r = write_data(out, buf, nr, &hole)) return r;
     sub64_32(tmp64, size, nr);
     cp64(size, tmp64);
   }
-  return 0;
+  return end_data(out, hole);
 }
 
 
-/* A callback to count and print errors */
+/* A callback to count and print errors.  With -j, copy workers report
+ * errors too, so this is serialized.
+ */
 static afs_uint32 my_error_cb(afs_uint32 code, int fatal, void *ref, char *msg, ...)
 {
+  static pthread_mutex_t error_lock = PTHREAD_MUTEX_INITIALIZER;
   va_list alist;
 
+  pthread_mutex_lock(&error_lock);
   error_count++;
   if (!quiet) {
     va_start(alist, msg);
     com_err_va(argv0, code, msg, alist);
     va_end(alist);
   }
+  pthread_mutex_unlock(&error_lock);
   return 0;
 }
 
@@ -305,24 +452,773 @@ static afs_uint32 volhdr_cb(afs_vol_header *hdr, XFILE *X, void *refcon)
 }
 
 
+/* Parallel extraction (-j).  The parser queues each file to be copied,
+ * and a pool of workers copies them, each with its own handle on the
+ * dump.  Directories are still made by the parser, and dumps list them
+ * before any files, so each file's directory exists before it is queued.
+ * The parser has already saved each file's links and metadata by the
+ * time it is copied, so files that fail (or are abandoned after a
+ * failure) are remembered, and those are skipped.
+ */
+typedef struct {
+  u_int64 offset, size;
+  char *path;
+} copy_job;
+
+typedef struct {
+  pthread_t tid;
+  XFILE X;                   /* This worker's handle on the dump */
+} copy_worker_info;
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t work_cv;    /* Signalled when a job is queued */
+  pthread_cond_t space_cv;   /* Signalled when a job is taken */
+  copy_job jobs[MAXJOBS];
+  int head, count;
+  int done;                  /* No more jobs are coming */
+  afs_uint32 error;          /* First error; stops the parser */
+  int nthreads;
+  copy_worker_info *workers;
+  char **failed;             /* Paths not copied; sorted once finished */
+  afs_uint32 n_failed, max_failed;
+} pool;
+
+
+/* Remember a path that wasn't copied.  Takes over path; the caller
+ * must hold pool.lock if workers are running.
+ */
+static void copy_failed(char *path)
+{
+  char **f;
+
+  if (pool.n_failed == pool.max_failed) {
+    pool.max_failed = pool.max_failed ? pool.max_failed * 2 : 16;
+    f = (char **)realloc(pool.failed, pool.max_failed * sizeof(char *));
+    if (!f) {
+      free(path);
+      return;
+    }
+    pool.failed = f;
+  }
+  pool.failed[pool.n_failed++] = path;
+}
+
+
+static int cmp_paths(const void *a, const void *b)
+{
+  return strcmp(*(char **)a, *(char **)b);
+}
+
+
+/* Was a file copied, or at least not known to have failed? */
+static int was_copied(char *path)
+{
+  if (!pool.n_failed) return 1;
+  return !bsearch(&path, pool.failed, pool.n_failed, sizeof(char *),
+                  cmp_paths);
+}
+
+
+static void free_failed(void)
+{
+  while (pool.n_failed) free(pool.failed[--pool.n_failed]);
+  if (pool.failed) free(pool.failed);
+  pool.failed = 0;
+  pool.max_failed = 0;
+}
+
+
+static void *copy_worker(void *arg)
+{
+  copy_worker_info *w = (copy_worker_info *)arg;
+  copy_job job;
+  XFILE OX;
+  char *buf;
+  afs_uint32 r;
+
+  if (!(buf = (char *)malloc(COPYBUFSIZE))) {
+    pthread_mutex_lock(&pool.lock);
+    if (!pool.error) pool.error = ENOMEM;
+    pthread_cond_broadcast(&pool.space_cv);
+    pthread_mutex_unlock(&pool.lock);
+    return 0;
+  }
+
+  for (;;) {
+    pthread_mutex_lock(&pool.lock);
+    while (!pool.count && !pool.done && !pool.error)
+      pthread_cond_wait(&pool.work_cv, &pool.lock);
+    if (!pool.count || pool.error) {
+      pthread_mutex_unlock(&pool.lock);
+      break;
+    }
+    job = pool.jobs[pool.head];
+    pool.head = (pool.head + 1) % MAXJOBS;
+    pool.count--;
+    pthread_cond_signal(&pool.space_cv);
+    pthread_mutex_unlock(&pool.lock);
+
+    if (!(r = xfseek(&w->X, &job.offset))
+    &&  !(r = xfopen_path(&OX, O_RDWR|O_CREAT|O_TRUNC, job.path, 0644))) {
+      r = copyfile(&w->X, &OX, job.size, buf);
+      if (r) xfclose(&OX);
+      else r = xfclose(&OX);
+    }
+    if (r) {
+      my_error_cb(r, 1, 0, "extracting /%s", job.path);
+      pthread_mutex_lock(&pool.lock);
+      if (!pool.error) pool.error = r;
+      copy_failed(job.path);
+      pthread_cond_broadcast(&pool.space_cv);
+      pthread_mutex_unlock(&pool.lock);
+    } else {
+      free(job.path);
+    }
+  }
+  free(buf);
+  return 0;
+}
+
+
+/* Start the workers.  Their handles on the dump are opened here, before
+ * we chdir into the target directory, in case input_path is relative.
+ */
+static afs_uint32 start_workers(void)
+{
+  copy_worker_info *w;
+  afs_uint32 r = 0;
+  int i;
+
+  pool.workers = (copy_worker_info *)malloc(nworkers * sizeof(*pool.workers));
+  if (!pool.workers) return ENOMEM;
+  pthread_mutex_init(&pool.lock, 0);
+  pthread_cond_init(&pool.work_cv, 0);
+  pthread_cond_init(&pool.space_cv, 0);
+  for (i = 0; i < nworkers; i++) {
+    w = pool.workers + pool.nthreads;
+    if (r = xfopen(&w->X, O_RDONLY, input_path)) break;
+    if (r = pthread_create(&w->tid, 0, copy_worker, w)) {
+      xfclose(&w->X);
+      break;
+    }
+    pool.nthreads++;
+  }
+  return pool.nthreads ? 0 : r;
+}
+
+
+/* Wait for the workers to finish everything queued */
+static afs_uint32 finish_workers(void)
+{
+  int i;
+
+  pthread_mutex_lock(&pool.lock);
+  pool.done = 1;
+  pthread_cond_broadcast(&pool.work_cv);
+  pthread_mutex_unlock(&pool.lock);
+  for (i = 0; i < pool.nthreads; i++) {
+    pthread_join(pool.workers[i].tid, 0);
+    xfclose(&pool.workers[i].X);
+  }
+
+  /* Anything left was abandoned because of an error */
+  while (pool.count) {
+    copy_failed(pool.jobs[pool.head].path);
+    pool.head = (pool.head + 1) % MAXJOBS;
+    pool.count--;
+  }
+  if (pool.n_failed)
+    qsort(pool.failed, pool.n_failed, sizeof(char *), cmp_paths);
+  free(pool.workers);
+  pool.nthreads = 0;
+  pthread_cond_destroy(&pool.work_cv);
+  pthread_cond_destroy(&pool.space_cv);
+  pthread_mutex_destroy(&pool.lock);
+  return pool.error;
+}
+
+
+static afs_uint32 queue_copy(afs_vnode *v, char *path)
+{
+  copy_job *job;
+  afs_uint32 r;
+  char *copy;
+
+  if (!(copy = (char *)malloc(strlen(path) + 1))) return ENOMEM;
+  strcpy(copy, path);
+  pthread_mutex_lock(&pool.lock);
+  while (pool.count == MAXJOBS && !pool.error)
+    pthread_cond_wait(&pool.space_cv, &pool.lock);
+  if (r = pool.error) {
+    pthread_mutex_unlock(&pool.lock);
+    free(copy);
+    return r;
+  }
+  job = pool.jobs + (pool.head + pool.count) % MAXJOBS;
+  cp64(job->offset, v->d_offset);
+  cp64(job->size, v->size);
+  job->path = copy;
+  pool.count++;
+  pthread_cond_signal(&pool.work_cv);
+  pthread_mutex_unlock(&pool.lock);
+  return 0;
+}
+
+
+/* Metadata restore (-m).  Setting modes, owners and times as each file
+ * is made would mean setting them before -j workers have written the
+ * data, and changing a directory's mode or times before everything in
+ * it is made.  So they are saved up and done in batches at the end:
+ * everything but directories first, then directories from the bottom
+ * up.  Each batch is shared out among the -j workers.
+ */
+typedef struct {
+  char *path;
+  afs_uint32 field_mask;
+  afs_uint32 mode, owner, group, date;
+  int depth;                 /* Directory depth (root is 0); -1 if not a dir */
+  int is_link;
+  int lazy;                  /* Skip it if it was never made */
+} meta_entry;
+
+static meta_entry *meta;
+static afs_uint32 meta_count, meta_max;
+
+static struct {
+  pthread_mutex_t lock;
+  meta_entry *next, *end;
+} batch;
+
+
+/* Remember the metadata of something just extracted */
+static afs_uint32 add_meta(afs_vnode *v, char *path)
+{
+  meta_entry *m;
+  char *x;
+
+  if (!do_meta || nomode || rawmode || tarmode) return 0;
+  if (meta_count == meta_max) {
+    meta_max = meta_max ? meta_max * 2 : 1024;
+    if (!(m = (meta_entry *)realloc(meta, meta_max * sizeof(meta_entry))))
+      return ENOMEM;
+    meta = m;
+  }
+  m = meta + meta_count;
+  if (!*path) path = ".";
+  if (!(m->path = (char *)malloc(strlen(path) + 1))) return ENOMEM;
+  strcpy(m->path, path);
+  m->field_mask = v->field_mask;
+  m->mode  = v->mode;
+  m->owner = v->owner;
+  m->group = v->group;
+  m->date  = v->client_date;
+  m->is_link = (v->type == vSymlink);
+  m->lazy = 0;
+  m->depth = -1;
+  if (v->type == vDirectory && !strcmp(m->path, "."))
+    m->depth = 0;
+  else if (v->type == vDirectory)
+    for (m->depth = 1, x = m->path; *x; x++)
+      if (*x == '/') m->depth++;
+  meta_count++;
+  return 0;
+}
+
+
+/* Same, for a directory that is only made if something is put in it */
+static afs_uint32 add_lazy_meta(afs_vnode *v, char *path)
+{
+  afs_uint32 n = meta_count, r;
+
+  if (!(r = add_meta(v, path)) && meta_count > n) meta[n].lazy = 1;
+  return r;
+}
+
+
+static void set_meta(meta_entry *m)
+{
+  struct timespec ts[2];
+  struct stat statbuf;
+  uid_t uid = -1;
+  gid_t gid = -1;
+
+  if (m->lazy && lstat(m->path, &statbuf)) return;
+  if (!was_copied(m->path)) return;
+  if (!geteuid()) {
+    if (m->field_mask & F_VNODE_OWNER) uid = m->owner;
+    if (m->field_mask & F_VNODE_GROUP) gid = m->group;
+    if ((uid != (uid_t)-1 || gid != (gid_t)-1) && lchown(m->path, uid, gid))
+      my_error_cb(errno, 0, 0, "setting owner of /%s", m->path);
+  }
+  if ((m->field_mask & F_VNODE_MODE) && !m->is_link
+  &&  chmod(m->path, m->mode & 07777))
+    my_error_cb(errno, 0, 0, "setting mode of /%s", m->path);
+  if (m->field_mask & F_VNODE_CDATE) {
+    ts[0].tv_sec  = ts[1].tv_sec  = m->date;
+    ts[0].tv_nsec = ts[1].tv_nsec = 0;
+    if (utimensat(AT_FDCWD, m->path, ts, AT_SYMLINK_NOFOLLOW))
+      my_error_cb(errno, 0, 0, "setting times of /%s", m->path);
+  }
+}
+
+
+static void *meta_worker(void *arg)
+{
+  meta_entry *m, *end;
+
+  for (;;) {
+    pthread_mutex_lock(&batch.lock);
+    m = batch.next;
+    end = (batch.end - m > METABATCH) ? m + METABATCH : batch.end;
+    batch.next = end;
+    pthread_mutex_unlock(&batch.lock);
+    if (m == end) return 0;
+    for (; m < end; m++) set_meta(m);
+  }
+}
+
+
+/* Apply metadata to n entries, using up to nworkers threads */
+static void apply_batch(meta_entry *m, afs_uint32 n)
+{
+  pthread_t *tids;
+  int i, nt;
+
+  batch.next = m;
+  batch.end = m + n;
+  nt = (n + METABATCH - 1) / METABATCH;
+  if (nt > nworkers) nt = nworkers;
+  if (nt < 2 || !(tids = (pthread_t *)malloc((nt - 1) * sizeof(pthread_t)))) {
+    meta_worker(0);
+    return;
+  }
+  for (i = 0; i < nt - 1; i++)
+    if (pthread_create(&tids[i], 0, meta_worker, 0)) break;
+  meta_worker(0);
+  while (i--) pthread_join(tids[i], 0);
+  free(tids);
+}
+
+
+/* Non-directories first, then directories deepest first */
+static int cmp_meta(const void *a, const void *b)
+{
+  const meta_entry *x = (const meta_entry *)a, *y = (const meta_entry *)b;
+
+  if ((x->depth < 0) != (y->depth < 0)) return (x->depth < 0) ? -1 : 1;
+  return y->depth - x->depth;
+}
+
+
+static void restore_meta(void)
+{
+  afs_uint32 i, j;
+
+  if (!meta_count) return;
+  if (verbose) printf("* Restoring modes, owners and times...\n");
+  qsort(meta, meta_count, sizeof(meta_entry), cmp_meta);
+  pthread_mutex_init(&batch.lock, 0);
+  for (i = 0; i < meta_count; i = j) {
+    for (j = i + 1; j < meta_count && meta[j].depth == meta[i].depth; j++);
+    apply_batch(meta + i, j - i);
+  }
+  pthread_mutex_destroy(&batch.lock);
+  for (i = 0; i < meta_count; i++) free(meta[i].path);
+  free(meta);
+  meta = 0;
+  meta_count = meta_max = 0;
+}
+
+
 static afs_uint32 do_extract(afs_vnode *v, XFILE *X, char *vnodepath)
 {
+  static char buf[COPYBUFSIZE];
   u_int64 where;
   XFILE OX;
   int r;
 
+  if (pool.nthreads) return queue_copy(v, vnodepath + 1);
   if ((r = xftell(X, &where))
       ||  (r = xfseek(X, &v->d_offset))
       ||  (r = xfopen_path(&OX, O_RDWR|O_CREAT|O_TRUNC, vnodepath + 1, 0644))) {
     return r;
   }
-  r = copyfile(X, &OX, v->size);
+  r = copyfile(X, &OX, v->size, buf);
   xfclose(&OX);
   xfseek(X, &where);
   return r;
 }
 
 
+static void print_file(afs_vnode *v, char *vnodepath)
+{
+  if (verbose) {
+    printf("-%s %3d %-11d %11d %s %s\n",
+           modestr(v->mode), v->nlinks, v->owner, lo64(v->size),
+           datestr(v->server_date), vnodepath);
+  } else if (!quiet) {
+    printf("%s\n", vnodepath);
+  }
+}
+
+
+/* Files with more than one name.  Each is extracted once, and its other
+ * names are made hard links to it.  On disk, the links are made after
+ * everything else has been extracted, so -j workers have made the files
+ * by then; with -T, they go in the archive right after the file.
+ */
+typedef struct {
+  char *target, *path;
+} pending_link;
+
+static pending_link *pending;
+static afs_uint32 pending_count, pending_max;
+
+
+static void free_names(char **names, int n)
+{
+  while (n--) free(names[n]);
+  if (names) free(names);
+}
+
+
+/* Find the other names of a file that are to be extracted, and return
+ * them in *others.  If *path isn't to be used (*use is 0) but another
+ * name is, that one takes its place.
+ */
+static afs_uint32 link_names(afs_vnode *v, XFILE *X, char **path, int *use,
+                             char ***others, int *n_others)
+{
+  char **names;
+  afs_uint32 r;
+  int i, n, k;
+
+  *others = 0;
+  *n_others = 0;
+  if (use_vnum || *use == 2 || v->type != vFile
+  ||  !(v->field_mask & F_VNODE_NLINKS) || v->nlinks < 2)
+    return 0;
+  if (r = Path_BuildLinks(X, &phi, v->vnode, &names, &n, !use_realpath))
+    return r;
+
+  for (i = k = 0; i < n; i++) {
+    if (!strcmp(names[i], *path) || !usevnode(X, v->vnode, names[i])) {
+      free(names[i]);
+    } else if (!*use) {
+      free(*path);
+      *path = names[i];
+      *use = 1;
+    } else {
+      names[k++] = names[i];
+    }
+  }
+  if (k) {
+    *others = names;
+    *n_others = k;
+  } else {
+    free(names);
+  }
+  return 0;
+}
+
+
+/* Make a file's other names into links to it.  Frees the names. */
+static afs_uint32 add_links(afs_vnode *v, char *path, char **others, int n)
+{
+  pending_link *pl;
+  afs_uint32 r = 0;
+  int i;
+
+  for (i = 0; i < n && !r; i++) {
+    print_file(v, others[i]);
+    if (nomode) continue;
+    if (tarmode) {
+      r = Tar_Header(&tar_out, v, others[i] + 1, path + 1);
+      continue;
+    }
+    if (pending_count == pending_max) {
+      pending_max = pending_max ? pending_max * 2 : 64;
+      pl = (pending_link *)realloc(pending, pending_max * sizeof(pending_link));
+      if (!pl) {
+        r = ENOMEM;
+        break;
+      }
+      pending = pl;
+    }
+    pl = pending + pending_count;
+    if (!(pl->target = (char *)malloc(strlen(path) + 1))) {
+      r = ENOMEM;
+      break;
+    }
+    strcpy(pl->target, path);
+    pl->path = others[i];
+    others[i] = 0;
+    pending_count++;
+  }
+  free_names(others, n);
+  return r;
+}
+
+
+static void make_links(void)
+{
+  pending_link *pl;
+  char *x;
+  int r;
+
+  for (pl = pending; pl < pending + pending_count; pl++) {
+    /* Nothing to link to; that was already reported */
+    if (!was_copied(pl->target + 1)) {
+      free(pl->target);
+      free(pl->path);
+      continue;
+    }
+    /* Its directory may not have been extracted */
+    r = 0;
+    if ((x = strrchr(pl->path, '/')) && x != pl->path) {
+      *x = 0;
+      r = mkdirp(pl->path + 1);
+      *x = '/';
+    }
+    /* Replace anything already there, as extracting a file would */
+    if (!r && link(pl->target + 1, pl->path + 1)) {
+      r = errno;
+      if (r == EEXIST && !unlink(pl->path + 1)
+      &&  !link(pl->target + 1, pl->path + 1))
+        r = 0;
+    }
+    if (r) my_error_cb(r, 0, 0, "linking %s to %s", pl->path, pl->target);
+    free(pl->target);
+    free(pl->path);
+  }
+  if (pending) free(pending);
+  pending = 0;
+  pending_count = pending_max = 0;
+}
+
+
+/* One-pass extraction, for dumps that can't be prescanned.  Pathname
+ * info is collected from directories as they go by, and file data is
+ * written out by stream_chunk_cb as the parser reads it.  Dumps normally
+ * have every directory before any file, so paths are nearly always known
+ * by the time they are needed; a vnode whose path isn't known yet is
+ * parked (with its data in a temporary file) and put in place at the end.
+ */
+typedef struct parked_vnode {
+  struct parked_vnode *next;
+  afs_vnode v;
+  char *link_target;
+  char tmpname[40];
+  FILE *tmp;                 /* With -T, where its data is kept instead */
+} parked_vnode;
+
+static parked_vnode *parked;
+static int placing, parked_dirs;
+static int lazy_dirs;        /* Directories left for make_parent to make */
+
+/* The file whose data is arriving */
+static struct {
+  afs_uint32 vnode;
+  char *path;
+  char vnpx[30];
+  int use, open, parked, hole;
+  FILE *tmp;
+  char **others;             /* Its other names; see link_names */
+  int n_others;
+  XFILE OX;
+} cur;
+
+
+/* Build a path without complaining if it can't be done yet */
+static afs_uint32 stream_path(afs_uint32 vnode, char **path)
+{
+  dump_parser quiet_p, *p = phi.p;
+  afs_uint32 r;
+
+  memset(&quiet_p, 0, sizeof(quiet_p));
+  phi.p = &quiet_p;
+  r = Path_Build(&input_file, &phi, vnode, path, !use_realpath);
+  phi.p = p;
+  return r;
+}
+
+
+static afs_uint32 park_vnode(afs_vnode *v, char *tmpname, FILE *tmp)
+{
+  parked_vnode *pv;
+
+  if (!(pv = (parked_vnode *)calloc(1, sizeof(parked_vnode))))
+    return ENOMEM;
+  pv->v = *v;
+  pv->v.link_target = 0;
+  pv->v.data = 0;
+  if (v->field_mask & F_VNODE_LINK_TARGET) {
+    if (!(pv->link_target = (char *)malloc(strlen(v->link_target) + 1))) {
+      free(pv);
+      return ENOMEM;
+    }
+    strcpy(pv->link_target, v->link_target);
+  }
+  if (tmpname) strcpy(pv->tmpname, tmpname);
+  pv->tmp = tmp;
+  pv->next = parked;
+  parked = pv;
+  if (v->type == vDirectory) parked_dirs++;
+  if (verbose) printf("* Vnode %d comes before its directory\n", v->vnode);
+  return 0;
+}
+
+
+/* Make the directory a vnode goes in.  This is only needed when its
+ * directory was parked, or only might have led to something selected,
+ * and so hasn't been made yet.
+ */
+static afs_uint32 make_parent(char *vnodepath)
+{
+  char *x;
+  int r;
+
+  if (tarmode || (!parked_dirs && !lazy_dirs)
+  ||  !(x = strrchr(vnodepath, '/')) || x == vnodepath)
+    return 0;
+  *x = 0;
+  r = mkdirp(vnodepath + 1);
+  *x = '/';
+  return r;
+}
+
+
+/* Get the path of a vnode.  When streaming, a vnode whose path can't be
+ * known yet is parked and *path is left null.  *path is also left null
+ * for a vnode in a directory that wasn't used.
+ */
+static afs_uint32 get_path(afs_vnode *v, XFILE *X, char **path)
+{
+  *path = 0;
+  if (skipvnode(v)) return 0;
+  if (!streaming || placing)
+    return Path_Build(X, &phi, v->vnode, path, !use_realpath);
+  if (!stream_path(v->vnode, path)) return 0;
+  *path = 0;
+  return park_vnode(v, 0, 0);
+}
+
+
+static afs_uint32 stream_volhdr_cb(afs_vol_header *hdr, XFILE *X, void *refcon)
+{
+  if (use_vnum || phi.dense_max) return 0;
+  return Path_Init(&phi, (hdr->field_mask & F_VOLHDR_NFILES) ? hdr->nfiles : 0);
+}
+
+
+/* Decide where a file's data goes, and open it */
+static afs_uint32 stream_start(afs_vnode *v)
+{
+  char *target;
+  afs_uint32 r;
+
+  if (cur.path) free(cur.path);
+  memset(&cur, 0, sizeof(cur));
+  cur.vnode = v->vnode;
+  sprintf(cur.vnpx, "#%d:%d", v->vnode, v->vuniq);
+
+  if (use_vnum) {
+    if (!(cur.use = usevnode(&input_file, v->vnode, 0))) return 0;
+    target = cur.vnpx + 1;
+  } else if (skipvnode(v)) {
+    return 0;
+  } else if (stream_path(v->vnode, &cur.path)) {
+    /* Hold onto it until we know where it goes */
+    cur.path = 0;
+    cur.use = cur.parked = 1;
+    sprintf(cur.vnpx, ".park.%d.%d", v->vnode, v->vuniq);
+    target = cur.vnpx;
+  } else {
+    cur.use = usevnode(&input_file, v->vnode, cur.path);
+    if (r = link_names(v, &input_file, &cur.path, &cur.use,
+                       &cur.others, &cur.n_others))
+      return r;
+    if (!cur.use) return 0;
+    if (cur.use == 2) {
+      target = cur.vnpx + 1;
+    } else {
+      target = cur.path + 1;
+      if (!nomode && (r = make_parent(cur.path))) return r;
+    }
+  }
+
+  if (nomode) return 0;
+  if (tarmode && cur.parked) {
+    /* There's nowhere to put it yet */
+    if (!(cur.tmp = tmpfile())) return errno;
+    xfopen_FILE(&cur.OX, O_RDWR, cur.tmp);
+  } else if (tarmode) {
+    if (r = Tar_Header(&tar_out, v, target, 0)) return r;
+  } else if (r = xfopen_path(&cur.OX, O_RDWR|O_CREAT|O_TRUNC, target, 0644)) {
+    return r;
+  }
+  cur.open = 1;
+  return 0;
+}
+
+
+/* A callback to write out file data as it goes by */
+static afs_uint32 stream_chunk_cb(afs_vnode *v, char *buf, afs_uint32 len,
+                                  u_int64 *offset, int last, void *refcon)
+{
+  afs_uint32 r = 0;
+
+  if (!rawmode && (!(v->field_mask & F_VNODE_TYPE) || v->type != vFile))
+    return 0;
+  if (zero64(*offset) && (r = stream_start(v))) return r;
+  if (!cur.open || cur.vnode != v->vnode) return 0;
+  if (tarmode && !cur.parked) {
+    if (len) r = xfwrite(&tar_out, buf, len);
+    if (!r && last) r = Tar_Pad(&tar_out, &v->size);
+    if (r || last) cur.open = 0;
+    return r;
+  }
+  if (len) r = write_data(&cur.OX, buf, len, &cur.hole);
+  if (!r && last) r = end_data(&cur.OX, cur.hole);
+  if (r || last) {
+    cur.open = 0;
+    if (cur.tmp && !r) return 0;   /* Kept until it is placed */
+    cur.tmp = 0;
+    if (r) xfclose(&cur.OX);
+    else r = xfclose(&cur.OX);
+  }
+  return r;
+}
+
+
+static afs_uint32 stream_file_cb(afs_vnode *v, XFILE *X)
+{
+  char *vnodepath;
+  u_int64 zero;
+  afs_uint32 r;
+
+  /* No data went by, so make an empty file */
+  if (cur.vnode != v->vnode) {
+    mk64(zero, 0, 0);
+    if (r = stream_chunk_cb(v, 0, 0, &zero, 1, 0)) return r;
+  }
+  cur.vnode = 0;
+
+  if (cur.parked) return park_vnode(v, cur.vnpx, cur.tmp);
+  if (!cur.use) return 0;
+  vnodepath = (use_vnum || cur.use == 2) ? cur.vnpx : cur.path;
+  print_file(v, vnodepath);
+  if (r = add_meta(v, vnodepath + 1))
+    free_names(cur.others, cur.n_others);
+  else
+    r = add_links(v, vnodepath, cur.others, cur.n_others);
+  cur.others = 0;
+  cur.n_others = 0;
+  return r;
+}
+
+
 static afs_uint32 directory_cb(afs_vnode *v, XFILE *X, void *refcon)
 {
   char *vnodepath = 0;
@@ -330,8 +1226,8 @@ static afs_uint32 directory_cb(afs_vnode *v, XFILE *X, void *refcon)
 
   /* Should we even use this? */
   if (!use_vnum) {
-    if (r = Path_Build(X, &phi, v->vnode, &vnodepath, !use_realpath))
-      return r;
+    if (r = get_path(v, X, &vnodepath)) return r;
+    if (!vnodepath) return 0;
   }
 
   if (!(use = usevnode(X, v->vnode, vnodepath))) {
@@ -339,6 +1235,14 @@ static afs_uint32 directory_cb(afs_vnode *v, XFILE *X, void *refcon)
     return 0;
   }
 
+  /* Not selected itself, so only make it if something is put in it */
+  if (use == 3) {
+    lazy_dirs++;
+    r = add_lazy_meta(v, vnodepath + 1);
+    free(vnodepath);
+    return r;
+  }
+
   /* Print it out */
   if (verbose) {
     if (use_vnum) 
@@ -356,12 +1260,18 @@ static afs_uint32 directory_cb(afs_vnode *v, XFILE *X, void *refcon)
   /* Make the directory, if needed */
   if (!nomode && rawmode) {
     char vnpx[30];
+    if (streaming) return 0;   /* stream_chunk_cb has the contents */
     sprintf(vnpx, "#%d:%d", v->vnode, v->vuniq);
     if ((r = do_extract(v, X, vnpx)))
       return r;
+  } else if (!nomode && tarmode && !use_vnum && use != 2) {
+    if (r = Tar_Header(&tar_out, v, vnodepath[1] ? vnodepath + 1 : ".", 0)) {
+      free(vnodepath);
+      return r;
+    }
   } else if (!nomode && !use_vnum && use != 2) {
-    if (strcmp(vnodepath, "/")
-      && (r = mkdirp(vnodepath + 1))) {
+    if ((strcmp(vnodepath, "/") && (r = mkdirp(vnodepath + 1)))
+    ||  (r = add_meta(v, vnodepath + 1))) {
       free(vnodepath);
       return r;
     }
@@ -376,21 +1286,27 @@ static afs_uint32 directory_cb(afs_vnode *v, XFILE *X, void *refcon)
 
 static afs_uint32 file_cb(afs_vnode *v, XFILE *X, void *refcon)
 {
-  char *vnodepath, vnpx[30];
+  char *vnodepath, vnpx[30], **others = 0;
   u_int64 where;
   XFILE OX;
-  int r, use;
+  int r, use, n_others = 0;
 
   if (!dirs_done) {
     dirs_done = 1;
     if (verbose) printf("* Extracting files...\n");
   }
+  if (streaming) return stream_file_cb(v, X);
 
   /* Should we even use this? */
   if (!use_vnum) {
-    if (r = Path_Build(X, &phi, v->vnode, &vnodepath, !use_realpath))
+    if (r = get_path(v, X, &vnodepath)) return r;
+    if (!vnodepath) return 0;
+    use = usevnode(X, v->vnode, vnodepath);
+    if (r = link_names(v, X, &vnodepath, &use, &others, &n_others)) {
+      free(vnodepath);
       return r;
-    if (!(use = usevnode(X, v->vnode, vnodepath))) {
+    }
+    if (!use) {
       free(vnodepath);
       return 0;
     }
@@ -406,18 +1322,13 @@ static afs_uint32 file_cb(afs_vnode *v, XFILE *X, void *refcon)
     vnodepath = vnpx;
   }
 
-  /* Print it out */
-  if (verbose) {
-    printf("-%s %3d %-11d %11d %s %s\n",
-           modestr(v->mode), v->nlinks, v->owner, lo64(v->size),
-           datestr(v->server_date), vnodepath);
-  } else if (!quiet) {
-    printf("%s\n", vnodepath);
-  }
-
+  print_file(v, vnodepath);
   r = 0;
-  if (!nomode)
-    r = do_extract(v, X, vnodepath);
+  if (!nomode && !(r = make_parent(vnodepath))
+  &&  !(r = do_extract(v, X, vnodepath)))
+    r = add_meta(v, vnodepath + 1);
+  if (r) free_names(others, n_others);
+  else r = add_links(v, vnodepath, others, n_others);
 
   if (!use_vnum && use != 2) free(vnodepath);
   return r;
@@ -437,8 +1348,8 @@ static afs_uint32 symlink_cb(afs_vnode *v, XFILE *X, void *refcon)
 
   /* Should we even use this? */
   if (!use_vnum) {
-    if (r = Path_Build(X, &phi, v->vnode, &vnodepath, !use_realpath))
-      return r;
+    if (r = get_path(v, X, &vnodepath)) return r;
+    if (!vnodepath) return 0;
     if (!(use = usevnode(X, v->vnode, vnodepath))) {
       free(vnodepath);
       return 0;
@@ -459,15 +1370,19 @@ static afs_uint32 symlink_cb(afs_vnode *v, XFILE *X, void *refcon)
     if (!use_vnum && use != 2) free(vnodepath);
     return DSERR_MEM;
   }
-  if ((r = xftell(X, &where))
-  ||  (r = xfseek(X, &v->d_offset))
-  ||  (r = xfread(X, linktarget, get64(v->size)))) {
+  if (v->field_mask & F_VNODE_LINK_TARGET) {
+    /* The parser already read it */
+    strcpy(linktarget, v->link_target);
+  } else if ((r = xftell(X, &where))
+         ||  (r = xfseek(X, &v->d_offset))
+         ||  (r = xfread(X, linktarget, get64(v->size)))) {
     if (!use_vnum && use != 2) free(vnodepath);
     free(linktarget);
     return r;
+  } else {
+    xfseek(X, &where);
+    linktarget[get64(v->size)] = 0;
   }
-  xfseek(X, &where);
-  linktarget[get64(v->size)] = 0;
 
   /* Print it out */
   if (verbose)
@@ -479,10 +1394,14 @@ static afs_uint32 symlink_cb(afs_vnode *v, XFILE *X, void *refcon)
 
   r = 0;
   if (!nomode) {
-    if (rawmode)
-      r = do_extract(v, X, vnodepath);
-    else if (symlink(linktarget, vnodepath + 1))
-      r = errno;
+    if (rawmode) {
+      if (!streaming) r = do_extract(v, X, vnodepath);
+    } else if (tarmode) {
+      r = Tar_Header(&tar_out, v, vnodepath + 1, linktarget);
+    } else if (use == 2 || !(r = make_parent(vnodepath))) {
+      if (symlink(linktarget, vnodepath + 1)) r = errno;
+      else r = add_meta(v, vnodepath + 1);
+    }
   }
 
   free(linktarget);
@@ -502,12 +1421,324 @@ static afs_uint32 lose_cb(afs_vnode *v, XFILE *F, void *refcon)
 }
 
 
+/* Throw away a parked file's data */
+static void drop_parked(parked_vnode *pv)
+{
+  if (pv->tmp) fclose(pv->tmp);
+  else unlink(pv->tmpname);
+  pv->tmp = 0;
+}
+
+
+/* Add a parked file to the tar archive */
+static afs_uint32 tar_parked(parked_vnode *pv, char *path)
+{
+  static char buf[COPYBUFSIZE];
+  afs_uint32 r;
+  XFILE TX;
+
+  rewind(pv->tmp);
+  xfopen_FILE(&TX, O_RDONLY, pv->tmp);
+  pv->tmp = 0;
+  if (!(r = Tar_Header(&tar_out, &pv->v, path, 0))
+  &&  !(r = copyfile(&TX, &tar_out, pv->v.size, buf)))
+    r = Tar_Pad(&tar_out, &pv->v.size);
+  xfclose(&TX);
+  return r;
+}
+
+
+/* Put parked vnodes in place, now that every directory has been seen.
+ * Directories go first, so there is somewhere to put everything else.
+ */
+static void place_parked(void)
+{
+  parked_vnode *pv, *list = 0;
+  char *vnodepath, **others;
+  int pass, use, n_others;
+  afs_uint32 r;
+
+  /* Back into dump order */
+  while (pv = parked) {
+    parked = pv->next;
+    pv->next = list;
+    list = pv;
+  }
+
+  placing = 1;
+  for (pass = 0; pass < 2; pass++) {
+    for (pv = list; pv; pv = pv->next) {
+      if ((pv->v.type == vDirectory) != !pass) continue;
+      r = 0;
+      switch (pv->v.type) {
+        case vDirectory:
+          r = directory_cb(&pv->v, &input_file, 0);
+          break;
+
+        case vSymlink:
+          if (!pv->link_target) {
+            my_error_cb(DSERR_FMT, 0, 0, "Symlink %d has no target",
+                        pv->v.vnode);
+            break;
+          }
+          pv->v.link_target = pv->link_target;
+          r = symlink_cb(&pv->v, &input_file, 0);
+          break;
+
+        case vFile:
+          if (Path_Build(&input_file, &phi, pv->v.vnode, &vnodepath,
+                         !use_realpath)) {
+            /* Already reported */
+            drop_parked(pv);
+            break;
+          }
+          use = usevnode(&input_file, pv->v.vnode, vnodepath);
+          if (r = link_names(&pv->v, &input_file, &vnodepath, &use,
+                             &others, &n_others)) {
+            drop_parked(pv);
+          } else if (!use) {
+            drop_parked(pv);
+          } else {
+            if (use == 2) {
+              free(vnodepath);
+              sprintf(cur.vnpx, "#%d:%d", pv->v.vnode, pv->v.vuniq);
+              vnodepath = cur.vnpx;
+            }
+            print_file(&pv->v, vnodepath);
+            if (nomode) drop_parked(pv);
+            else if (tarmode) r = tar_parked(pv, vnodepath + 1);
+            else if (!(r = make_parent(vnodepath))) {
+              if (rename(pv->tmpname, vnodepath + 1)) r = errno;
+              else r = add_meta(&pv->v, vnodepath + 1);
+            }
+            if (r) free_names(others, n_others);
+            else r = add_links(&pv->v, vnodepath, others, n_others);
+          }
+          if (use != 2) free(vnodepath);
+          break;
+      }
+      if (r) my_error_cb(r, 0, 0, "extracting vnode %d", pv->v.vnode);
+    }
+  }
+  placing = 0;
+
+  if (cur.path) free(cur.path);
+  cur.path = 0;
+  while (pv = list) {
+    list = pv->next;
+    if (pv->link_target) free(pv->link_target);
+    if (pv->tmp) fclose(pv->tmp);
+    free(pv);
+  }
+}
+
+
+/* Vnodes selected using the index, and where to find them */
+static u_int64 *sel_offsets;
+static afs_uint32 sel_count, sel_max;
+
+static afs_uint32 add_selected(dump_index *di, afs_uint32 vnum)
+{
+  index_vnode iv;
+  u_int64 *x;
+  afs_uint32 r;
+
+  if (r = DumpIndex_Find(di, vnum, &iv)) return r;
+  if (sel_count == sel_max) {
+    sel_max = sel_max ? sel_max * 2 : 64;
+    x = (u_int64 *)realloc(sel_offsets, sel_max * sizeof(u_int64));
+    if (!x) return ENOMEM;
+    sel_offsets = x;
+  }
+  cp64(sel_offsets[sel_count], iv.v_offset);
+  sel_count++;
+  return 0;
+}
+
+
+/* Select a vnode and, if it is a directory, everything under it */
+static afs_uint32 add_subtree(dump_index *di, afs_uint32 vnum)
+{
+  afs_uint32 *queue, head, tail, i, r;
+  index_vnode iv;
+
+  /* A directory can only appear once in a sane tree */
+  if (!(queue = (afs_uint32 *)malloc((di->n_vnodes + 1) * sizeof(afs_uint32))))
+    return ENOMEM;
+  head = tail = 0;
+  queue[tail++] = vnum;
+  while (head < tail) {
+    vnum = queue[head++];
+    if (r = DumpIndex_Find(di, vnum, &iv)) {
+      if (r == ENOENT) continue;
+      free(queue);
+      return r;
+    }
+    if (r = add_selected(di, vnum)) {
+      free(queue);
+      return r;
+    }
+    for (i = 0; i < iv.n_entries && tail <= di->n_vnodes; i++) {
+      if (r = DumpIndex_Entry(di, iv.first_entry + i, 0, &vnum, 0)) {
+        free(queue);
+        return r;
+      }
+      if (vnum & 1) queue[tail++] = vnum;
+      else if (r = add_selected(di, vnum)) {
+        if (r == ENOENT) continue;
+        free(queue);
+        return r;
+      }
+    }
+  }
+  free(queue);
+  return 0;
+}
+
+
+/* Select the vnodes named by a path: the directories leading to it
+ * (so they can be created) and everything under it.  This goes by the
+ * index's directory entries alone, for when there is no pathname info
+ * (with -i); otherwise add_paths does them all at once.
+ */
+static afs_uint32 add_path(dump_index *di, char *path)
+{
+  afs_uint32 vnum = 1, r;
+  char *copy, *name, *x;
+
+  if (!(copy = (char *)malloc(strlen(path) + 1))) return ENOMEM;
+  strcpy(copy, path);
+  for (name = copy; *name; name = x) {
+    while (*name == '/') name++;
+    if (!*name) break;
+    for (x = name; *x && *x != '/'; x++);
+    if (*x) *x++ = 0;
+    if ((r = DumpIndex_Lookup(di, vnum, name, &vnum))
+    ||  (r = add_selected(di, vnum))) {
+      free(copy);
+      return r;
+    }
+  }
+  free(copy);
+  return add_subtree(di, vnum);
+}
+
+
+/* Select the vnodes named by all the paths at once.  Every directory
+ * above each path is followed too, so it gets selected; Path_FollowMany
+ * shares the lookups, so this costs little more than the paths alone.
+ * Paths that can't be followed are reported in verbose mode and skipped.
+ */
+static afs_uint32 add_paths(XFILE *X, dump_index *di)
+{
+  dump_parser quiet_p, *p = phi.p;
+  afs_uint32 *codes, r = 0;
+  vhash_ent *vhe;
+  char **paths, *x;
+  int i, n = 0, max = name_count;
+
+  for (i = 0; i < name_count; i++)
+    for (x = file_names[i] + 1; *x; x++) if (*x == '/') max++;
+  paths = (char **)malloc(max * sizeof(char *));
+  codes = (afs_uint32 *)malloc(max * sizeof(afs_uint32));
+  vhe = (vhash_ent *)malloc(max * sizeof(vhash_ent));
+  if (!paths || !codes || !vhe) {
+    r = ENOMEM;
+    goto out;
+  }
+
+  /* The paths themselves come first, then the directories above them */
+  for (n = 0; n < name_count; n++) paths[n] = file_names[n];
+  for (i = 0; i < name_count; i++)
+    for (x = file_names[i] + 1; *x; x++) {
+      if (*x != '/' || x[-1] == '/') continue;
+      if (!(paths[n] = (char *)malloc(x - file_names[i] + 1))) {
+        r = ENOMEM;
+        goto out;
+      }
+      memcpy(paths[n], file_names[i], x - file_names[i]);
+      paths[n++][x - file_names[i]] = 0;
+    }
+
+  memset(&quiet_p, 0, sizeof(quiet_p));
+  quiet_p.flags = p->flags;
+  phi.p = &quiet_p;
+  r = Path_FollowMany(X, &phi, n, paths, vhe, codes);
+  phi.p = p;
+
+  for (i = 0; !r && i < n; i++) {
+    if (codes[i]) {
+      if (verbose && i < name_count)
+        printf("* %s not found\n", file_names[i]);
+    } else if (i < name_count) {
+      r = add_subtree(di, vhe[i].vnode);
+    } else if ((r = add_selected(di, vhe[i].vnode)) == ENOENT) {
+      r = 0;
+    }
+  }
+
+out:
+  if (paths) {
+    for (i = name_count; i < n; i++) free(paths[i]);
+    free(paths);
+  }
+  if (codes) free(codes);
+  if (vhe) free(vhe);
+  return r;
+}
+
+
+static int cmp_offsets(const void *a, const void *b)
+{
+  const u_int64 *x = (const u_int64 *)a, *y = (const u_int64 *)b;
+
+  if (!ne64(*x, *y)) return 0;
+  return lt64(*x, *y) ? -1 : 1;
+}
+
+
+/* Extract just the selected files, seeking directly to each one
+ * instead of parsing the whole dump.  Vnodes are visited in dump order,
+ * so directories are made before the files in them.
+ */
+static afs_uint32 extract_indexed(XFILE *X, dump_index *di)
+{
+  afs_uint32 r, j;
+  int i;
+
+  /* The root is always used, unless we're going by vnode number only */
+  if (!use_vnum && (r = add_selected(di, 1)) && r != ENOENT) return r;
+  if (!use_vnum && name_count && (r = add_paths(X, di))) return r;
+  for (i = 0; use_vnum && i < name_count; i++) {
+    if (r = add_path(di, file_names[i])) {
+      if (r != ENOENT) return r;
+      if (verbose) printf("* %s not found\n", file_names[i]);
+    }
+  }
+  for (i = 0; i < vnum_count; i++) {
+    if (r = add_selected(di, file_vnums[i])) {
+      if (r != ENOENT) return r;
+      if (verbose) printf("* vnode %d not found\n", file_vnums[i]);
+    }
+  }
+
+  qsort(sel_offsets, sel_count, sizeof(u_int64), cmp_offsets);
+  for (j = 0; j < sel_count; j++) {
+    if (j && !ne64(sel_offsets[j], sel_offsets[j - 1])) continue;
+    if ((r = xfseek(X, &sel_offsets[j]))
+    ||  (r = ParseVNode(X, &dp)))
+      return r;
+  }
+  return 0;
+}
+
+
 /* Main program */
 int main(int argc, char **argv)
 {
-  XFILE input_file;
+  dump_index di;
   afs_uint32 r;
-  int code = 0;
+  int code = 0, n;
 
   parse_options(argc, argv);
   initialize_acfg_error_table();
@@ -523,21 +1754,76 @@ int main(int argc, char **argv)
     exit(2);
   }
 
+  /* The archive gets stdout, so anything else we print goes to stderr */
+  if (tarmode && !nomode) {
+    FILE *F;
+    int fd;
+
+    fflush(stdout);
+    if ((fd = dup(1)) < 0 || dup2(2, 1) < 0 || !(F = fdopen(fd, "w")))
+      r = errno;
+    else r = xfopen_FILE(&tar_out, O_WRONLY, F);
+    if (r) {
+      com_err(argv0, r, "opening standard output");
+      exit(2);
+    }
+  }
+
   memset(&dp, 0, sizeof(dp));
   dp.cb_error       = my_error_cb;
-  if (input_file.is_seekable) dp.flags |= DSFLAG_SEEK;
+  if (error_keep >= 0)
+    ErrorSummary_Init(&es, &dp, &input_file, error_keep, error_every);
+  if (!input_file.is_seekable) streaming = 1;
+  if (streaming && nworkers > 1 && !nomode && !quiet)
+    fprintf(stderr, "%s: -j is ignored when extracting in one pass\n", argv0);
+
+  /* The workers can't each have their own handle on standard input */
+  if (!streaming && nworkers > 1 && !strcmp(input_path, "-")) {
+    if (!nomode && !quiet)
+      fprintf(stderr, "%s: -j is ignored when reading standard input\n",
+              argv0);
+    nworkers = 1;
+  }
+  if (!streaming) dp.flags |= DSFLAG_SEEK;
+  else index_path = 0;
   dirs_done = 0;
 
-  if (!use_vnum) {
+  /* Use the dump's own index, if it has one */
+  if (!streaming && !index_path && strcmp(input_path, "-")
+  &&  DumpIndex_Embedded(input_path))
+    index_path = input_path;
+  if (index_path
+  &&  (r = DumpIndex_Open(&di, index_path,
+                          strcmp(input_path, "-") ? input_path : 0))) {
+    com_err(argv0, r, "opening index %s", index_path);
+    xfclose(&input_file);
+    exit(1);
+  }
+
+  if (streaming) {
+    /* Pathname info is collected on the way through */
+    memset(&phi, 0, sizeof(phi));
+    phi.p = &dp;
+    dp.refcon        = &phi;
+    dp.cb_volhdr     = stream_volhdr_cb;
+    dp.cb_data_chunk = stream_chunk_cb;
+    if (!use_vnum) dp.cb_dirent = Path_AddEntry;
+  } else if (!use_vnum) {
     u_int64 where;
 
     memset(&phi, 0, sizeof(phi));
     phi.p = &dp;
 
-    if (verbose) printf("* Building pathname info...\n");
-    if ((r = xftell(&input_file, &where))
-    ||  (r = Path_PreScan(&input_file, &phi, 1))
-    ||  (r = xfseek(&input_file, &where))) {
+    if (index_path) {
+      if (verbose) printf("* Reading pathname info from %s...\n", index_path);
+      r = Path_FromIndex(&phi, &di);
+    } else {
+      if (verbose) printf("* Building pathname info...\n");
+      if (!(r = xftell(&input_file, &where))
+      &&  !(r = Path_PreScan(&input_file, &phi, 1)))
+        r = xfseek(&input_file, &where);
+    }
+    if (r) {
       com_err(argv0, r, "- path initialization failed");
       xfclose(&input_file);
       exit(1);
@@ -551,17 +1837,51 @@ int main(int argc, char **argv)
   dp.cb_vnode_wierd = lose_cb;
   if (do_headers) {
     dp.cb_dumphdr   = dumphdr_cb;
-    dp.cb_volhdr    = volhdr_cb;
+    if (!streaming) dp.cb_volhdr = volhdr_cb;
   }
 
-  if (!nomode) {
+  if (!nomode && !streaming && nworkers > 1 && (r = start_workers())) {
+    com_err(argv0, r, "starting workers");
+    exit(1);
+  }
+  if (!nomode && !tarmode) {
     mkdir(target, 0755);
     if (chdir(target)) {
       fprintf(stderr, "chdir %s failed: %s\n", target, strerror(errno));
       exit(1);
     }
   }
-  r = ParseDumpFile(&input_file, &dp);
+  if (index_path && (name_count || vnum_count) && !include_count)
+    r = extract_indexed(&input_file, &di);
+  else
+    r = ParseDumpFile(&input_file, &dp);
+  if (pool.nthreads) {
+    afs_uint32 r2 = finish_workers();
+
+    if (!r) r = r2;
+  }
+  if (streaming) {
+    place_parked();
+    if (!use_vnum) Path_FreeHashTable(&phi);
+  }
+  make_links();
+  restore_meta();
+  free_failed();
+  if (tarmode && !nomode) {
+    if (!r) r = Tar_End(&tar_out);
+    if (!r) r = xfclose(&tar_out);
+    else xfclose(&tar_out);
+  }
+  if (index_path) DumpIndex_Close(&di);
+
+  if (error_keep >= 0) {
+    /* Count what was left out, but not the summary's own messages */
+    n = error_count + es.suppressed;
+    if (es.interval) n -= es.suppressed / es.interval;
+    ErrorSummary_Report(&es);
+    ErrorSummary_Free(&es);
+    error_count = n;
+  }
 
   if (verbose && error_count) fprintf(stderr, "*** %d errors\n", error_count);
   if (r && !quiet) fprintf(stderr, "*** FAILED: %s\n", error_message(r));
@@ -0,0 +1,207 @@
+/*
+ * CMUCS AFStools
+ * dumpscan - routines for scanning and manipulating AFS volume dumps
+ *
+ * Copyright (c) 1998, 2001 Carnegie Mellon University
+ * All Rights Reserved.
+ * 
+ * Permission to use, copy, modify and distribute this software and its
+ * documentation is hereby granted, provided that both the copyright
+ * notice and this permission notice appear in all copies of the
+ * software, derivative works or modified versions, and any portions
+ * thereof, and that both notices appear in supporting documentation.
+ *
+ * CARNEGIE MELLON ALLOWS FREE USE OF THIS SOFTWARE IN ITS "AS IS"
+ * CONDITION.  CARNEGIE MELLON DISCLAIMS ANY LIABILITY OF ANY KIND FOR
+ * ANY DAMAGES WHATSOEVER RESULTING FROM THE USE OF THIS SOFTWARE.
+ *
+ * Carnegie Mellon requests users of this software to return to
+ *
+ *  Software Distribution Coordinator  or  Software_Distribution@CS.CMU.EDU
+ *  School of Computer Science
+ *  Carnegie Mellon University
+ *  Pittsburgh PA 15213-3890
+ *
+ * any improvements or extensions that they make and grant Carnegie Mellon
+ * the rights to redistribute these changes.
+ */
+
+/* afsdump_index.c - Build a vnode index for an AFS volume dump */
+
+#include <sys/fcntl.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include <afs/stds.h>
+#include <rx/rxkad.h>
+#include <ubik.h>
+#include <afs/cellconfig.h>
+#include <afs/volser.h>
+#include <afs/vlserver.h>
+#include <com_err.h>
+
+#include "dumpscan.h"
+
+extern int optind;
+extern char *optarg;
+
+char *argv0;
+static char *input_path, *index_path;
+static afs_uint32 repairflags;
+static int quiet, verbose, error_count;
+
+static dump_parser dp;
+
+
+/* Print a usage message and exit */
+static void usage(int status, char *msg)
+{
+  if (msg) fprintf(stderr, "%s: %s\n", argv0, msg);
+  fprintf(stderr, "Usage: %s [options] dumpfile [indexfile]\n", argv0);
+  fprintf(stderr, "  -Rxxx  Set repair options (see afsdump_scan)\n");
+  fprintf(stderr, "  -h     Print this help message\n");
+  fprintf(stderr, "  -q     Quiet mode (don't print errors)\n");
+  fprintf(stderr, "  -v     Verbose mode\n");
+  fprintf(stderr, "The index file defaults to dumpfile.idx\n");
+  exit(status);
+}
+
+
+/* Parse the argument given to the -R option.
+ * Returns the resulting * dumpscan repair flags (DSFIX_*).
+ * If an unrecognized flag is used, prints an error message and exits.
+ */
+static afs_uint32 parse_repairflags(char *flags)
+{
+  afs_uint32 result = 0;
+  char *x;
+
+  for (x = flags; *x; x++) switch (*x) {
+    case '0': result |= DSFIX_SKIP;   continue;
+    case 'b': result |= DSFIX_RSKIP;  continue;
+    case 'd': result |= DSFIX_VDSYNC; continue;
+    case 'v': result |= DSFIX_VFSYNC; continue;
+    default:  usage(1, "Invalid repair options!");
+  }
+  return result;
+}
+
+
+/* Parse the command-line options */
+static void parse_options(int argc, char **argv)
+{
+  int c;
+
+  /* Set the program name */
+  if (argv0 = strrchr(argv[0], '/')) argv0++;
+  else argv0 = argv[0];
+
+  /* Initialize options */
+  input_path = index_path = 0;
+  quiet = verbose = 0;
+  repairflags = 0;
+
+  /* Initialize other stuff */
+  error_count = 0;
+
+  /* Parse the options */
+  while ((c = getopt(argc, argv, "R:hqv")) != EOF) {
+    switch (c) {
+      case 'R': repairflags  = parse_repairflags(optarg); continue;
+      case 'q': quiet        = 1;                         continue;
+      case 'v': verbose      = 1;                         continue;
+      case 'h': usage(0, 0);
+      default:  usage(1, "Invalid option!");
+    }
+  }
+
+  if (quiet && verbose) usage(1, "Can't specify both -q and -v");
+
+  /* Parse non-option arguments */
+  if (argc - optind < 1) usage(1, "Dumpfile name required!");
+  if (argc - optind > 2) usage(1, "Too many arguments!");
+  input_path = argv[optind];
+  if (argc - optind > 1) index_path = argv[optind + 1];
+  else {
+    index_path = (char *)malloc(strlen(input_path) + 5);
+    if (!index_path) {
+      fprintf(stderr, "%s: out of memory\n", argv0);
+      exit(2);
+    }
+    sprintf(index_path, "%s.idx", input_path);
+  }
+}
+
+
+/* A callback to count and print errors */
+static afs_uint32 my_error_cb(afs_uint32 code, int fatal, void *ref, char *msg, ...)
+{
+  va_list alist;
+
+  error_count++;
+  if (!quiet) {
+    va_start(alist, msg);
+    com_err_va(argv0, code, msg, alist);
+    va_end(alist);
+  }
+  return 0;
+}
+
+
+/* Main program */
+int main(int argc, char **argv)
+{
+  XFILE input_file;
+  dump_index di;
+  afs_uint32 r;
+  int code = 0;
+
+  parse_options(argc, argv);
+  initialize_acfg_error_table();
+  initialize_AVds_error_table();
+  initialize_rxk_error_table();
+  initialize_u_error_table();
+  initialize_vl_error_table();
+  initialize_vols_error_table();
+  initialize_xFil_error_table();
+  r = xfopen(&input_file, O_RDONLY, input_path);
+  if (r) {
+    com_err(argv0, r, "opening %s", input_path);
+    exit(2);
+  }
+  if (!input_file.is_seekable) {
+    fprintf(stderr, "%s: %s is not seekable; can't index it\n",
+            argv0, input_path);
+    xfclose(&input_file);
+    exit(1);
+  }
+
+  memset(&dp, 0, sizeof(dp));
+  dp.cb_error     = my_error_cb;
+  dp.repair_flags = repairflags;
+  dp.flags       |= DSFLAG_SEEK;
+
+  r = DumpIndex_Build(&input_file, &dp, index_path);
+  xfclose(&input_file);
+
+  if (!r && verbose) {
+    if (r = DumpIndex_Open(&di, index_path, input_path))
+      com_err(argv0, r, "reopening %s", index_path);
+    else {
+      printf("%s: %d vnodes, %d directory entries\n",
+             index_path, di.n_vnodes, di.n_entries);
+      DumpIndex_Close(&di);
+    }
+  }
+
+  if (verbose && error_count) fprintf(stderr, "*** %d errors\n", error_count);
+  if (r && !quiet) fprintf(stderr, "*** FAILED: %s\n", error_message(r));
+
+  if (r) {
+      code = 3;  /* failed */
+  } else if (error_count) {
+      code = 4;  /* errors */
+  }
+  return code;
+}
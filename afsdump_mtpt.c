@@ -57,9 +57,10 @@ extern afs_uint32 repair_vnode_cb(afs_vnode *, XFILE *, void *);
 
 char *argv0;
 static char *input_path, *gendump_path;
-static int quiet, verbose, error_count;
+static int quiet, verbose, error_count, error_keep, error_every, add_index;
 
 static dump_parser dp;
+static error_summary es;
 
 static char mtpt_src[128];
 static char mtpt_dst[128];
@@ -71,9 +72,13 @@ static void usage(int status, char *msg)
 {
   if (msg) fprintf(stderr, "%s: %s\n", argv0, msg);
   fprintf(stderr, "Usage: %s [options] src_cell dst_cell\n", argv0);
+  fprintf(stderr, "  -E n   With -e, report progress every n unprinted errors\n");
+  fprintf(stderr, "  -e n   Print only n errors of each kind, then a summary\n");
   fprintf(stderr, "  -h     Print this help message\n");
+  fprintf(stderr, "  -o xxx Put output in file xxx [default stdout]\n");
   fprintf(stderr, "  -q     Quiet mode (don't print errors)\n");
   fprintf(stderr, "  -v     Verbose mode\n");
+  fprintf(stderr, "  -x     Append an index to the output (needs -o)\n");
   exit(status);
 }
 
@@ -90,22 +95,30 @@ static void parse_options(int argc, char **argv)
 
   /* Initialize options */
   input_path = gendump_path = "-";
-  quiet = verbose = 0;
+  quiet = verbose = add_index = 0;
 
   /* Initialize other stuff */
   error_count = 0;
+  error_keep = -1;
+  error_every = 0;
 
   /* Parse the options */
-  while ((c = getopt(argc, argv, "hqv")) != EOF) {
+  while ((c = getopt(argc, argv, "E:e:ho:qvx")) != EOF) {
     switch (c) {
-      case 'q': quiet        = 1;      continue;
-      case 'v': verbose      = 1;      continue;
+      case 'E': error_every  = atoi(optarg); continue;
+      case 'e': error_keep   = atoi(optarg); continue;
+      case 'o': gendump_path = optarg;       continue;
+      case 'q': quiet        = 1;            continue;
+      case 'v': verbose      = 1;            continue;
+      case 'x': add_index    = 1;            continue;
       case 'h': usage(0, 0);
       default:  usage(1, "Invalid option!");
     }
   }
 
   if (quiet && verbose) usage(1, "Can't specify both -q and -v");
+  if (add_index && !strcmp(gendump_path, "-")) usage(1, "-x requires -o");
+  if (error_every && error_keep < 0) usage(1, "-E requires -e");
 
   /* Parse non-option arguments */
   if (argc - optind < 2) usage(1, "Too few arguments!");
@@ -362,15 +375,24 @@ int main(int argc, char **argv)
     exit(2);
   }
 
+  if (error_keep >= 0)
+    ErrorSummary_Init(&es, &dp, &input_file, error_keep, error_every);
   dp.print_flags = 0;
   r = ParseDumpFile(&input_file, &dp);
   xfclose(&input_file);
   if (gendump_path) {
     if (!r) r = DumpDumpEnd(&output_file);
+    if (!r && add_index) r = DumpIndex_Append(&output_file, &dp);
     if (!r) r = xfclose(&output_file);
     else xfclose(&output_file);
   }
 
+  if (error_keep >= 0) {
+    ErrorSummary_Report(&es);
+    error_count = es.total;
+    ErrorSummary_Free(&es);
+  }
+
   if (verbose && error_count) fprintf(stderr, "*** %d errors\n", error_count);
   if (r && !quiet) fprintf(stderr, "*** FAILED: %s\n", afs_error_message(r));
   if (r) {
@@ -52,12 +52,13 @@ extern afs_uint32 repair_volhdr_cb(afs_vol_header *, XFILE *, void *);
 extern afs_uint32 repair_vnode_cb(afs_vnode *, XFILE *, void *);
 
 char *argv0;
-static char *input_path, *gendump_path;
+static char *input_path, *gendump_path, *index_path;
 static afs_uint32 printflags, repairflags;
-static int quiet, verbose, error_count;
+static int quiet, verbose, error_count, error_keep, error_every, add_index;
 
 static path_hashinfo phi;
 static dump_parser dp;
+static error_summary es;
 
 
 /* Print a usage message and exit */
@@ -80,10 +81,14 @@ static void usage(int status, char *msg)
   fprintf(stderr, "          b = Seek backward to find skipped tags\n");
   fprintf(stderr, "          d = Resync after vnode data\n");
   fprintf(stderr, "          v = Resync after corrupted vnodes\n");
+  fprintf(stderr, "  -Ixxx  Use vnode index xxx for paths (see afsdump_index)\n");
+  fprintf(stderr, "  -en    Print only n errors of each kind, then a summary\n");
+  fprintf(stderr, "  -En    With -e, report progress every n unprinted errors\n");
   fprintf(stderr, "  -h     Print this help message\n");
   fprintf(stderr, "  -gxxx  Generate a new dump in file xxx\n");
   fprintf(stderr, "  -q     Quiet mode (don't print errors)\n");
   fprintf(stderr, "  -v     Verbose mode\n");
+  fprintf(stderr, "  -x     Append an index to the generated dump\n");
   exit(status);
 }
 
@@ -143,27 +148,35 @@ static void parse_options(int argc, char **argv)
   else argv0 = argv[0];
 
   /* Initialize options */
-  input_path = gendump_path = 0;
+  input_path = gendump_path = index_path = 0;
   printflags = repairflags = 0;
   quiet = verbose = 0;
 
   /* Initialize other stuff */
   error_count = 0;
+  error_keep = -1;
+  error_every = 0;
 
   /* Parse the options */
-  while ((c = getopt(argc, argv, "P:R:g:hqv")) != EOF) {
+  while ((c = getopt(argc, argv, "E:I:P:R:e:g:hqvx")) != EOF) {
     switch (c) {
+      case 'E': error_every  = atoi(optarg);              continue;
+      case 'I': index_path   = optarg;                    continue;
       case 'P': printflags   = parse_printflags(optarg);  continue;
       case 'R': repairflags  = parse_repairflags(optarg); continue;
+      case 'e': error_keep   = atoi(optarg);              continue;
       case 'g': gendump_path = optarg;                    continue;
       case 'q': quiet        = 1;                         continue;
       case 'v': verbose      = 1;                         continue;
+      case 'x': add_index    = 1;                         continue;
       case 'h': usage(0, 0);
       default:  usage(1, "Invalid option!");
     }
   }
 
   if (quiet && verbose) usage(1, "Can't specify both -q and -v");
+  if (add_index && !gendump_path) usage(1, "-x requires -g");
+  if (error_every && error_keep < 0) usage(1, "-E requires -e");
 
   /* Parse non-option arguments */
   if (argc - optind > 1) usage(1, "Too many arguments!");
@@ -250,6 +263,8 @@ int main(int argc, char **argv)
   memset(&dp, 0, sizeof(dp));
   dp.cb_error     = my_error_cb;
   dp.repair_flags = repairflags;
+  if (error_keep >= 0)
+    ErrorSummary_Init(&es, &dp, &input_file, error_keep, error_every);
   if (input_file.is_seekable) dp.flags |= DSFLAG_SEEK;
   else {
     if (repairflags)
@@ -269,13 +284,27 @@ int main(int argc, char **argv)
   if (printflags & DSPRINT_PATH) {
     u_int64 where;
 
+    /* Use the dump's own index, if it has one */
+    if (!index_path && strcmp(input_path, "-")
+    &&  DumpIndex_Embedded(input_path))
+      index_path = input_path;
+
     dp.print_flags = printflags & DSPRINT_DEBUG;
     memset(&phi, 0, sizeof(phi));
     phi.p = &dp;
 
-    if ((r = xftell(&input_file, &where))
-    ||  (r = Path_PreScan(&input_file, &phi, 0))
-    ||  (r = xfseek(&input_file, &where))) {
+    if (index_path) {
+      dump_index di;
+
+      if (!(r = DumpIndex_Open(&di, index_path,
+                               strcmp(input_path, "-") ? input_path : 0))) {
+        r = Path_FromIndex(&phi, &di);
+        DumpIndex_Close(&di);
+      }
+    } else if (!(r = xftell(&input_file, &where))
+           &&  !(r = Path_PreScan(&input_file, &phi, 0)))
+      r = xfseek(&input_file, &where);
+    if (r) {
       com_err(argv0, r, "- path initialization failed");
       xfclose(&input_file);
       exit(2);
@@ -293,10 +322,17 @@ int main(int argc, char **argv)
   xfclose(&input_file);
   if (gendump_path) {
     if (!r) r = DumpDumpEnd(&repair_output);
+    if (!r && add_index) r = DumpIndex_Append(&repair_output, &dp);
     if (!r) r = xfclose(&repair_output);
     else xfclose(&repair_output);
   }
 
+  if (error_keep >= 0) {
+    ErrorSummary_Report(&es);
+    error_count = es.total;
+    ErrorSummary_Free(&es);
+  }
+
   if (verbose && error_count) fprintf(stderr, "*** %d errors\n", error_count);
   if (r && !quiet) fprintf(stderr, "*** FAILED: %s\n", error_message(r));
 
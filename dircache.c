@@ -0,0 +1,380 @@
+/*
+ * CMUCS AFStools
+ * dumpscan - routines for scanning and manipulating AFS volume dumps
+ *
+ * Copyright (c) 1998, 2001 Carnegie Mellon University
+ * All Rights Reserved.
+ * 
+ * Permission to use, copy, modify and distribute this software and its
+ * documentation is hereby granted, provided that both the copyright
+ * notice and this permission notice appear in all copies of the
+ * software, derivative works or modified versions, and any portions
+ * thereof, and that both notices appear in supporting documentation.
+ *
+ * CARNEGIE MELLON ALLOWS FREE USE OF THIS SOFTWARE IN ITS "AS IS"
+ * CONDITION.  CARNEGIE MELLON DISCLAIMS ANY LIABILITY OF ANY KIND FOR
+ * ANY DAMAGES WHATSOEVER RESULTING FROM THE USE OF THIS SOFTWARE.
+ *
+ * Carnegie Mellon requests users of this software to return to
+ *
+ *  Software Distribution Coordinator  or  Software_Distribution@CS.CMU.EDU
+ *  School of Computer Science
+ *  Carnegie Mellon University
+ *  Pittsburgh PA 15213-3890
+ *
+ * any improvements or extensions that they make and grant Carnegie Mellon
+ * the rights to redistribute these changes.
+ */
+
+/* dircache.c - Cache of decoded directories
+ *
+ * Building the pathname of every vnode in a volume means looking up
+ * each vnode in its parent directory, so a directory with thousands of
+ * entries would be read and parsed thousands of times.  Instead, the
+ * pathname routines keep a cache of decoded directories, keyed by vnode
+ * number.  Each one holds the names packed into a single buffer, an
+ * array of entries sorted by vnode number (for reverse lookups) and a
+ * hash table on the names (for forward lookups).  The cache is bounded
+ * by the memory it uses; the least recently used directories go first.
+ *
+ * Reverse lookups, which have to look at every entry, decode a directory
+ * into the cache.  Looking up a name in a directory that isn't cached
+ * just follows the directory's own hash chain, as DirectoryLookup does,
+ * which reads a page or two instead of all of it.  Only when names are
+ * looked up in the same directory twice in a row (as Path_FollowMany
+ * does for files in one directory) is it decoded for that.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "dumpscan.h"
+#include "internal.h"
+
+#define DIRCACHE_HASHSIZE  256          /* Buckets for directory vnodes */
+#define DIRCACHE_MAXBYTES  (16 << 20)   /* Default memory bound */
+
+typedef struct {
+  afs_uint32 vnode, vuniq;
+  afs_uint32 name;           /* Offset into names */
+} dc_entry;
+
+typedef struct {
+  afs_uint32 vnode;
+  int entry;                 /* Index into entries */
+} dc_vnode;
+
+typedef struct cached_dir {
+  struct cached_dir *hnext;  /* Next in hash chain */
+  struct cached_dir *prev;   /* More recently used */
+  struct cached_dir *next;   /* Less recently used */
+  afs_uint32 vnode;          /* Directory vnode number */
+  afs_uint32 error;          /* Error that cut decoding short, if any */
+  int n_entries, entries_max;
+  dc_entry *entries;         /* Entries, in directory order */
+  dc_vnode *by_vnode;        /* Entries, sorted by vnode number */
+  int n_buckets;
+  int *buckets, *chain;      /* Name hash; -1 ends a chain */
+  char *names;
+  afs_uint32 names_len, names_max;
+  afs_uint32 bytes;          /* Memory used by this directory */
+} cached_dir;
+
+struct dir_cache {
+  pthread_mutex_t lock;
+  cached_dir *hash[DIRCACHE_HASHSIZE];
+  cached_dir *mru, *lru;     /* Ends of the LRU list */
+  afs_uint32 bytes, maxbytes;
+  afs_uint32 last_walked;    /* Last directory whose hash chain we used */
+};
+
+
+static int dc_namehash(char *name, int buckets)
+{
+  unsigned int hval = 0;
+
+  while (*name) hval = (hval * 173) + (unsigned char)*name++;
+  return hval & (buckets - 1);
+}
+
+
+static int cmp_vnode(const void *a, const void *b)
+{
+  const dc_vnode *x = (const dc_vnode *)a, *y = (const dc_vnode *)b;
+
+  if (x->vnode != y->vnode) return (x->vnode < y->vnode) ? -1 : 1;
+  return x->entry - y->entry;
+}
+
+
+static void free_dir(cached_dir *cd)
+{
+  if (cd->entries)  free(cd->entries);
+  if (cd->by_vnode) free(cd->by_vnode);
+  if (cd->buckets)  free(cd->buckets);
+  if (cd->chain)    free(cd->chain);
+  if (cd->names)    free(cd->names);
+  free(cd);
+}
+
+
+/* Collect one directory entry */
+static afs_uint32 collect_cb(afs_vnode *v, afs_dir_entry *de,
+                             XFILE *X, void *refcon)
+{
+  cached_dir *cd = (cached_dir *)refcon;
+  afs_uint32 l = strlen(de->name) + 1;
+  dc_entry *e;
+  char *n;
+
+  if (cd->n_entries == cd->entries_max) {
+    cd->entries_max = cd->entries_max ? cd->entries_max * 2 : 64;
+    e = (dc_entry *)realloc(cd->entries, cd->entries_max * sizeof(dc_entry));
+    if (!e) return ENOMEM;
+    cd->entries = e;
+  }
+  if (cd->names_len + l > cd->names_max) {
+    while (cd->names_len + l > cd->names_max)
+      cd->names_max = cd->names_max ? cd->names_max * 2 : 1024;
+    if (!(n = (char *)realloc(cd->names, cd->names_max))) return ENOMEM;
+    cd->names = n;
+  }
+  e = cd->entries + cd->n_entries++;
+  e->vnode = de->vnode;
+  e->vuniq = de->uniq;
+  e->name  = cd->names_len;
+  memcpy(cd->names + cd->names_len, de->name, l);
+  cd->names_len += l;
+  return 0;
+}
+
+
+/* Read and decode a directory.  X must be positioned at its start. */
+static afs_uint32 decode_dir(XFILE *X, dump_parser *p, afs_uint32 size,
+                             cached_dir *cd)
+{
+  dump_parser my_p;
+  afs_uint32 r;
+  int i, h;
+
+  memset(&my_p, 0, sizeof(my_p));
+  my_p.refcon     = (void *)cd;
+  my_p.err_refcon = p->err_refcon;
+  my_p.cb_error   = p->cb_error;
+  my_p.cb_dirent  = collect_cb;
+
+  /* Keep whatever was found before any error, as a full scan would */
+  r = parse_directory(X, &my_p, 0, size, 0);
+  if (r == ENOMEM) return r;
+  if (r) cd->error = handle_return(r, X, 0, p);
+
+  for (cd->n_buckets = 16;
+       cd->n_buckets < cd->n_entries;
+       cd->n_buckets <<= 1);
+  cd->buckets  = (int *)malloc(cd->n_buckets * sizeof(int));
+  cd->chain    = (int *)malloc((cd->n_entries + 1) * sizeof(int));
+  cd->by_vnode = (dc_vnode *)malloc((cd->n_entries + 1) * sizeof(dc_vnode));
+  if (!cd->buckets || !cd->chain || !cd->by_vnode) return ENOMEM;
+
+  /* Chain in reverse, so the first of any duplicate names wins */
+  for (i = 0; i < cd->n_buckets; i++) cd->buckets[i] = -1;
+  for (i = cd->n_entries - 1; i >= 0; i--) {
+    h = dc_namehash(cd->names + cd->entries[i].name, cd->n_buckets);
+    cd->chain[i] = cd->buckets[h];
+    cd->buckets[h] = i;
+    cd->by_vnode[i].vnode = cd->entries[i].vnode;
+    cd->by_vnode[i].entry = i;
+  }
+  qsort(cd->by_vnode, cd->n_entries, sizeof(dc_vnode), cmp_vnode);
+
+  cd->bytes = sizeof(cached_dir) + cd->names_max
+            + cd->entries_max * sizeof(dc_entry)
+            + (cd->n_entries + 1) * (sizeof(dc_vnode) + sizeof(int))
+            + cd->n_buckets * sizeof(int);
+  return 0;
+}
+
+
+static void unlink_lru(dir_cache *dc, cached_dir *cd)
+{
+  if (cd->prev) cd->prev->next = cd->next;
+  else dc->mru = cd->next;
+  if (cd->next) cd->next->prev = cd->prev;
+  else dc->lru = cd->prev;
+  cd->prev = cd->next = 0;
+}
+
+
+static void link_mru(dir_cache *dc, cached_dir *cd)
+{
+  cd->prev = 0;
+  cd->next = dc->mru;
+  if (dc->mru) dc->mru->prev = cd;
+  else dc->lru = cd;
+  dc->mru = cd;
+}
+
+
+/* Evict least recently used directories until we are within bounds,
+ * but never the one just added.
+ */
+static void evict(dir_cache *dc)
+{
+  cached_dir *cd, **hp;
+
+  while (dc->bytes > dc->maxbytes && dc->lru && dc->lru != dc->mru) {
+    cd = dc->lru;
+    unlink_lru(dc, cd);
+    for (hp = &dc->hash[cd->vnode % DIRCACHE_HASHSIZE]; *hp; hp = &(*hp)->hnext)
+      if (*hp == cd) {
+        *hp = cd->hnext;
+        break;
+      }
+    dc->bytes -= cd->bytes;
+    free_dir(cd);
+  }
+}
+
+
+/* Find a directory in the cache, if it is there */
+static cached_dir *find_dir(dir_cache *dc, afs_uint32 dvnode)
+{
+  cached_dir *cd;
+
+  for (cd = dc->hash[dvnode % DIRCACHE_HASHSIZE]; cd; cd = cd->hnext)
+    if (cd->vnode == dvnode) {
+      unlink_lru(dc, cd);
+      link_mru(dc, cd);
+      return cd;
+    }
+  return 0;
+}
+
+
+static afs_uint32 seek_dir(XFILE *X, dump_parser *p, afs_uint32 dvnode,
+                           u_int64 *offset)
+{
+  afs_uint32 r;
+
+  if ((r = xfseek(X, offset)) && p->cb_error)
+    (p->cb_error)(r, 1, p->err_refcon,
+                  "Unable to seek to directory %d", dvnode);
+  return r;
+}
+
+
+/* Find a directory in the cache, decoding it if needed */
+static afs_uint32 get_dir(dir_cache *dc, XFILE *X, dump_parser *p,
+                          afs_uint32 dvnode, u_int64 *offset, afs_uint32 size,
+                          cached_dir **cdp)
+{
+  cached_dir *cd;
+  afs_uint32 r;
+
+  if (*cdp = find_dir(dc, dvnode)) return 0;
+  if (r = seek_dir(X, p, dvnode, offset)) return r;
+  if (!(cd = (cached_dir *)malloc(sizeof(cached_dir)))) return ENOMEM;
+  memset(cd, 0, sizeof(cached_dir));
+  cd->vnode = dvnode;
+  if (r = decode_dir(X, p, size, cd)) {
+    free_dir(cd);
+    return r;
+  }
+  cd->hnext = dc->hash[dvnode % DIRCACHE_HASHSIZE];
+  dc->hash[dvnode % DIRCACHE_HASHSIZE] = cd;
+  link_mru(dc, cd);
+  dc->bytes += cd->bytes;
+  evict(dc);
+  *cdp = cd;
+  return 0;
+}
+
+
+/* Create a directory cache using at most maxbytes (0 for the default) */
+afs_uint32 DirCache_Init(dir_cache **dcp, afs_uint32 maxbytes)
+{
+  *dcp = (dir_cache *)malloc(sizeof(dir_cache));
+  if (!*dcp) return ENOMEM;
+  memset(*dcp, 0, sizeof(dir_cache));
+  pthread_mutex_init(&(*dcp)->lock, 0);
+  (*dcp)->maxbytes = maxbytes ? maxbytes : DIRCACHE_MAXBYTES;
+  return 0;
+}
+
+
+/* Look up an entry in directory vnode dvnode, whose data is size bytes
+ * at offset in X.  This works just like DirectoryLookup: if *name is
+ * NULL, we look up by vnode; otherwise by filename.  Any of name, vnode
+ * and vuniq that are neither NULL nor the search key are filled in on
+ * success; a name so returned must be freed by the caller.
+ * Returns 0 on success, whether or not the entry is found.
+ */
+afs_uint32 DirCache_Lookup(dir_cache *dc, XFILE *X, dump_parser *p,
+                           afs_uint32 dvnode, u_int64 *offset, afs_uint32 size,
+                           char **name, afs_uint32 *vnode, afs_uint32 *vuniq)
+{
+  cached_dir *cd;
+  dc_entry *e = 0;
+  afs_uint32 r;
+  int i, lo, hi, mid;
+
+  pthread_mutex_lock(&dc->lock);
+  if (name && name[0] && !(cd = find_dir(dc, dvnode))
+  &&  dc->last_walked != dvnode) {
+    dc->last_walked = dvnode;
+    pthread_mutex_unlock(&dc->lock);
+    if (r = seek_dir(X, p, dvnode, offset)) return r;
+    return DirectoryLookup(X, p, size, name, vnode, vuniq);
+  }
+  if (r = get_dir(dc, X, p, dvnode, offset, size, &cd)) {
+    pthread_mutex_unlock(&dc->lock);
+    return r;
+  }
+
+  if (name && name[0]) {                        /* Search by filename */
+    for (i = cd->buckets[dc_namehash(name[0], cd->n_buckets)];
+         i >= 0 && strcmp(cd->names + cd->entries[i].name, name[0]);
+         i = cd->chain[i]);
+    if (i >= 0) {
+      e = cd->entries + i;
+      if (vnode) vnode[0] = e->vnode;
+      if (vuniq) vuniq[0] = e->vuniq;
+    }
+  } else if (vnode) {                           /* Search by vnode */
+    for (lo = 0, hi = cd->n_entries; lo < hi;) {
+      mid = (lo + hi) / 2;
+      if (cd->by_vnode[mid].vnode < vnode[0]) lo = mid + 1;
+      else hi = mid;
+    }
+    if (lo < cd->n_entries && cd->by_vnode[lo].vnode == vnode[0]) {
+      e = cd->entries + cd->by_vnode[lo].entry;
+      if (name) {
+        name[0] = (char *)malloc(strlen(cd->names + e->name) + 1);
+        if (!name[0]) r = ENOMEM;
+        else strcpy(name[0], cd->names + e->name);
+      }
+      if (vuniq) vuniq[0] = e->vuniq;
+    }
+  }
+
+  /* A miss in a directory we couldn't read all of is that error */
+  if (!e && !r) r = cd->error;
+  pthread_mutex_unlock(&dc->lock);
+  return r;
+}
+
+
+/* Free a directory cache and everything in it */
+void DirCache_Free(dir_cache *dc)
+{
+  cached_dir *cd, *next;
+
+  for (cd = dc->mru; cd; cd = next) {
+    next = cd->next;
+    free_dir(cd);
+  }
+  pthread_mutex_destroy(&dc->lock);
+  free(dc);
+}
@@ -54,8 +54,6 @@ struct dir_state {
   int used;                  /* # entries used in this page */
 };
 
-static afs_dir_page page;
-
 #define bmbyte(bm,x) bm[(x)>>3]
 #define bmbit(x) (1 << ((x) & 7))
 
@@ -77,6 +75,7 @@ static int namehash(char *name, int buckets, int seed)
 afs_uint32 parse_directory(XFILE *X, dump_parser *p, afs_vnode *v,
                         afs_uint32 size, int toeof)
 {
+  afs_dir_page page;
   afs_dir_entry de;
   int pgno, i, l, n;
   int r;
@@ -172,6 +171,50 @@ static afs_uint32 dirlookup_cb(afs_vnode *v, afs_dir_entry *de,
 }
 
 
+/* Look up a filename by following its hash chain, reading only the
+ * header page and the pages the chain passes through.  X must be
+ * positioned at start, the beginning of the directory.
+ * Returns 0 if the name was found, ENOENT if it is not on its chain,
+ * or some other error if the chain can't be followed (bad page tag,
+ * bad blob number, loop), in which case a full scan is in order.
+ */
+static afs_uint32 hash_lookup(XFILE *X, afs_uint32 size, u_int64 *start,
+                              char *name, afs_uint32 *vnode, afs_uint32 *vuniq)
+{
+  afs_dir_page page;
+  u_int64 where;
+  int npages = size / AFS_PAGESIZE;
+  int l = strlen(name) + 1;
+  int pgno, blob, e, steps;
+  afs_uint32 r;
+
+  if (r = xfread(X, &page, AFS_PAGESIZE)) return r;
+  if (page.header.tag != htons(AFS_DIR_MAGIC)) return DSERR_MAGIC;
+  pgno = 0;
+  blob = ntohs(((afs_dir_header *)&page)->hash[namehash(name, NHASHENT, 0)]);
+  for (steps = 0; blob; steps++) {
+    if (steps >= npages * EPP || blob / EPP >= npages) return DSERR_FMT;
+    if (blob / EPP != pgno) {
+      pgno = blob / EPP;
+      add64_32(where, *start, pgno * AFS_PAGESIZE);
+      if (r = xfseek(X, &where)) return r;
+      if (r = xfread(X, &page, AFS_PAGESIZE)) return r;
+      if (page.header.tag != htons(AFS_DIR_MAGIC)) return DSERR_MAGIC;
+    }
+    e = blob % EPP;
+    if (e < (pgno ? 1 : DPHE) || !allocbit(e) || page.entry[e].flag != FFIRST)
+      return DSERR_FMT;
+    if (l <= (EPP - e - 1) * 32 + 16 && !memcmp(page.entry[e].name, name, l)) {
+      if (vnode) *vnode = ntohl(page.entry[e].vnode);
+      if (vuniq) *vuniq = ntohl(page.entry[e].vunique);
+      return 0;
+    }
+    blob = ntohs(page.entry[e].next);
+  }
+  return ENOENT;
+}
+
+
 /* Look up an entry in a directory, by name or vnode.
  * If *name is NULL, we are looking up by vnode.
  * Otherwise, we are looking for a filename.
@@ -188,8 +231,25 @@ afs_uint32 DirectoryLookup(XFILE *X, dump_parser *p, afs_uint32 size,
 {
   dump_parser my_p;
   dirlookup_stat my_s;
+  u_int64 start;
+  char *x;
   afs_uint32 r;
 
+  /* Filenames can be found through the hash table, if we can seek.
+   * A miss is believed unless the name has 8-bit characters, which
+   * hash differently depending on whether the server's char is signed.
+   */
+  if (name && name[0] && (p->flags & DSFLAG_SEEK)) {
+    if (r = xftell(X, &start)) return r;
+    r = hash_lookup(X, size, &start, name[0], vnode, vuniq);
+    if (!r) return 0;
+    if (r == ENOENT) {
+      for (x = name[0]; *x && !(*x & 0x80); x++);
+      if (!*x) return 0;
+    }
+    if (r = xfseek(X, &start)) return r;
+  }
+
   memset(&my_s, 0, sizeof(my_s));
   my_s.name  = name;
   my_s.vnode = vnode;
@@ -0,0 +1,602 @@
+/*
+ * CMUCS AFStools
+ * dumpscan - routines for scanning and manipulating AFS volume dumps
+ *
+ * Copyright (c) 1998, 2001 Carnegie Mellon University
+ * All Rights Reserved.
+ * 
+ * Permission to use, copy, modify and distribute this software and its
+ * documentation is hereby granted, provided that both the copyright
+ * notice and this permission notice appear in all copies of the
+ * software, derivative works or modified versions, and any portions
+ * thereof, and that both notices appear in supporting documentation.
+ *
+ * CARNEGIE MELLON ALLOWS FREE USE OF THIS SOFTWARE IN ITS "AS IS"
+ * CONDITION.  CARNEGIE MELLON DISCLAIMS ANY LIABILITY OF ANY KIND FOR
+ * ANY DAMAGES WHATSOEVER RESULTING FROM THE USE OF THIS SOFTWARE.
+ *
+ * Carnegie Mellon requests users of this software to return to
+ *
+ *  Software Distribution Coordinator  or  Software_Distribution@CS.CMU.EDU
+ *  School of Computer Science
+ *  Carnegie Mellon University
+ *  Pittsburgh PA 15213-3890
+ *
+ * any improvements or extensions that they make and grant Carnegie Mellon
+ * the rights to redistribute these changes.
+ */
+
+/* dumpindex.c - Build and use a vnode index kept next to a dump
+ *
+ * Finding out where things are in a dump normally takes a full pass
+ * over it (see Path_PreScan).  A dump index records the results of such
+ * a pass in a file, which can be mapped into memory and used directly.
+ * All values are stored in network byte order:
+ *
+ *   Header (INDEX_HDR_SIZE bytes):
+ *     magic, version, n_vnodes, n_entries, names_size,
+ *     dump size (high, low), volume ID, and reserved words
+ *   Vnode records (INDEX_VNODE_SIZE bytes each), sorted by vnode number:
+ *     vnode, vuniq, type, parent, datavers,
+ *     vnode offset, data offset, data size (each high, low),
+ *     first_entry, n_entries
+ *   Directory entry records (INDEX_ENTRY_SIZE bytes each),
+ *     grouped by directory in the same order as the vnodes:
+ *     vnode, vuniq, offset of name
+ *   Names: NUL-terminated directory entry names
+ *
+ * The "." and ".." entries are not recorded.
+ *
+ * An index may also be appended to a dump, after the dump end record,
+ * followed by a trailer (INDEX_TRAILER_SIZE bytes) that holds the
+ * index's offset (high, low), its size, and INDEX_TRAILER_MAGIC.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/fcntl.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dumpscan.h"
+#include "dumpscan_errs.h"
+
+#define INDEX_MAGIC      0x41444958   /* 'ADIX' */
+#define INDEX_VERSION    1
+#define INDEX_HDR_SIZE   64
+#define INDEX_VNODE_SIZE 52
+#define INDEX_ENTRY_SIZE 12
+
+#define INDEX_TRAILER_MAGIC 0x41444954   /* 'ADIT' */
+#define INDEX_TRAILER_SIZE  16
+
+#define GET32(b, i)    get32((unsigned char *)(b) + 4 * (i))
+#define PUT32(b, i, v) put32((unsigned char *)(b) + 4 * (i), (v))
+
+typedef struct {
+  dump_parser *p;            /* Caller's parser, for errors */
+  index_vnode *vnodes;       /* Vnodes seen so far */
+  afs_uint32 n_vnodes, max_vnodes;
+  afs_uint32 *entries;       /* Entries seen so far (3 words each) */
+  afs_uint32 n_entries, max_entries;
+  char *names;               /* Names seen so far */
+  afs_uint32 names_size, max_names;
+  afs_uint32 pending;        /* First entry not yet claimed by a vnode */
+  afs_uint32 pending_names;  /* Size of names when those entries began */
+  u_int64 pending_offset;    /* Offset of the vnode they came from */
+  afs_uint32 volid;
+} index_state;
+
+
+/* An embedded index need not be aligned, so go through memcpy */
+static afs_uint32 get32(unsigned char *b)
+{
+  afs_uint32 x;
+
+  memcpy(&x, b, sizeof(x));
+  return ntohl(x);
+}
+
+static void put32(unsigned char *b, afs_uint32 v)
+{
+  v = htonl(v);
+  memcpy(b, &v, sizeof(v));
+}
+
+
+/* Make sure there is room for n more items in a growing array */
+static int grow(void **array, afs_uint32 *max, afs_uint32 count,
+                afs_uint32 n, afs_uint32 size)
+{
+  afs_uint32 newmax;
+  void *x;
+
+  if (count + n <= *max) return 0;
+  for (newmax = *max ? *max : 256; newmax < count + n; newmax <<= 1);
+  if (!(x = realloc(*array, newmax * size))) return ENOMEM;
+  *array = x;
+  *max = newmax;
+  return 0;
+}
+
+
+static afs_uint32 index_volhdr_cb(afs_vol_header *hdr, XFILE *X, void *refcon)
+{
+  index_state *is = (index_state *)refcon;
+
+  if (hdr->field_mask & F_VOLHDR_VOLID) is->volid = hdr->volid;
+  return 0;
+}
+
+
+/* Throw away any pending entries that don't belong to v.  This happens
+ * when a directory vnode is dropped by DSFIX_VFSYNC after its entries
+ * were parsed, so the vnode callback never claims them.
+ */
+static void drop_pending(index_state *is, afs_vnode *v)
+{
+  if (is->n_entries > is->pending && ne64(is->pending_offset, v->offset)) {
+    is->n_entries  = is->pending;
+    is->names_size = is->pending_names;
+  }
+}
+
+
+/* Directory entries arrive before the vnode they belong to */
+static afs_uint32 index_dirent_cb(afs_vnode *v, afs_dir_entry *de,
+                                  XFILE *X, void *refcon)
+{
+  index_state *is = (index_state *)refcon;
+  afs_uint32 *e, nl;
+
+  if (!strcmp(de->name, ".") || !strcmp(de->name, "..")) return 0;
+  drop_pending(is, v);
+  if (is->n_entries == is->pending) {
+    cp64(is->pending_offset, v->offset);
+    is->pending_names = is->names_size;
+  }
+  nl = strlen(de->name) + 1;
+  if (grow((void **)&is->entries, &is->max_entries, is->n_entries, 1,
+           3 * sizeof(afs_uint32))
+  ||  grow((void **)&is->names, &is->max_names, is->names_size, nl, 1))
+    return ENOMEM;
+  e = is->entries + 3 * is->n_entries++;
+  e[0] = de->vnode;
+  e[1] = de->uniq;
+  e[2] = is->names_size;
+  memcpy(is->names + is->names_size, de->name, nl);
+  is->names_size += nl;
+  return 0;
+}
+
+
+static afs_uint32 index_vnode_cb(afs_vnode *v, XFILE *X, void *refcon)
+{
+  index_state *is = (index_state *)refcon;
+  index_vnode *iv;
+
+  if (grow((void **)&is->vnodes, &is->max_vnodes, is->n_vnodes, 1,
+           sizeof(index_vnode)))
+    return ENOMEM;
+  iv = is->vnodes + is->n_vnodes++;
+  memset(iv, 0, sizeof(index_vnode));
+  iv->vnode = v->vnode;
+  iv->vuniq = v->vuniq;
+  if (v->field_mask & F_VNODE_TYPE)   iv->type = v->type;
+  if (v->field_mask & F_VNODE_PARENT) iv->parent = v->parent;
+  if (v->field_mask & F_VNODE_DVERS)  iv->datavers = v->datavers;
+  cp64(iv->v_offset, v->offset);
+  if (v->field_mask & F_VNODE_DATA) {
+    cp64(iv->d_offset, v->d_offset);
+    cp64(iv->d_size, v->size);
+  }
+  drop_pending(is, v);
+  iv->first_entry = is->pending;
+  iv->n_entries = is->n_entries - is->pending;
+  is->pending = is->n_entries;
+  return 0;
+}
+
+
+/* Sort vnodes by number; if a vnode appears twice, the later one wins */
+static int cmp_vnodes(const void *a, const void *b)
+{
+  const index_vnode *x = (const index_vnode *)a;
+  const index_vnode *y = (const index_vnode *)b;
+
+  if (x->vnode != y->vnode) return (x->vnode < y->vnode) ? -1 : 1;
+  if (ne64(x->v_offset, y->v_offset))
+    return lt64(x->v_offset, y->v_offset) ? -1 : 1;
+  return 0;
+}
+
+
+/* Write out the index.  Entries are rewritten in vnode order. */
+static afs_uint32 write_index(XFILE *OX, index_state *is, u_int64 *dump_size)
+{
+  unsigned char hdr[INDEX_HDR_SIZE], rec[INDEX_VNODE_SIZE];
+  index_vnode *iv;
+  afs_uint32 i, j, n, r, nv, ne;
+
+  /* Drop duplicates, keeping the last copy of each vnode */
+  for (i = nv = 0; i < is->n_vnodes; i++) {
+    if (i + 1 < is->n_vnodes && is->vnodes[i + 1].vnode == is->vnodes[i].vnode)
+      continue;
+    is->vnodes[nv++] = is->vnodes[i];
+  }
+  for (i = ne = 0; i < nv; i++) ne += is->vnodes[i].n_entries;
+
+  memset(hdr, 0, sizeof(hdr));
+  PUT32(hdr, 0, INDEX_MAGIC);
+  PUT32(hdr, 1, INDEX_VERSION);
+  PUT32(hdr, 2, nv);
+  PUT32(hdr, 3, ne);
+  PUT32(hdr, 4, is->names_size);
+  PUT32(hdr, 5, hi64(*dump_size));
+  PUT32(hdr, 6, lo64(*dump_size));
+  PUT32(hdr, 7, is->volid);
+  if (r = xfwrite(OX, hdr, sizeof(hdr))) return r;
+
+  for (i = n = 0; i < nv; i++) {
+    iv = is->vnodes + i;
+    PUT32(rec, 0, iv->vnode);
+    PUT32(rec, 1, iv->vuniq);
+    PUT32(rec, 2, iv->type);
+    PUT32(rec, 3, iv->parent);
+    PUT32(rec, 4, iv->datavers);
+    PUT32(rec, 5, hi64(iv->v_offset));
+    PUT32(rec, 6, lo64(iv->v_offset));
+    PUT32(rec, 7, hi64(iv->d_offset));
+    PUT32(rec, 8, lo64(iv->d_offset));
+    PUT32(rec, 9, hi64(iv->d_size));
+    PUT32(rec, 10, lo64(iv->d_size));
+    PUT32(rec, 11, n);
+    PUT32(rec, 12, iv->n_entries);
+    if (r = xfwrite(OX, rec, INDEX_VNODE_SIZE)) return r;
+    n += iv->n_entries;
+  }
+
+  for (i = 0; i < nv; i++) {
+    iv = is->vnodes + i;
+    for (j = 0; j < iv->n_entries; j++) {
+      n = 3 * (iv->first_entry + j);
+      PUT32(rec, 0, is->entries[n]);
+      PUT32(rec, 1, is->entries[n + 1]);
+      PUT32(rec, 2, is->entries[n + 2]);
+      if (r = xfwrite(OX, rec, INDEX_ENTRY_SIZE)) return r;
+    }
+  }
+
+  if (is->names_size && (r = xfwrite(OX, is->names, is->names_size)))
+    return r;
+  return 0;
+}
+
+
+/* Scan a dump, collecting what goes into its index */
+static afs_uint32 collect_index(XFILE *X, dump_parser *p, index_state *is,
+                                afs_uint32 flags, afs_uint32 repair_flags,
+                                u_int64 *dump_size)
+{
+  dump_parser my_p;
+  afs_uint32 r;
+
+  memset(is, 0, sizeof(index_state));
+  is->p = p;
+  memset(&my_p, 0, sizeof(my_p));
+  my_p.refcon         = (void *)is;
+  my_p.cb_volhdr      = index_volhdr_cb;
+  my_p.cb_vnode_dir   = index_vnode_cb;
+  my_p.cb_vnode_file  = index_vnode_cb;
+  my_p.cb_vnode_link  = index_vnode_cb;
+  my_p.cb_vnode_empty = index_vnode_cb;
+  my_p.cb_vnode_wierd = index_vnode_cb;
+  my_p.cb_dirent      = index_dirent_cb;
+  my_p.err_refcon     = p->err_refcon;
+  my_p.cb_error       = p->cb_error;
+  my_p.flags          = flags;
+  my_p.repair_flags   = repair_flags;
+  my_p.vnode_fields   = F_VNODE_TYPE | F_VNODE_PARENT | F_VNODE_DVERS
+                      | F_VNODE_SIZE | F_VNODE_DATA;
+
+  r = ParseDumpFile(X, &my_p);
+  if (!r) r = xftell(X, dump_size);
+  if (!r) qsort(is->vnodes, is->n_vnodes, sizeof(index_vnode), cmp_vnodes);
+  return r;
+}
+
+
+static void free_index_state(index_state *is)
+{
+  if (is->vnodes)  free(is->vnodes);
+  if (is->entries) free(is->entries);
+  if (is->names)   free(is->names);
+}
+
+
+/* Scan a dump and write an index for it to the named file */
+afs_uint32 DumpIndex_Build(XFILE *X, dump_parser *p, char *path)
+{
+  index_state is;
+  u_int64 dump_size;
+  XFILE OX;
+  afs_uint32 r;
+
+  r = collect_index(X, p, &is, p->flags, p->repair_flags, &dump_size);
+  if (!r) {
+    if (!(r = xfopen(&OX, O_RDWR | O_CREAT | O_TRUNC, path))) {
+      r = write_index(&OX, &is, &dump_size);
+      if (!r) r = xfclose(&OX);
+      else {
+        xfclose(&OX);
+        unlink(path);
+      }
+    }
+    if (r && p->cb_error)
+      (p->cb_error)(r, 1, p->err_refcon, "Unable to write index %s", path);
+  }
+  free_index_state(&is);
+  return r;
+}
+
+
+/* Append an index to a dump we have just written, followed by a trailer
+ * saying where to find it.  X must be open for reading and writing, and
+ * seekable; the dump is scanned from the beginning.  Readers stop at the
+ * dump end record, so they never see the extra data.
+ */
+afs_uint32 DumpIndex_Append(XFILE *X, dump_parser *p)
+{
+  unsigned char trailer[INDEX_TRAILER_SIZE];
+  index_state is;
+  u_int64 start, dump_size, end, size;
+  afs_uint32 r;
+
+  if (!X->is_seekable) {
+    if (p->cb_error)
+      (p->cb_error)(ESPIPE, 1, p->err_refcon,
+                    "Can't add an index to a dump that isn't seekable");
+    return ESPIPE;
+  }
+  mk64(start, 0, 0);
+  if (r = xfseek(X, &start)) return r;
+  r = collect_index(X, p, &is, DSFLAG_SEEK, 0, &dump_size);
+  if (!r) r = xfseek(X, &dump_size);
+  if (!r) r = write_index(X, &is, &dump_size);
+  if (!r) r = xftell(X, &end);
+  if (!r) {
+    sub64_64(size, end, dump_size);
+    if (hi64(size)) r = EFBIG;
+  }
+  if (!r) {
+    PUT32(trailer, 0, hi64(dump_size));
+    PUT32(trailer, 1, lo64(dump_size));
+    PUT32(trailer, 2, lo64(size));
+    PUT32(trailer, 3, INDEX_TRAILER_MAGIC);
+    r = xfwrite(X, trailer, sizeof(trailer));
+  }
+  if (r && p->cb_error)
+    (p->cb_error)(r, 1, p->err_refcon, "Unable to append index to dump");
+  free_index_state(&is);
+  return r;
+}
+
+
+/* Find the index at the end of a dump, if there is one.
+ * On success, *offset and *size say where it is.
+ */
+static afs_uint32 find_trailer(int fd, off_t file_size, off_t *offset,
+                               afs_uint32 *size)
+{
+  unsigned char trailer[INDEX_TRAILER_SIZE];
+  off_t start;
+
+  if (file_size < INDEX_TRAILER_SIZE + INDEX_HDR_SIZE) return DSERR_INDEX;
+  if (lseek(fd, file_size - INDEX_TRAILER_SIZE, SEEK_SET) < 0) return errno;
+  if (read(fd, trailer, INDEX_TRAILER_SIZE) != INDEX_TRAILER_SIZE)
+    return DSERR_INDEX;
+  if (GET32(trailer, 3) != INDEX_TRAILER_MAGIC) return DSERR_INDEX;
+  start = ((off_t)GET32(trailer, 0) << 16 << 16) | GET32(trailer, 1);
+  *size = GET32(trailer, 2);
+  if (start < 0 || *size < INDEX_HDR_SIZE
+  ||  start + *size != file_size - INDEX_TRAILER_SIZE)
+    return DSERR_INDEX;
+  *offset = start;
+  return 0;
+}
+
+
+/* Does this dump have an index at the end? */
+int DumpIndex_Embedded(char *dump_path)
+{
+  struct stat st;
+  afs_uint32 size;
+  off_t offset;
+  int fd, r;
+
+  if ((fd = open(dump_path, O_RDONLY)) < 0) return 0;
+  r = !fstat(fd, &st) && !find_trailer(fd, st.st_size, &offset, &size);
+  close(fd);
+  return r;
+}
+
+
+/* Open an index.  The index may be in a file by itself, or at the end of
+ * the dump it belongs to.  If dump_path is given, make sure a separate
+ * index is for a dump of the same size.
+ */
+afs_uint32 DumpIndex_Open(dump_index *di, char *path, char *dump_path)
+{
+  struct stat st;
+  unsigned char *idx;
+  afs_uint32 want, r, size;
+  off_t offset, base;
+  int fd, embedded = 0;
+
+  memset(di, 0, sizeof(dump_index));
+  if ((fd = open(path, O_RDONLY)) < 0) return errno;
+  if (fstat(fd, &st)) {
+    r = errno;
+    close(fd);
+    return r;
+  }
+  if (!find_trailer(fd, st.st_size, &offset, &size)) embedded = 1;
+  else if (st.st_size < INDEX_HDR_SIZE
+       ||  st.st_size != (off_t)(afs_uint32)st.st_size) {
+    close(fd);
+    return DSERR_INDEX;
+  } else {
+    offset = 0;
+    size = st.st_size;
+  }
+
+  /* The mapping must start on a page boundary */
+  base = offset - offset % sysconf(_SC_PAGESIZE);
+  di->map_size = size + (offset - base);
+  di->map = (char *)mmap(0, di->map_size, PROT_READ, MAP_SHARED, fd, base);
+  close(fd);
+  if (di->map == (char *)MAP_FAILED) {
+    di->map = 0;
+    return errno;
+  }
+  idx = (unsigned char *)di->map + (offset - base);
+
+  if (GET32(idx, 0) != INDEX_MAGIC || GET32(idx, 1) != INDEX_VERSION) {
+    DumpIndex_Close(di);
+    return DSERR_INDEX;
+  }
+  di->n_vnodes   = GET32(idx, 2);
+  di->n_entries  = GET32(idx, 3);
+  di->names_size = GET32(idx, 4);
+  mk64(di->dump_size, GET32(idx, 5), GET32(idx, 6));
+  di->volid      = GET32(idx, 7);
+
+  want = INDEX_HDR_SIZE;
+  if (di->n_vnodes  > (size - want) / INDEX_VNODE_SIZE
+  ||  di->n_entries > (size - want - di->n_vnodes * INDEX_VNODE_SIZE)
+                      / INDEX_ENTRY_SIZE) {
+    DumpIndex_Close(di);
+    return DSERR_INDEX;
+  }
+  want += di->n_vnodes * INDEX_VNODE_SIZE + di->n_entries * INDEX_ENTRY_SIZE;
+  if (size - want != di->names_size
+  ||  (di->names_size && idx[size - 1])) {
+    DumpIndex_Close(di);
+    return DSERR_INDEX;
+  }
+  di->vnodes  = idx + INDEX_HDR_SIZE;
+  di->entries = di->vnodes + di->n_vnodes * INDEX_VNODE_SIZE;
+  di->names   = (char *)di->entries + di->n_entries * INDEX_ENTRY_SIZE;
+
+  /* An embedded index must describe the dump it is attached to */
+  if (embedded) {
+    if (hi64(di->dump_size) != (afs_uint32)(offset >> 16 >> 16)
+    ||  lo64(di->dump_size) != (afs_uint32)offset) {
+      DumpIndex_Close(di);
+      return DSERR_INDEX;
+    }
+  } else if (dump_path) {
+    /* If the dump has its own index too, don't count that */
+    if ((fd = open(dump_path, O_RDONLY)) < 0 || fstat(fd, &st)) {
+      r = errno;
+      if (fd >= 0) close(fd);
+      DumpIndex_Close(di);
+      return r;
+    }
+    if (find_trailer(fd, st.st_size, &offset, &size)) offset = st.st_size;
+    close(fd);
+    if ((afs_uint32)(offset >> 16 >> 16) != hi64(di->dump_size)
+    ||  (afs_uint32)offset != lo64(di->dump_size)) {
+      DumpIndex_Close(di);
+      return DSERR_INDEX;
+    }
+  }
+  return 0;
+}
+
+
+/* Close an index */
+void DumpIndex_Close(dump_index *di)
+{
+  if (di->map) munmap(di->map, di->map_size);
+  memset(di, 0, sizeof(dump_index));
+}
+
+
+/* Get the i'th vnode in an index */
+afs_uint32 DumpIndex_Get(dump_index *di, afs_uint32 i, index_vnode *iv)
+{
+  unsigned char *rec;
+
+  if (i >= di->n_vnodes) return ENOENT;
+  rec = di->vnodes + i * INDEX_VNODE_SIZE;
+  iv->vnode    = GET32(rec, 0);
+  iv->vuniq    = GET32(rec, 1);
+  iv->type     = GET32(rec, 2);
+  iv->parent   = GET32(rec, 3);
+  iv->datavers = GET32(rec, 4);
+  mk64(iv->v_offset, GET32(rec, 5), GET32(rec, 6));
+  mk64(iv->d_offset, GET32(rec, 7), GET32(rec, 8));
+  mk64(iv->d_size,   GET32(rec, 9), GET32(rec, 10));
+  iv->first_entry = GET32(rec, 11);
+  iv->n_entries   = GET32(rec, 12);
+  if (iv->first_entry > di->n_entries
+  ||  iv->n_entries > di->n_entries - iv->first_entry)
+    return DSERR_INDEX;
+  return 0;
+}
+
+
+/* Find a vnode in an index, by number */
+afs_uint32 DumpIndex_Find(dump_index *di, afs_uint32 vnode, index_vnode *iv)
+{
+  afs_uint32 lo = 0, hi = di->n_vnodes, mid, x;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    x = GET32(di->vnodes + mid * INDEX_VNODE_SIZE, 0);
+    if (x == vnode) return DumpIndex_Get(di, mid, iv);
+    if (x < vnode) lo = mid + 1;
+    else hi = mid;
+  }
+  return ENOENT;
+}
+
+
+/* Get the i'th directory entry in an index.  The name is not a copy. */
+afs_uint32 DumpIndex_Entry(dump_index *di, afs_uint32 i, char **name,
+                           afs_uint32 *vnode, afs_uint32 *vuniq)
+{
+  unsigned char *rec;
+  afs_uint32 off;
+
+  if (i >= di->n_entries) return ENOENT;
+  rec = di->entries + i * INDEX_ENTRY_SIZE;
+  off = GET32(rec, 2);
+  if (off >= di->names_size) return DSERR_INDEX;
+  if (name)  *name  = di->names + off;
+  if (vnode) *vnode = GET32(rec, 0);
+  if (vuniq) *vuniq = GET32(rec, 1);
+  return 0;
+}
+
+
+/* Look up a name in a directory, using only the index */
+afs_uint32 DumpIndex_Lookup(dump_index *di, afs_uint32 dir, char *name,
+                            afs_uint32 *vnode)
+{
+  index_vnode iv;
+  afs_uint32 i, r;
+  char *x;
+
+  if (r = DumpIndex_Find(di, dir, &iv)) return r;
+  for (i = 0; i < iv.n_entries; i++) {
+    if (r = DumpIndex_Entry(di, iv.first_entry + i, &x, vnode, 0)) return r;
+    if (!strcmp(x, name)) return 0;
+  }
+  return ENOENT;
+}
@@ -0,0 +1,268 @@
+/*
+ * CMUCS AFStools
+ * dumpscan - routines for scanning and manipulating AFS volume dumps
+ *
+ * Copyright (c) 1998, 2001 Carnegie Mellon University
+ * All Rights Reserved.
+ * 
+ * Permission to use, copy, modify and distribute this software and its
+ * documentation is hereby granted, provided that both the copyright
+ * notice and this permission notice appear in all copies of the
+ * software, derivative works or modified versions, and any portions
+ * thereof, and that both notices appear in supporting documentation.
+ *
+ * CARNEGIE MELLON ALLOWS FREE USE OF THIS SOFTWARE IN ITS "AS IS"
+ * CONDITION.  CARNEGIE MELLON DISCLAIMS ANY LIABILITY OF ANY KIND FOR
+ * ANY DAMAGES WHATSOEVER RESULTING FROM THE USE OF THIS SOFTWARE.
+ *
+ * Carnegie Mellon requests users of this software to return to
+ *
+ *  Software Distribution Coordinator  or  Software_Distribution@CS.CMU.EDU
+ *  School of Computer Science
+ *  Carnegie Mellon University
+ *  Pittsburgh PA 15213-3890
+ *
+ * any improvements or extensions that they make and grant Carnegie Mellon
+ * the rights to redistribute these changes.
+ */
+
+/* dumpreader.c - Read a volume dump one item at a time */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "dumpscan.h"
+#include "dumpscan_errs.h"
+#include "dumpfmt.h"
+#include "internal.h"
+#include "stagehdr.h"
+
+#define DRSTATE_NEEDTAG  0  /* Next thing in the dump is a tag */
+#define DRSTATE_HAVETAG  1  /* We already read the next tag */
+#define DRSTATE_DATA     2  /* In the middle of vnode data */
+#define DRSTATE_DONE     3  /* Saw the end of the dump */
+#define DRSTATE_ERROR    4  /* Something went wrong */
+
+/** Field list for top-level objects; the same as in parsedump.c **/
+static tagged_field reader_fields[] = {
+  { TAG_DUMPHEADER,  DKIND_SPECIAL, "* DUMP HEADER",   parse_dumphdr, 0, 0 },
+  { TAG_VOLHEADER,   DKIND_SPECIAL, "* VOLUME HEADER", parse_volhdr,  0, 0 },
+  { TAG_VNODE,       DKIND_SPECIAL, "* VNODE ",        parse_vnode,   0, 0 },
+  { TAG_DUMPEND,     DKIND_INT32,   "* DUMP END",      parse_dumpend, 0, 0 },
+  { V20_VERSMIN,     DKIND_SPECIAL, "* STAGE HEADER",  try_backuphdr, 0, 0 },
+  { 'S',             DKIND_SPECIAL, "* STAGE HEADER",  try_backuphdr, 0, 0 },
+  { 0,0,0,0,0,0 }};
+
+
+/** Callbacks that save each item as it is parsed.  Each takes over
+ ** any strings in the item, so the parser won't free them.
+ **/
+static afs_uint32 save_bckhdr(backup_system_header *hdr, XFILE *X,
+                              void *refcon)
+{
+  dump_item *item = &((dump_reader *)refcon)->item;
+
+  item->kind = DRITEM_BCKHDR;
+  item->bckhdr = *hdr;
+  hdr->server = hdr->part = hdr->volname = 0;
+  return 0;
+}
+
+static afs_uint32 save_dumphdr(afs_dump_header *hdr, XFILE *X, void *refcon)
+{
+  dump_item *item = &((dump_reader *)refcon)->item;
+
+  item->kind = DRITEM_DUMPHDR;
+  item->dumphdr = *hdr;
+  hdr->field_mask &= ~F_DUMPHDR_VOLNAME;
+  return 0;
+}
+
+static afs_uint32 save_volhdr(afs_vol_header *hdr, XFILE *X, void *refcon)
+{
+  dump_item *item = &((dump_reader *)refcon)->item;
+
+  item->kind = DRITEM_VOLHDR;
+  item->volhdr = *hdr;
+  hdr->field_mask &= ~(F_VOLHDR_VOLNAME | F_VOLHDR_OFFLINE_MSG | F_VOLHDR_MOTD);
+  return 0;
+}
+
+static afs_uint32 save_vnode(afs_vnode *v, XFILE *X, void *refcon)
+{
+  dump_item *item = &((dump_reader *)refcon)->item;
+
+  item->kind = DRITEM_VNODE;
+  item->vnode = *v;
+  v->field_mask &= ~F_VNODE_LINK_TARGET;
+  return 0;
+}
+
+
+/* Free any strings belonging to an item */
+void DumpReader_FreeItem(dump_item *item)
+{
+  switch (item->kind) {
+  case DRITEM_BCKHDR:
+    if (item->bckhdr.server)  free(item->bckhdr.server);
+    if (item->bckhdr.part)    free(item->bckhdr.part);
+    if (item->bckhdr.volname) free(item->bckhdr.volname);
+    break;
+
+  case DRITEM_DUMPHDR:
+    if (item->dumphdr.field_mask & F_DUMPHDR_VOLNAME)
+      free(item->dumphdr.volname);
+    break;
+
+  case DRITEM_VOLHDR:
+    if (item->volhdr.field_mask & F_VOLHDR_VOLNAME)
+      free(item->volhdr.volname);
+    if (item->volhdr.field_mask & F_VOLHDR_OFFLINE_MSG)
+      free(item->volhdr.offline_msg);
+    if (item->volhdr.field_mask & F_VOLHDR_MOTD)
+      free(item->volhdr.motd_msg);
+    break;
+
+  case DRITEM_VNODE:
+    if (item->vnode.field_mask & F_VNODE_LINK_TARGET)
+      free(item->vnode.link_target);
+    break;
+  }
+  item->kind = 0;
+}
+
+
+/* Prepare to read a dump from X.  Error reporting, seekability, and
+ * printing are controlled by p, which is copied; the callbacks in p
+ * are not used.  Repair options are not supported.
+ */
+afs_uint32 DumpReader_Open(dump_reader *dr, XFILE *X, dump_parser *p)
+{
+  memset(dr, 0, sizeof(*dr));
+  dr->X = X;
+  dr->state = DRSTATE_NEEDTAG;
+
+  dr->p.err_refcon   = p->err_refcon;
+  dr->p.cb_error     = p->cb_error;
+  dr->p.flags        = (p->flags & DSFLAG_SEEK) | DSFLAG_DEFER;
+  dr->p.print_flags  = p->print_flags;
+  dr->p.vnode_fields = p->vnode_fields;
+  dr->p.refcon       = (void *)dr;
+  dr->p.cb_bckhdr      = save_bckhdr;
+  dr->p.cb_dumphdr     = save_dumphdr;
+  dr->p.cb_volhdr      = save_volhdr;
+  dr->p.cb_vnode_dir   = save_vnode;
+  dr->p.cb_vnode_file  = save_vnode;
+  dr->p.cb_vnode_link  = save_vnode;
+  dr->p.cb_vnode_empty = save_vnode;
+  dr->p.cb_vnode_wierd = save_vnode;
+  return 0;
+}
+
+
+/* Get the next item from the dump.  On success, *item points to an item
+ * which remains valid until the next call to DumpReader_Next or
+ * DumpReader_Close; use DumpReader_Keep to hang onto it for longer.
+ * If the item is a vnode, its data (if any) may be read using
+ * DumpReader_ReadData; whatever is not read is skipped.  At the end of
+ * the dump, the item kind is DRITEM_END, and stays that way.
+ */
+afs_uint32 DumpReader_Next(dump_reader *dr, dump_item **item)
+{
+  tag_parse_info pi;
+  tagged_field *field;
+  afs_uint32 r, value = 0;
+
+  *item = &dr->item;
+  switch (dr->state) {
+    case DRSTATE_DONE:  return 0;
+    case DRSTATE_ERROR: return dr->error;
+  }
+  DumpReader_FreeItem(&dr->item);
+
+  if (dr->state == DRSTATE_DATA) {
+    if (r = xfskip64(dr->X, &dr->remain)) goto fail;
+    dr->state = DRSTATE_NEEDTAG;
+  }
+  if (dr->state == DRSTATE_NEEDTAG) {
+    if (r = ReadByte(dr->X, &dr->tag)) goto fail;
+    dr->state = DRSTATE_HAVETAG;
+  }
+
+  for (field = reader_fields; field->tag; field++)
+    if (field->tag == (char)dr->tag) break;
+  if (!field->tag) {
+    r = 0;
+    goto fail;
+  }
+
+  prep_pi(&dr->p, &pi);
+  if (field->kind == DKIND_INT32 && (r = ReadInt32(dr->X, &value)))
+    goto fail;
+  r = (field->func)(dr->X, &dr->tag, field, value, &pi, (void *)&dr->p, 0);
+
+  if (field->tag == TAG_DUMPEND) {
+    if (r != DSERR_DONE) goto fail;
+    dr->item.kind = DRITEM_END;
+    dr->state = DRSTATE_DONE;
+    return 0;
+  }
+  if (r == DSERR_DONE && dr->item.kind == DRITEM_VNODE) {
+    /* Stopped at the vnode data */
+    cp64(dr->remain, dr->item.vnode.size);
+    dr->state = DRSTATE_DATA;
+    return 0;
+  }
+  if (r) goto fail;
+  return 0;
+
+fail:
+  DumpReader_FreeItem(&dr->item);
+  dr->error = handle_return(r, dr->X, dr->tag, &dr->p);
+  if (!dr->error) dr->error = DSERR_TAG;
+  dr->state = DRSTATE_ERROR;
+  return dr->error;
+}
+
+
+/* Read up to n bytes of the current vnode's data into buf.  The number
+ * of bytes read is stored in *nread; this is 0 at the end of the data.
+ */
+afs_uint32 DumpReader_ReadData(dump_reader *dr, char *buf, afs_uint32 n,
+                               afs_uint32 *nread)
+{
+  afs_uint32 r;
+
+  *nread = 0;
+  if (dr->state != DRSTATE_DATA) return 0;
+  if (!hi64(dr->remain) && lo64(dr->remain) < n) n = lo64(dr->remain);
+  if (!n) return 0;
+  if (r = xfread(dr->X, buf, n)) {
+    DumpReader_FreeItem(&dr->item);
+    dr->error = handle_return(r, dr->X, 0, &dr->p);
+    dr->state = DRSTATE_ERROR;
+    return dr->error;
+  }
+  sub64_32(dr->remain, dr->remain, n);
+  *nread = n;
+  return 0;
+}
+
+
+/* Copy the current item into *item, which then belongs to the caller
+ * and must eventually be released using DumpReader_FreeItem.
+ */
+void DumpReader_Keep(dump_reader *dr, dump_item *item)
+{
+  *item = dr->item;
+  dr->item.kind = 0;
+  if (item->kind == DRITEM_END) dr->item.kind = DRITEM_END;
+}
+
+
+/* Release anything held by the reader.  This does not close the XFILE. */
+void DumpReader_Close(dump_reader *dr)
+{
+  DumpReader_FreeItem(&dr->item);
+  dr->state = DRSTATE_DONE;
+}
@@ -46,6 +46,8 @@ typedef struct tag_parse_info tag_parse_info;
 typedef afs_uint32 (*tag_parser)(XFILE *, unsigned char *, tagged_field *,
                               afs_uint32, tag_parse_info *, void *, void *);
 typedef struct dir_state dir_state;
+typedef struct dir_cache dir_cache;
+typedef struct path_selector path_selector;
 
 /* Error codes used within dumpscan.
  * Any of the routines declared below, or callbacks used by them,
@@ -177,6 +179,7 @@ typedef struct {
 #define F_VNODE_PARTIAL       0x00002000 /* Partial vnode continuation (no header) */
 #define F_VNODE_LINK_TARGET   0x00004000 /* Symlink target present */
 #define F_VNODE_SIZE_HI       0x00008000 /* Set if high 32 bits of size are present */
+#define F_VNODE_BUFFER        0x00010000 /* Data buffered in memory */
 typedef struct {
   u_int64 offset;              /* Where in the input stream is it? */
   afs_uint32 field_mask;       /* What fields are present? */
@@ -195,10 +198,35 @@ typedef struct {
   u_int64 size;                /* Size of data */
   u_int64 d_offset;            /* Where in the input stream is the data? */
   char *link_target;           /* Target of symbolic link */
+  char *data;                  /* Vnode data, if buffered (see cb_vnode_attrs) */
+  /* Directory ACL; valid only if F_VNODE_ACL is set.  This must be last. */
   unsigned char acl[SIZEOF_LARGEDISKVNODE - SIZEOF_SMALLDISKVNODE];
 } afs_vnode;
 
 
+/** A batch of vnodes, stored one array per field **/
+#define VNODE_BATCH_SIZE 4096
+typedef struct {
+  afs_uint32 count;                             /* Vnodes in this batch */
+  afs_uint32 field_mask[VNODE_BATCH_SIZE];      /* F_VNODE_* */
+  afs_uint32 vnode[VNODE_BATCH_SIZE];
+  afs_uint32 vuniq[VNODE_BATCH_SIZE];
+  unsigned char type[VNODE_BATCH_SIZE];
+  afs_uint16 nlinks[VNODE_BATCH_SIZE];
+  afs_uint16 mode[VNODE_BATCH_SIZE];
+  afs_uint32 parent[VNODE_BATCH_SIZE];
+  afs_uint32 datavers[VNODE_BATCH_SIZE];
+  afs_uint32 author[VNODE_BATCH_SIZE];
+  afs_uint32 owner[VNODE_BATCH_SIZE];
+  afs_uint32 group[VNODE_BATCH_SIZE];
+  afs_uint32 client_date[VNODE_BATCH_SIZE];
+  afs_uint32 server_date[VNODE_BATCH_SIZE];
+  u_int64 size[VNODE_BATCH_SIZE];
+  u_int64 offset[VNODE_BATCH_SIZE];
+  u_int64 d_offset[VNODE_BATCH_SIZE];
+} vnode_batch;
+
+
 /** AFS directory entry **/
 typedef struct {
   int  slot;                /* Directory slot # (info only) */
@@ -278,8 +306,44 @@ typedef struct {
   /* This function is called for each directory entry, if set */
   afs_uint32 (*cb_dirent)(afs_vnode *, afs_dir_entry *, XFILE *, void *);
 
+  /* If set, this is called with batches of up to VNODE_BATCH_SIZE vnodes,
+   * in addition to any per-vnode callbacks.  Symlink targets and ACL's
+   * are not included.  The last batch is delivered at the end of the dump
+   * by ParseDumpFile; callers of ParseVNode must use FlushVNodeBatch.
+   */
+  afs_uint32 (*cb_vnode_batch)(vnode_batch *, XFILE *, void *);
+
+  /* If set, this is called when a vnode's attributes have been parsed,
+   * before its data is read.  It may store a DSDATA_* value in *disp
+   * to choose what happens to the data; the default is as if this
+   * callback were not set.  It is called even for a vnode with no
+   * data, in which case *disp is ignored.  Data of 4G or more can't
+   * be buffered; it is streamed instead, with a warning.  This callback
+   * must not use the input file.
+   */
+  afs_uint32 (*cb_vnode_attrs)(afs_vnode *, int *disp, void *);
+#define DSDATA_DEFAULT  0       /* Read symlinks, parse dirs if cb_dirent */
+#define DSDATA_SKIP     1       /* Skip the data; no data callback */
+#define DSDATA_STREAM   2       /* Just call the data callback */
+#define DSDATA_BUFFER   3       /* Read into v->data; no data callback */
+#define DSDATA_DIR      4       /* Parse as a directory, using cb_dirent */
+
+  /* If set, this is called with each vnode's data, in order, in chunks
+   * of up to 64K; the last chunk is flagged.  The offset is that of the
+   * chunk within the data.  This sees any data the parser doesn't use
+   * itself, plus symlink targets and buffered data (from memory), and
+   * is called once with no data for vnodes that have none.  It should
+   * be used instead of the data callbacks; it works on non-seekable
+   * input and the caller does no I/O.
+   */
+  afs_uint32 (*cb_data_chunk)(afs_vnode *, char *buf, afs_uint32 len,
+                              u_int64 *offset, int last, void *);
+
   int flags;            /* Flags and options */
 #define DSFLAG_SEEK     0x0001  /* Input file is seekable */
+#define DSFLAG_UNORDERED 0x0002 /* Parallel: vnodes may arrive out of order */
+#define DSFLAG_DEFER    0x0004  /* Stop at vnode data (used by DumpReader) */
+#define DSFLAG_HDRONLY  0x0008  /* Stop at the first vnode */
 
   int print_flags;      /* Flags to control what is printed */
 #define DSPRINT_BCKHDR  0x0001  /* Print backup system header */
@@ -299,30 +363,147 @@ typedef struct {
 #define DSFIX_VDSYNC    0x0004  /* Resync location after vnode data */
 #define DSFIX_VFSYNC    0x0008  /* Try to resync after bad vnode */
 
+  afs_uint32 vnode_fields; /* F_VNODE_* fields the callbacks will use; others
+                            * are skipped, not stored or printed.  The type
+                            * and size are always decoded.  0 means all. */
+
   /** Things below this point for internal use only **/
   afs_uint32 vol_uniquifier;
+  afs_uint32 last_good_vnode;
+  vnode_batch *batch;
 } dump_parser;
 
 
-/** Hash table and control info for pathname manipulation **/
-typedef struct vhash_ent {
-  struct vhash_ent *next;    /* Pointer to next entry */
+/** Vnode tables and control info for pathname manipulation **/
+typedef struct vhash_ent {   /* One vnode, as returned by Path_Follow */
   afs_uint32 vnode;             /* VNode number */
   afs_uint32 parent;            /* Parent VNode number */
   u_int64 v_offset;          /* Offset to start of vnode */
   u_int64 d_offset;          /* Offset to data (0 if none) */
   u_int64 d_size;            /* Size of data */
 } vhash_ent;
+typedef struct {             /* Per-vnode arrays; see pathname.c */
+  afs_uint32 size;              /* Number of slots allocated */
+  unsigned char *present;    /* Nonzero if the slot is in use */
+  afs_uint32 *parent;           /* Parent VNode number */
+  u_int64 *v_offset;         /* Offset to start of vnode */
+  u_int64 *d_offset;         /* Offset to data (0 if none) */
+  u_int64 *d_size;           /* Size of data */
+  afs_uint32 *name;             /* Name in name_dir (name pool offset, or 0) */
+  afs_uint32 *name_dir;         /* Directory in which name was found */
+  afs_uint32 *path[2];          /* Cached path (path pool offset, or 0);
+                                 * [1] is the path made of vnode numbers.
+                                 * Directories and sparse table only. */
+  afs_uint32 *vnode;            /* VNode number (sparse table only) */
+} vnode_table;
+typedef struct {             /* A name a file has besides its main one */
+  afs_uint32 vnode;             /* VNode number */
+  afs_uint32 dir;               /* Directory it is in */
+  afs_uint32 name;              /* Its name there (name pool offset) */
+} path_link;
 typedef struct {
   afs_uint32 n_vnodes;          /* Number of vnodes in volume */
   afs_uint32 n_dirs;            /* Number of file vnodes */
   afs_uint32 n_files;           /* Number of directory vnodes */
-  int hash_size;             /* Hash table size (bits) */
-  vhash_ent **hash_table;    /* Hash table */
+  afs_uint32 dense_max;         /* Largest index kept in a dense table */
+  vnode_table tables[3];     /* Files, directories (by vnode >> 1), sparse */
+  afs_uint32 *sparse_hash;      /* Open hash of sparse table slots + 1 */
+  afs_uint32 sparse_hash_size;  /* Slots in sparse_hash (a power of 2) */
+  afs_uint32 n_sparse;          /* Vnodes in sparse table */
   dump_parser *p;            /* Dump parser to use */
+  dir_cache *dcache;         /* Decoded directories (see dircache.c) */
+  char *names;               /* Pool of interned names */
+  afs_uint32 names_len;         /* Bytes used in name pool */
+  afs_uint32 names_max;         /* Bytes allocated for name pool */
+  afs_uint32 *name_hash;        /* Open hash of name pool offsets */
+  afs_uint32 name_hash_size;    /* Slots in name_hash (a power of 2) */
+  afs_uint32 n_names;           /* Distinct names in pool */
+  char *paths;               /* Pool of cached directory paths */
+  afs_uint32 paths_len;         /* Bytes used in path pool */
+  afs_uint32 paths_max;         /* Bytes allocated for path pool */
+  path_link *links;          /* Other names of files with several */
+  afs_uint32 n_links;           /* Entries in links */
+  afs_uint32 max_links;         /* Entries allocated for links */
+  int links_sorted;          /* Nonzero if links is sorted by vnode */
 } path_hashinfo;
 
 
+/** A vnode, as recorded in a dump index **/
+typedef struct {
+  afs_uint32 vnode;          /* VNode number */
+  afs_uint32 vuniq;          /* Uniquifier */
+  afs_uint32 type;           /* Vnode type (0 if unknown) */
+  afs_uint32 parent;         /* Parent VNode number (0 if unknown) */
+  afs_uint32 datavers;       /* Data version */
+  u_int64 v_offset;          /* Offset to start of vnode */
+  u_int64 d_offset;          /* Offset to data (0 if none) */
+  u_int64 d_size;            /* Size of data */
+  afs_uint32 first_entry;    /* First directory entry (directories only) */
+  afs_uint32 n_entries;      /* Number of directory entries */
+} index_vnode;
+
+/** An open dump index (see dumpindex.c for the file format) **/
+typedef struct {
+  char *map;                 /* The index, mapped into memory */
+  afs_uint32 map_size;       /* Size of the mapping */
+  afs_uint32 n_vnodes;       /* Number of vnodes */
+  afs_uint32 n_entries;      /* Number of directory entries */
+  afs_uint32 volid;          /* Volume ID (0 if unknown) */
+  u_int64 dump_size;         /* Size of the dump that was indexed */
+  unsigned char *vnodes;     /* Vnode records, sorted by vnode number */
+  unsigned char *entries;    /* Directory entry records */
+  char *names;               /* Directory entry names */
+  afs_uint32 names_size;     /* Size of names */
+} dump_index;
+
+/** Items returned by the pull-style dump reader **/
+typedef struct {
+  int kind;                            /* What kind of item is this? */
+#define DRITEM_BCKHDR   1               /* Backup system header */
+#define DRITEM_DUMPHDR  2               /* AFS dump header */
+#define DRITEM_VOLHDR   3               /* AFS volume header */
+#define DRITEM_VNODE    4               /* Vnode (data follows) */
+#define DRITEM_END      5               /* End of dump */
+  backup_system_header bckhdr;
+  afs_dump_header dumphdr;
+  afs_vol_header volhdr;
+  afs_vnode vnode;
+} dump_item;
+
+/** State for the pull-style dump reader **/
+typedef struct {
+  XFILE *X;                  /* Dump being read */
+  dump_parser p;             /* Private copy of the caller's parser */
+  dump_item item;            /* Current item */
+  u_int64 remain;            /* Vnode data not yet read */
+  afs_uint32 error;          /* Error that stopped us, if any */
+  unsigned char tag;         /* Next tag, if we have it */
+  int state;                 /* Where we are (internal) */
+} dump_reader;
+
+
+/** Error summary, for dumps with more errors than anyone wants to read **/
+#define ERRSUM_MSGLEN   256     /* Longest message we keep */
+#define ERRSUM_HASHSIZE 64
+typedef struct error_site {
+  struct error_site *next;
+  afs_uint32 code;           /* Error code */
+  char *fmt;                 /* Message format; identifies the call site */
+  afs_uint32 count;          /* Number of times seen */
+  char *last;                /* Last few suppressed messages (ring) */
+  u_int64 *offsets;          /* Where in the dump each of those was seen */
+} error_site;
+typedef struct {
+  void *err_refcon;          /* Where messages go, taken from the parser */
+  afs_uint32 (*cb_error)(afs_uint32, int, void *, char *, ...);
+  XFILE *X;                  /* Dump being parsed, for offsets (or 0) */
+  afs_uint32 keep;           /* Messages to print and keep, per site */
+  afs_uint32 interval;       /* Print progress every so many (0 = never) */
+  afs_uint32 total;          /* Errors seen */
+  afs_uint32 suppressed;     /* Errors not printed */
+  error_site *sites[ERRSUM_HASHSIZE];
+} error_summary;
+
 /** Function prototypes **/
 /** Only the functions declared below are public interfaces **/
 /** Maybe someday, I'll write man pages for these **/
@@ -360,6 +541,41 @@ extern afs_uint32 ParseDumpHeader(XFILE *, dump_parser *);
 extern afs_uint32 ParseVolumeHeader(XFILE *, dump_parser *);
 extern afs_uint32 ParseVNode(XFILE *, dump_parser *);
 
+/* parsevnode.c - Parse vnodes */
+extern afs_uint32 FlushVNodeBatch(XFILE *, dump_parser *);
+
+/* parallel.c - Parse a seekable volume dump using multiple threads */
+extern afs_uint32 ScanVNodeOffsets(XFILE *, dump_parser *,
+                                   u_int64 **, afs_uint32 *);
+extern afs_uint32 ParseDumpFileParallel(XFILE *, char *, dump_parser *, int);
+
+/* dumpreader.c - Read a volume dump one item at a time */
+extern afs_uint32 DumpReader_Open(dump_reader *, XFILE *, dump_parser *);
+extern afs_uint32 DumpReader_Next(dump_reader *, dump_item **);
+extern afs_uint32 DumpReader_ReadData(dump_reader *, char *, afs_uint32,
+                                      afs_uint32 *);
+extern void DumpReader_Keep(dump_reader *, dump_item *);
+extern void DumpReader_FreeItem(dump_item *);
+extern void DumpReader_Close(dump_reader *);
+
+/* dumpindex.c - Build and use a vnode index kept next to a dump */
+extern afs_uint32 DumpIndex_Build(XFILE *, dump_parser *, char *);
+extern afs_uint32 DumpIndex_Append(XFILE *, dump_parser *);
+extern int DumpIndex_Embedded(char *);
+extern afs_uint32 DumpIndex_Open(dump_index *, char *, char *);
+extern void DumpIndex_Close(dump_index *);
+extern afs_uint32 DumpIndex_Get(dump_index *, afs_uint32, index_vnode *);
+extern afs_uint32 DumpIndex_Find(dump_index *, afs_uint32, index_vnode *);
+extern afs_uint32 DumpIndex_Entry(dump_index *, afs_uint32, char **,
+                                  afs_uint32 *, afs_uint32 *);
+extern afs_uint32 DumpIndex_Lookup(dump_index *, afs_uint32, char *,
+                                   afs_uint32 *);
+
+/* errsum.c - Summarize errors instead of printing them all */
+extern void ErrorSummary_Init(error_summary *, dump_parser *, XFILE *,
+                              afs_uint32, afs_uint32);
+extern afs_uint32 ErrorSummary_Report(error_summary *);
+extern void ErrorSummary_Free(error_summary *);
 
 /* directory.c - Directory parsing, lookup, and generation */
 extern afs_uint32 ParseDirectory(XFILE *, dump_parser *, afs_uint32, int);
@@ -372,6 +588,13 @@ extern afs_uint32 Dir_Finalize(dir_state *);
 extern afs_uint32 Dir_EmitData(dir_state *, XFILE *, int);
 extern afs_uint32 Dir_Free(dir_state *ds);
 
+/* dircache.c - Cache of decoded directories */
+extern afs_uint32 DirCache_Init(dir_cache **, afs_uint32);
+extern afs_uint32 DirCache_Lookup(dir_cache *, XFILE *, dump_parser *,
+                                  afs_uint32, u_int64 *, afs_uint32,
+                                  char **, afs_uint32 *, afs_uint32 *);
+extern void DirCache_Free(dir_cache *);
+
 
 /* dump.c - Dump parts of a volume dump */
 extern afs_uint32 DumpDumpHeader(XFILE *, afs_dump_header *);
@@ -380,10 +603,34 @@ extern afs_uint32 DumpVNode(XFILE *, afs_vnode *);
 extern afs_uint32 DumpVNodeData(XFILE *, char *, u_int64 *);
 extern afs_uint32 CopyVNodeData(XFILE *, XFILE *, u_int64 *);
 
+/* tarfile.c - Write volume contents as a tar stream */
+extern afs_uint32 Tar_Header(XFILE *, afs_vnode *, char *, char *);
+extern afs_uint32 Tar_Pad(XFILE *, u_int64 *);
+extern afs_uint32 Tar_End(XFILE *);
+
 /* pathname.c - Follow and construct pathnames */
 extern afs_uint32 Path_PreScan(XFILE *, path_hashinfo *, int);
+extern afs_uint32 Path_Init(path_hashinfo *, afs_uint32);
+extern afs_uint32 Path_AddEntry(afs_vnode *, afs_dir_entry *, XFILE *, void *);
+extern afs_uint32 Path_FromIndex(path_hashinfo *, dump_index *);
 extern void Path_FreeHashTable(path_hashinfo *);
 extern afs_uint32 Path_Follow(XFILE *, path_hashinfo *, char *, vhash_ent *);
+extern afs_uint32 Path_FollowMany(XFILE *, path_hashinfo *, int, char **,
+                                  vhash_ent *, afs_uint32 *);
 extern afs_uint32 Path_Build(XFILE *, path_hashinfo *, afs_uint32, char **, int);
+extern afs_uint32 Path_BuildLinks(XFILE *, path_hashinfo *, afs_uint32,
+                                  char ***, int *, int);
+
+/* pathsel.c - Select vnodes by path, pattern, or number */
+#define PSEL_GLOB       0x0000  /* Pattern is a shell glob */
+#define PSEL_REGEX      0x0001  /* Pattern is an extended regex */
+#define PSEL_EXCLUDE    0x0002  /* Pattern excludes, rather than includes */
+extern afs_uint32 PathSel_Init(path_selector **);
+extern afs_uint32 PathSel_AddPath(path_selector *, char *);
+extern afs_uint32 PathSel_AddVnode(path_selector *, afs_uint32);
+extern afs_uint32 PathSel_AddPattern(path_selector *, char *, int);
+extern int PathSel_Match(path_selector *, afs_uint32, char *);
+extern int PathSel_Skip(path_selector *, afs_uint32, afs_uint32);
+extern void PathSel_Free(path_selector *);
 
 #endif
@@ -0,0 +1,202 @@
+/*
+ * CMUCS AFStools
+ * dumpscan - routines for scanning and manipulating AFS volume dumps
+ *
+ * Copyright (c) 1998, 2001 Carnegie Mellon University
+ * All Rights Reserved.
+ * 
+ * Permission to use, copy, modify and distribute this software and its
+ * documentation is hereby granted, provided that both the copyright
+ * notice and this permission notice appear in all copies of the
+ * software, derivative works or modified versions, and any portions
+ * thereof, and that both notices appear in supporting documentation.
+ *
+ * CARNEGIE MELLON ALLOWS FREE USE OF THIS SOFTWARE IN ITS "AS IS"
+ * CONDITION.  CARNEGIE MELLON DISCLAIMS ANY LIABILITY OF ANY KIND FOR
+ * ANY DAMAGES WHATSOEVER RESULTING FROM THE USE OF THIS SOFTWARE.
+ *
+ * Carnegie Mellon requests users of this software to return to
+ *
+ *  Software Distribution Coordinator  or  Software_Distribution@CS.CMU.EDU
+ *  School of Computer Science
+ *  Carnegie Mellon University
+ *  Pittsburgh PA 15213-3890
+ *
+ * any improvements or extensions that they make and grant Carnegie Mellon
+ * the rights to redistribute these changes.
+ */
+
+/* errsum.c - Summarize errors instead of printing them all
+ *
+ * A badly damaged dump can produce an enormous number of errors, most
+ * of them the same few messages over and over.  An error summary sits
+ * between the parser and its error callback.  For each call site (that
+ * is, each error code and message format), the first few messages are
+ * passed on as usual; after that, they are only counted, and the last
+ * few are kept, with where in the dump they were seen, to be printed by
+ * ErrorSummary_Report.  Fatal errors are always passed on.
+ *
+ * The callbacks run by ParseDumpFileParallel may report errors from
+ * several threads at once, so summaries are updated under a lock.
+ */
+
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "dumpscan.h"
+
+#define SITE_HASH(code, fmt) \
+  ((((unsigned long)(fmt) >> 3) ^ (code)) % ERRSUM_HASHSIZE)
+
+static pthread_mutex_t summary_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* Find (or create) the record for a call site */
+static error_site *find_site(error_summary *es, afs_uint32 code, char *fmt)
+{
+  error_site **head = &es->sites[SITE_HASH(code, fmt)];
+  error_site *site;
+
+  for (site = *head; site; site = site->next)
+    if (site->fmt == fmt && site->code == code) return site;
+  if (!(site = (error_site *)malloc(sizeof(error_site)))) return 0;
+  memset(site, 0, sizeof(error_site));
+  site->code = code;
+  site->fmt = fmt;
+  site->next = *head;
+  *head = site;
+  return site;
+}
+
+
+/* The error callback installed by ErrorSummary_Init */
+static afs_uint32 summary_error(afs_uint32 code, int fatal, void *refcon,
+                                char *fmt, ...)
+{
+  error_summary *es = (error_summary *)refcon;
+  error_site *site;
+  va_list alist;
+  char *msg, buf[ERRSUM_MSGLEN];
+  afs_uint32 n, r = 0;
+
+  pthread_mutex_lock(&summary_lock);
+  es->total++;
+  site = find_site(es, code, fmt);
+  if (fatal || !site || site->count++ < es->keep) {
+    va_start(alist, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, alist);
+    va_end(alist);
+    r = (es->cb_error)(code, fatal, es->err_refcon, "%s", buf);
+    pthread_mutex_unlock(&summary_lock);
+    return r;
+  }
+
+  /* Keep this one, if we're keeping any */
+  es->suppressed++;
+  if (es->keep && !site->last) {
+    site->last = (char *)malloc(es->keep * ERRSUM_MSGLEN);
+    site->offsets = (u_int64 *)malloc(es->keep * sizeof(u_int64));
+    if (!site->offsets && site->last) {
+      free(site->last);
+      site->last = 0;
+    }
+  }
+  if (site->last) {
+    n = (site->count - es->keep - 1) % es->keep;
+    msg = site->last + n * ERRSUM_MSGLEN;
+    va_start(alist, fmt);
+    vsnprintf(msg, ERRSUM_MSGLEN, fmt, alist);
+    va_end(alist);
+    if (!es->X || xftell(es->X, &site->offsets[n]))
+      mk64(site->offsets[n], 0, 0);
+  }
+
+  if (es->interval && !(es->suppressed % es->interval))
+    r = (es->cb_error)(0, 0, es->err_refcon,
+                       "%u errors so far; %u not shown",
+                       es->total, es->suppressed);
+  pthread_mutex_unlock(&summary_lock);
+  return r;
+}
+
+
+/* Set up an error summary for parser p, which is reading X.  Up to keep
+ * messages from each call site are passed on to p's error callback;
+ * after that, only the last keep are remembered, along with the offset
+ * in X when each was reported (X may be 0, if that isn't wanted or if
+ * the dump is parsed in parallel, as X isn't where the workers are).  If
+ * interval is non-zero, a progress message is passed on every interval
+ * suppressed errors.
+ */
+void ErrorSummary_Init(error_summary *es, dump_parser *p, XFILE *X,
+                       afs_uint32 keep, afs_uint32 interval)
+{
+  memset(es, 0, sizeof(error_summary));
+  es->cb_error = p->cb_error;
+  es->err_refcon = p->err_refcon;
+  es->X = X;
+  es->keep = keep;
+  es->interval = interval;
+  if (p->cb_error) {
+    p->cb_error = summary_error;
+    p->err_refcon = es;
+  }
+}
+
+
+/* Pass on a summary of suppressed errors: a count for each call site
+ * that had any, followed by the last few messages from that site and
+ * where they were seen.
+ */
+afs_uint32 ErrorSummary_Report(error_summary *es)
+{
+  error_site *site;
+  afs_uint32 i, n, first, r;
+  u_int64 *where;
+
+  if (!es->suppressed) return 0;
+  for (i = 0; i < ERRSUM_HASHSIZE; i++) {
+    for (site = es->sites[i]; site; site = site->next) {
+      if (site->count <= es->keep) continue;
+      n = site->count - es->keep;
+      if (r = (es->cb_error)(site->code, 0, es->err_refcon,
+                             "%u more like \"%s\"", n, site->fmt))
+        return r;
+      if (!site->last) continue;
+      first = (n > es->keep) ? n - es->keep : 0;
+      for (; first < n; first++) {
+        where = site->offsets + first % es->keep;
+        if (!es->X)
+          r = (es->cb_error)(site->code, 0, es->err_refcon, "... %s",
+                             site->last + (first % es->keep) * ERRSUM_MSGLEN);
+        else
+          r = (es->cb_error)(site->code, 0, es->err_refcon,
+                             "... %s (near %s = 0x%s)",
+                             site->last + (first % es->keep) * ERRSUM_MSGLEN,
+                             decimate_int64(where, 0), hexify_int64(where, 0));
+        if (r) return r;
+      }
+    }
+  }
+  return 0;
+}
+
+
+/* Free the memory used by an error summary */
+void ErrorSummary_Free(error_summary *es)
+{
+  error_site *site, *next;
+  int i;
+
+  for (i = 0; i < ERRSUM_HASHSIZE; i++) {
+    for (site = es->sites[i]; site; site = next) {
+      next = site->next;
+      if (site->last) free(site->last);
+      if (site->offsets) free(site->offsets);
+      free(site);
+    }
+    es->sites[i] = 0;
+  }
+}
@@ -59,6 +59,7 @@ static afs_uint32 when;
 static int debug, doaliases, dorft, doallro;
 static const char *argv0, *csdbpath, *aliaspath;
 static char *outpath;
+static int doindex;
 static char **rocells;
 static int nrocells;
 
@@ -73,6 +74,7 @@ static void usage(int status, char *msg)
   fprintf(stderr, "  -d          Enable debug output\n");
   fprintf(stderr, "  -h          Print this help message\n");
   fprintf(stderr, "  -o outfile  Put output in file [default stdout]\n");
+  fprintf(stderr, "  -x          Append an index to the output (needs -o)\n");
   fprintf(stderr, "Default CellServDB: %s\n",
           AFSDIR_CLIENT_CELLSERVDB_FILEPATH);
   fprintf(stderr, "Default CellAlias:  %s\n",
@@ -89,14 +91,14 @@ static void parse_options(int argc, char **argv)
   else argv0 = argv[0];
 
   /* Initialize options */
-  debug = doaliases = dorft = doallro = nrocells = 0;
+  debug = doaliases = dorft = doallro = nrocells = doindex = 0;
   rocells = 0;
   outpath   = 0;
   csdbpath  = AFSDIR_CLIENT_CELLSERVDB_FILEPATH;
   aliaspath = AFSDIR_CLIENT_CELLALIAS_FILEPATH;
 
   /* Parse the options */
-  while ((c = getopt(argc, argv, "ar:thdo:")) != EOF) {
+  while ((c = getopt(argc, argv, "ar:thdo:x")) != EOF) {
     switch (c) {
       default:  usage(1, "Invalid option!");
       case 'h': usage(0, 0);
@@ -104,6 +106,7 @@ static void parse_options(int argc, char **argv)
       case 't': dorft        = 1;                         continue;
       case 'd': debug        = 1;                         continue;
       case 'o': outpath      = optarg;                    continue;
+      case 'x': doindex      = 1;                         continue;
       case 'r': 
         if (!strcmp(optarg, "+")) doallro = 1;
         else {
@@ -127,6 +130,7 @@ static void parse_options(int argc, char **argv)
     }
   }
 
+  if (doindex && !outpath) usage(1, "-x requires -o");
   if (argc > optind) csdbpath  = argv[optind++];
   if (argc > optind) aliaspath = argv[optind++];
   if (argc > optind) usage(1, "Too many arguments!");
@@ -346,6 +350,13 @@ void emit(void)
       die("vnode contents", r);
   }
   if ((r = DumpDumpEnd(&X))) die("dump end", r);
+  if (doindex) {
+    dump_parser dp;
+
+    memset(&dp, 0, sizeof(dp));
+    dp.flags = DSFLAG_SEEK;
+    if ((r = DumpIndex_Append(&X, &dp))) die("index", r);
+  }
   if ((r = xfclose(&X))) die("close", r);
 }
 
@@ -32,6 +32,13 @@
 #include "dumpscan.h"
 
 
+/* parsedump.c - Routines to parse dump headers and trailers */
+extern afs_uint32 parse_dumphdr(XFILE *, unsigned char *, tagged_field *, afs_uint32,
+                            tag_parse_info *, void *, void *);
+extern afs_uint32 parse_dumpend(XFILE *, unsigned char *, tagged_field *, afs_uint32,
+                            tag_parse_info *, void *, void *);
+extern afs_uint32 parse_next_vnode(XFILE *, dump_parser *);
+
 /* parsevol.c - Routines to parse volume headers */
 extern afs_uint32 parse_volhdr(XFILE *, unsigned char *, tagged_field *, afs_uint32,
                             tag_parse_info *, void *, void *);
@@ -39,6 +46,8 @@ extern afs_uint32 parse_volhdr(XFILE *, unsigned char *, tagged_field *, afs_uin
 /* parsevnode.c - Routines to parse vnodes and their fields */
 extern afs_uint32 parse_vnode(XFILE *, unsigned char *, tagged_field *, afs_uint32,
                            tag_parse_info *, void *, void *);
+extern afs_uint32 batch_vnode(XFILE *, dump_parser *, afs_vnode *);
+extern void discard_vnode_batch(dump_parser *);
 
 /* directory.c - Routines for parsing AFS directories */
 extern afs_uint32 parse_directory(XFILE *, dump_parser *, afs_vnode *,
@@ -53,3 +62,5 @@ extern afs_uint32 try_backuphdr(XFILE *X, unsigned char *tag, tagged_field *fiel
 extern afs_uint32 handle_return(int, XFILE *, unsigned char, dump_parser *);
 extern void prep_pi(dump_parser *, tag_parse_info *);
 extern afs_uint32 match_next_vnode(XFILE *, dump_parser *, u_int64 *, afs_uint32);
+extern afs_uint32 find_next_vnode(XFILE *, dump_parser *, u_int64 *, afs_uint32,
+                               int, int);
@@ -29,9 +29,11 @@
 /* null-search.c - search for nulls in data files */
 
 #include <sys/fcntl.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <pthread.h>
 
 #include <afs/stds.h>
 #include <rx/rxkad.h>
@@ -44,18 +46,25 @@
 #include "dumpscan.h"
 
 char *argv0;
-static char *input_path = 0;
-static int quiet = 0, showpaths = 0, searchcount = 1;
+static char *input_path = 0, *index_path = 0;
+static int quiet = 0, showpaths = 0, searchcount = 1, nworkers = 1;
 static int error_count = 0, bad_count = 0;
+static int error_keep = -1, error_every = 0;
+static pthread_mutex_t bad_lock = PTHREAD_MUTEX_INITIALIZER;
 static path_hashinfo phi;
 static dump_parser dp;
+static error_summary es;
 
 /* Print a usage message and exit */
 static void usage(int status, char *msg)
 {
   if (msg) fprintf(stderr, "%s: %s\n", argv0, msg);
   fprintf(stderr, "Usage: %s [options] [file]\n", argv0);
+  fprintf(stderr, "  -E n   With -e, report progress every n unprinted errors\n");
+  fprintf(stderr, "  -I idx Use vnode index idx (see afsdump_index)\n");
+  fprintf(stderr, "  -e n   Print only n errors of each kind, then a summary\n");
   fprintf(stderr, "  -h     Print this help message\n");
+  fprintf(stderr, "  -j n   Use n threads (seekable files only)\n");
   fprintf(stderr, "  -p     Print paths of bad vnodes\n");
   fprintf(stderr, "  -q     Quiet mode (don't print errors)\n");
   exit(status);
@@ -71,8 +80,12 @@ static void parse_options(int argc, char **argv)
   else argv0 = argv[0];
 
   /* Parse the options */
-  while ((c = getopt(argc, argv, "n:hpq")) != EOF) {
+  while ((c = getopt(argc, argv, "E:I:e:j:n:hpq")) != EOF) {
     switch (c) {
+      case 'E': error_every  = atoi(optarg); continue;
+      case 'I': index_path   = optarg;       continue;
+      case 'e': error_keep   = atoi(optarg); continue;
+      case 'j': nworkers     = atoi(optarg); continue;
       case 'n': searchcount  = atoi(optarg); continue;
       case 'p': showpaths    = 1;            continue;
       case 'q': quiet        = 1;            continue;
@@ -81,63 +94,94 @@ static void parse_options(int argc, char **argv)
     }
   }
 
+  if (error_every && error_keep < 0) usage(1, "-E requires -e");
   if (argc - optind > 1) usage(1, "Too many arguments!");
   input_path = (argc == optind) ? "-" : argv[optind];
 }
 
 
-/* A callback to count and print errors */
+/* A callback to count and print errors.  With -j -p, workers report
+ * path errors directly, so this is serialized.
+ */
 static afs_uint32 my_error_cb(afs_uint32 code, int fatal, void *ref, char *msg, ...)
 {
+  static pthread_mutex_t error_lock = PTHREAD_MUTEX_INITIALIZER;
   va_list alist;
 
+  pthread_mutex_lock(&error_lock);
   error_count++;
   if (!quiet) {
     va_start(alist, msg);
     com_err_va(argv0, code, msg, alist);
     va_end(alist);
   }
+  pthread_mutex_unlock(&error_lock);
+  return 0;
 }
 
 
-/* A callback to process file vnodes */
-static afs_uint32 my_file_cb(afs_vnode *v, XFILE *X, void *refcon)
+/* Null counts for the file being scanned; each thread has its own */
+typedef struct {
+  afs_uint32 nulls, cnulls, maxcnulls;
+} null_counts;
+static pthread_key_t counts_key;
+
+static null_counts *get_counts(void)
 {
-  static char buf[1024];
-  afs_uint32 size, nulls, cnulls, maxcnulls, n, r;
-  char *name = 0;
-  int i;
-
-  nulls = cnulls = maxcnulls = 0;
-  size = v->size;
-  if ((r = xfseek(X, &v->d_offset))) return r;
-  while (size) {
-    n = (size > 1024) ? 1024 : size;
-    if (r = xfread(X, buf, n)) return r;
-    for (i = 0; i < n; i++) {
-      if (buf[i]) {
-        if (cnulls > maxcnulls) maxcnulls = cnulls;
-        cnulls = 0;
-      } else {
-        nulls++;
-        cnulls++;
-      }
+  null_counts *nc = (null_counts *)pthread_getspecific(counts_key);
+
+  if (!nc && (nc = (null_counts *)calloc(1, sizeof(null_counts))))
+    pthread_setspecific(counts_key, nc);
+  return nc;
+}
+
+
+/* A callback to count nulls in file data as it goes by */
+static afs_uint32 my_chunk_cb(afs_vnode *v, char *buf, afs_uint32 len,
+                              u_int64 *offset, int last, void *refcon)
+{
+  null_counts *nc;
+  afs_uint32 i;
+
+  if (v->type != vFile) return 0;
+  if (!(nc = get_counts())) return ENOMEM;
+  if (zero64(*offset)) memset(nc, 0, sizeof(*nc));
+  for (i = 0; i < len; i++) {
+    if (buf[i]) {
+      if (nc->cnulls > nc->maxcnulls) nc->maxcnulls = nc->cnulls;
+      nc->cnulls = 0;
+    } else {
+      nc->nulls++;
+      nc->cnulls++;
     }
-    size -= n;
   }
-  if (maxcnulls >= searchcount) {
-    bad_count++;
+  return 0;
+}
+
+
+/* A callback to report on file vnodes, once their data has been seen */
+static afs_uint32 my_file_cb(afs_vnode *v, XFILE *X, void *refcon)
+{
+  null_counts *nc;
+  char *name = 0;
+
+  if (!(nc = get_counts())) return ENOMEM;
+  if (nc->maxcnulls >= searchcount) {
     if (showpaths) Path_Build(X, &phi, v->vnode, &name, 0);
+    pthread_mutex_lock(&bad_lock);
+    bad_count++;
     if (name) {
       printf("*** BAD %d (%s) - %d nulls, %d consecutive\n",
-             v->vnode, name, nulls, maxcnulls);
+             v->vnode, name, nc->nulls, nc->maxcnulls);
       free(name);
     } else {
       printf("*** BAD %d - %d nulls, %d consecutive\n",
-             v->vnode, nulls, maxcnulls);
+             v->vnode, nc->nulls, nc->maxcnulls);
     }
+    pthread_mutex_unlock(&bad_lock);
   }
-  return r;
+  memset(nc, 0, sizeof(*nc));
+  return 0;
 }
 
 
@@ -162,6 +206,9 @@ int main(int argc, char **argv)
 
   memset(&dp, 0, sizeof(dp));
   dp.cb_error      = my_error_cb;
+  if (error_keep >= 0)
+    ErrorSummary_Init(&es, &dp, nworkers > 1 ? 0 : &input_file,
+                      error_keep, error_every);
   if (input_file.is_seekable) dp.flags |= DSFLAG_SEEK;
   if (showpaths) {
     u_int64 where;
@@ -169,19 +216,46 @@ int main(int argc, char **argv)
     memset(&phi, 0, sizeof(phi));
     phi.p = &dp;
 
-    if ((r = xftell(&input_file, &where))
-    ||  (r = Path_PreScan(&input_file, &phi, 0))
-    ||  (r = xfseek(&input_file, &where))) {
+    /* Use the dump's own index, if it has one */
+    if (!index_path && strcmp(input_path, "-")
+    &&  DumpIndex_Embedded(input_path))
+      index_path = input_path;
+    if (index_path) {
+      dump_index di;
+
+      if (!(r = DumpIndex_Open(&di, index_path,
+                               strcmp(input_path, "-") ? input_path : 0))) {
+        r = Path_FromIndex(&phi, &di);
+        DumpIndex_Close(&di);
+      }
+    } else if (!(r = xftell(&input_file, &where))
+           &&  !(r = Path_PreScan(&input_file, &phi, 0)))
+      r = xfseek(&input_file, &where);
+    if (r) {
       com_err(argv0, r, "- path initialization failed");
       xfclose(&input_file);
       exit(2);
     }
   }
 
+  pthread_key_create(&counts_key, free);
+  dp.cb_data_chunk = my_chunk_cb;
   dp.cb_vnode_file = my_file_cb;
-  r = ParseDumpFile(&input_file, &dp);
+  if (nworkers > 1) {
+    /* Order doesn't matter; let the workers call my_file_cb directly */
+    dp.flags |= DSFLAG_UNORDERED;
+    r = ParseDumpFileParallel(&input_file, input_path, &dp, nworkers);
+  } else {
+    r = ParseDumpFile(&input_file, &dp);
+  }
   xfclose(&input_file);
 
+  if (error_keep >= 0) {
+    ErrorSummary_Report(&es);
+    error_count = es.total;
+    ErrorSummary_Free(&es);
+  }
+
   if (error_count) printf("*** %d errors\n", error_count);
   if (bad_count)   printf("*** %d bad files\n", bad_count);
   if (r && !quiet) printf("*** FAILED: %s\n", error_message(r));
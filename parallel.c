@@ -0,0 +1,583 @@
+/*
+ * CMUCS AFStools
+ * dumpscan - routines for scanning and manipulating AFS volume dumps
+ *
+ * Copyright (c) 1998, 2001 Carnegie Mellon University
+ * All Rights Reserved.
+ * 
+ * Permission to use, copy, modify and distribute this software and its
+ * documentation is hereby granted, provided that both the copyright
+ * notice and this permission notice appear in all copies of the
+ * software, derivative works or modified versions, and any portions
+ * thereof, and that both notices appear in supporting documentation.
+ *
+ * CARNEGIE MELLON ALLOWS FREE USE OF THIS SOFTWARE IN ITS "AS IS"
+ * CONDITION.  CARNEGIE MELLON DISCLAIMS ANY LIABILITY OF ANY KIND FOR
+ * ANY DAMAGES WHATSOEVER RESULTING FROM THE USE OF THIS SOFTWARE.
+ *
+ * Carnegie Mellon requests users of this software to return to
+ *
+ *  Software Distribution Coordinator  or  Software_Distribution@CS.CMU.EDU
+ *  School of Computer Science
+ *  Carnegie Mellon University
+ *  Pittsburgh PA 15213-3890
+ *
+ * any improvements or extensions that they make and grant Carnegie Mellon
+ * the rights to redistribute these changes.
+ */
+
+/* parallel.c - Parse a seekable volume dump using multiple threads */
+
+#include <sys/types.h>
+#include <sys/fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "dumpscan.h"
+#include "dumpscan_errs.h"
+#include "dumpfmt.h"
+#include "internal.h"
+
+#define PAR_CHUNK   256   /* Vnodes handed to a worker at a time */
+#define PAR_WINDOW  4     /* Chunks in flight per worker, in ordered mode */
+#define PAR_MAXMSG  1024  /* Longest error message passed from a worker */
+
+typedef struct {
+  u_int64 *offsets;          /* Offset of each vnode */
+  afs_uint32 count;          /* Number of vnodes found */
+  afs_uint32 size;           /* Allocated size of offsets */
+} vnode_list;
+
+typedef struct par_state par_state;
+
+typedef struct {
+  par_state *ps;             /* Shared state */
+  XFILE X;                   /* Our own handle on the dump */
+  dump_parser p;             /* Our own parser */
+  afs_vnode *slot;           /* Where captured vnodes go (ordered mode) */
+  afs_uint32 cur;            /* Index of the vnode being parsed */
+  afs_uint32 error;          /* Error delivering our last vnode batch */
+  pthread_t thread;
+} par_worker;
+
+struct par_state {
+  dump_parser *p;            /* Caller's parser */
+  u_int64 first;             /* Offset of the first vnode */
+  int have_first;            /* Set if there is a first vnode */
+  int ordered;               /* Deliver vnodes in dump order */
+
+  pthread_mutex_t lock;      /* Protects everything below */
+  pthread_mutex_t errlock;   /* Serializes calls to cb_error */
+  pthread_cond_t work_cv;    /* Signalled when the reorder window moves */
+  pthread_cond_t done_cv;    /* Signalled when a chunk is finished */
+  vnode_list vl;             /* Vnode offsets */
+  afs_uint32 nchunks;        /* Number of chunks */
+  afs_uint32 next_chunk;     /* Next chunk to hand out */
+  afs_uint32 delivered;      /* Chunks delivered (ordered mode) */
+  afs_uint32 completed;      /* Chunks finished (unordered mode) */
+  afs_uint32 error;          /* First error; stops everyone */
+  int nslots;                /* Size of the reorder buffer, in chunks */
+  afs_vnode *vnodes;         /* Reorder buffer (nslots * PAR_CHUNK) */
+  afs_uint32 *nfilled;       /* Vnodes parsed in each slot */
+  afs_uint32 *status;        /* Completion code for each slot */
+  int *done;                 /* Set when a slot is ready for delivery */
+};
+
+
+static afs_uint32 scan_vnode      (XFILE *, unsigned char *, tagged_field *,
+                                   afs_uint32, tag_parse_info *, void *, void *);
+static afs_uint32 scan_dumpend    (XFILE *, unsigned char *, tagged_field *,
+                                   afs_uint32, tag_parse_info *, void *, void *);
+static afs_uint32 skip_acl        (XFILE *, unsigned char *, tagged_field *,
+                                   afs_uint32, tag_parse_info *, void *, void *);
+static afs_uint32 skip_vdata      (XFILE *, unsigned char *, tagged_field *,
+                                   afs_uint32, tag_parse_info *, void *, void *);
+static afs_uint32 skip_vdata_large(XFILE *, unsigned char *, tagged_field *,
+                                   afs_uint32, tag_parse_info *, void *, void *);
+
+/** Field lists for the vnode boundary scan.  These follow the ones in
+ ** parsedump.c and parsevnode.c, but nothing is decoded or stored.
+ **/
+static tagged_field scan_top_fields[] = {
+  { TAG_VNODE,        DKIND_SPECIAL, "* VNODE ",        scan_vnode,       0, 0 },
+  { TAG_DUMPEND,      DKIND_INT32,   "* DUMP END",      scan_dumpend,     0, 0 },
+  { 0,0,0,0,0,0 }};
+
+static tagged_field scan_vnode_fields[] = {
+  { VTAG_TYPE,        DKIND_BYTE,    " VNode type:   ", 0,                0, 0 },
+  { VTAG_NLINKS,      DKIND_INT16,   " Link count:   ", 0,                0, 0 },
+  { VTAG_DVERS,       DKIND_INT32,   " Version:      ", 0,                0, 0 },
+  { VTAG_CLIENT_DATE, DKIND_TIME,    " Client Date:  ", 0,                0, 0 },
+  { VTAG_AUTHOR,      DKIND_INT32,   " Author:       ", 0,                0, 0 },
+  { VTAG_OWNER,       DKIND_INT32,   " Owner:        ", 0,                0, 0 },
+  { VTAG_GROUP,       DKIND_INT32,   " Group:        ", 0,                0, 0 },
+  { VTAG_MODE,        DKIND_OCT16,   " UNIX mode:    ", 0,                0, 0 },
+  { VTAG_PARENT,      DKIND_INT32,   " Parent:       ", 0,                0, 0 },
+  { VTAG_SERVER_DATE, DKIND_TIME,    " Server Date:  ", 0,                0, 0 },
+  { VTAG_ACL,         DKIND_SPECIAL, " xxxxxxxx ACL: ", skip_acl,         0, 0 },
+  { VTAG_DATA,        DKIND_SPECIAL, " Contents:     ", skip_vdata,       0, 0 },
+  { VTAG_DATA_LARGE,  DKIND_SPECIAL, " Contents:     ", skip_vdata_large, 0, 0 },
+  { 0,0,0,0,0,0 }};
+
+
+/* Note the location of a vnode, and skip over it */
+static afs_uint32 scan_vnode(XFILE *X, unsigned char *tag, tagged_field *field,
+                             afs_uint32 value, tag_parse_info *pi,
+                             void *g_refcon, void *l_refcon)
+{
+  vnode_list *vl = (vnode_list *)l_refcon;
+  u_int64 where, *x;
+  afs_uint32 r;
+
+  if (r = xftell(X, &where)) return r;
+  if (vl->count == vl->size) {
+    vl->size = vl->size ? vl->size * 2 : 1024;
+    x = (u_int64 *)realloc(vl->offsets, vl->size * sizeof(u_int64));
+    if (!x) return ENOMEM;
+    vl->offsets = x;
+  }
+  sub64_32(vl->offsets[vl->count], where, 1);
+  vl->count++;
+
+  /* Skip the vnode number and uniquifier */
+  if (r = xfskip(X, 8)) return r;
+  return ParseTaggedData(X, scan_vnode_fields, tag, pi, g_refcon, l_refcon);
+}
+
+
+/* The end of the dump; we're done */
+static afs_uint32 scan_dumpend(XFILE *X, unsigned char *tag,
+                               tagged_field *field, afs_uint32 value,
+                               tag_parse_info *pi,
+                               void *g_refcon, void *l_refcon)
+{
+  if (value != DUMPENDMAGIC) return DSERR_MAGIC;
+  return DSERR_DONE;
+}
+
+
+/* Skip over a directory ACL */
+static afs_uint32 skip_acl(XFILE *X, unsigned char *tag, tagged_field *field,
+                           afs_uint32 value, tag_parse_info *pi,
+                           void *g_refcon, void *l_refcon)
+{
+  afs_uint32 r;
+
+  if (r = xfskip(X, SIZEOF_LARGEDISKVNODE - SIZEOF_SMALLDISKVNODE)) return r;
+  return ReadByte(X, tag);
+}
+
+
+/* Skip over vnode data, given the high 32 bits of its size */
+static afs_uint32 skip_data(XFILE *X, unsigned char *tag, afs_uint32 size_hi)
+{
+  afs_uint32 r, size_lo;
+  u_int64 size;
+
+  if (r = ReadInt32(X, &size_lo)) return r;
+  mk64(size, size_hi, size_lo);
+  if (r = xfskip64(X, &size)) return r;
+  return ReadByte(X, tag);
+}
+
+static afs_uint32 skip_vdata(XFILE *X, unsigned char *tag, tagged_field *field,
+                             afs_uint32 value, tag_parse_info *pi,
+                             void *g_refcon, void *l_refcon)
+{
+  return skip_data(X, tag, 0);
+}
+
+static afs_uint32 skip_vdata_large(XFILE *X, unsigned char *tag,
+                                   tagged_field *field, afs_uint32 value,
+                                   tag_parse_info *pi,
+                                   void *g_refcon, void *l_refcon)
+{
+  afs_uint32 r, size_hi;
+
+  if (r = ReadInt32(X, &size_hi)) return r;
+  return skip_data(X, tag, size_hi);
+}
+
+
+/* Find the start of every vnode in a dump, beginning at the current
+ * position (which should be the start of a vnode) and continuing up
+ * to the end-of-dump marker.  No callbacks are made and no errors are
+ * reported; on failure, the caller should fall back on ParseDumpFile,
+ * which will complain appropriately.  On success, *offsets is an array
+ * of *count offsets, which the caller must free.
+ */
+afs_uint32 ScanVNodeOffsets(XFILE *X, dump_parser *p,
+                            u_int64 **offsets, afs_uint32 *count)
+{
+  tag_parse_info pi;
+  vnode_list vl;
+  unsigned char tag;
+  afs_uint32 r;
+
+  memset(&vl, 0, sizeof(vl));
+  memset(&pi, 0, sizeof(pi));
+  r = ParseTaggedData(X, scan_top_fields, &tag, &pi, (void *)p, (void *)&vl);
+  if (r == DSERR_DONE) {
+    *offsets = vl.offsets;
+    *count   = vl.count;
+    return 0;
+  }
+  if (vl.offsets) free(vl.offsets);
+  return r ? r : DSERR_TAG;
+}
+
+
+/** Callbacks used while parsing the headers **/
+static afs_uint32 par_bckhdr(backup_system_header *hdr, XFILE *X, void *refcon)
+{
+  dump_parser *p = ((par_state *)refcon)->p;
+  return (p->cb_bckhdr)(hdr, X, p->refcon);
+}
+
+static afs_uint32 par_dumphdr(afs_dump_header *hdr, XFILE *X, void *refcon)
+{
+  dump_parser *p = ((par_state *)refcon)->p;
+  return (p->cb_dumphdr)(hdr, X, p->refcon);
+}
+
+static afs_uint32 par_volhdr(afs_vol_header *hdr, XFILE *X, void *refcon)
+{
+  dump_parser *p = ((par_state *)refcon)->p;
+  return (p->cb_volhdr)(hdr, X, p->refcon);
+}
+
+static afs_uint32 par_stop(afs_vnode *v, XFILE *X, void *refcon)
+{
+  par_state *ps = (par_state *)refcon;
+
+  cp64(ps->first, v->offset);
+  ps->have_first = 1;
+  return DSERR_DONE;
+}
+
+
+/* Errors from workers are formatted locally, then passed on one at a time */
+static afs_uint32 par_error(afs_uint32 code, int fatal, void *refcon,
+                            char *fmt, ...)
+{
+  par_state *ps = (par_state *)refcon;
+  char msg[PAR_MAXMSG];
+  va_list alist;
+  afs_uint32 r;
+
+  va_start(alist, fmt);
+  vsnprintf(msg, sizeof(msg), fmt, alist);
+  va_end(alist);
+
+  pthread_mutex_lock(&ps->errlock);
+  r = (ps->p->cb_error)(code, fatal, ps->p->err_refcon, "%s", msg);
+  pthread_mutex_unlock(&ps->errlock);
+  return r;
+}
+
+
+/* In ordered mode, workers save each vnode for delivery later */
+static afs_uint32 par_capture(afs_vnode *v, XFILE *X, void *refcon)
+{
+  par_worker *w = (par_worker *)refcon;
+
+  w->slot[w->cur] = *v;
+  /* The copy owns the symlink target now; keep parse_vnode from freeing it */
+  v->field_mask &= ~F_VNODE_LINK_TARGET;
+  return 0;
+}
+
+
+/* Deliver a saved vnode to the caller's callbacks, in the same order
+ * ParseDumpFile would have: directory entries, then data, then the
+ * vnode itself.  Data callbacks are positioned at the vnode data.
+ */
+static afs_uint32 par_deliver(XFILE *X, dump_parser *p, afs_vnode *v)
+{
+  afs_uint32 (*cb)(afs_vnode *, XFILE *, void *);
+  afs_uint32 r;
+
+  if ((v->field_mask & F_VNODE_DATA) && v->type == vDirectory
+  &&  p->cb_dirent) {
+    if (r = xfseek(X, &v->d_offset)) return r;
+    if (r = parse_directory(X, p, v, get64(v->size), 0)) return r;
+  }
+
+  cb = 0;
+  if (v->field_mask & F_VNODE_TYPE) {
+    switch (v->type) {
+      case vFile:      cb = p->cb_file_data;  break;
+      case vDirectory: cb = p->cb_dir_data;   break;
+      case vSymlink:   cb = p->cb_link_data;  break;
+    }
+  }
+  if (cb && (v->field_mask & F_VNODE_SIZE)) {
+    if ((v->field_mask & F_VNODE_DATA) && (r = xfseek(X, &v->d_offset)))
+      return r;
+    if (r = (cb)(v, X, p->refcon)) return r;
+  }
+
+  if (v->field_mask & F_VNODE_TYPE)
+    switch (v->type) {
+    case vFile:      cb = p->cb_vnode_file;  break;
+    case vDirectory: cb = p->cb_vnode_dir;   break;
+    case vSymlink:   cb = p->cb_vnode_link;  break;
+    default:         cb = p->cb_vnode_wierd; break;
+    }
+  else               cb = p->cb_vnode_empty;
+  if (cb && (r = (cb)(v, X, p->refcon))) return r;
+
+  if (p->cb_vnode_batch) return batch_vnode(X, p, v);
+  return 0;
+}
+
+
+static void *par_worker_main(void *arg)
+{
+  par_worker *w = (par_worker *)arg;
+  par_state *ps = w->ps;
+  afs_uint32 c, i, n, first, r;
+  int slot;
+
+  pthread_mutex_lock(&ps->lock);
+  for (;;) {
+    /* In ordered mode, don't get too far ahead of delivery */
+    while (ps->ordered && !ps->error && ps->next_chunk < ps->nchunks
+    &&     ps->next_chunk >= ps->delivered + ps->nslots)
+      pthread_cond_wait(&ps->work_cv, &ps->lock);
+    if (ps->error || ps->next_chunk >= ps->nchunks) break;
+    c = ps->next_chunk++;
+    pthread_mutex_unlock(&ps->lock);
+
+    slot  = c % ps->nslots;
+    first = c * PAR_CHUNK;
+    n = ps->vl.count - first;
+    if (n > PAR_CHUNK) n = PAR_CHUNK;
+    w->slot = ps->vnodes + slot * PAR_CHUNK;
+
+    /* In unordered mode, a callback asking us to stop stops everyone */
+    for (r = i = 0; i < n && !ps->error; i++) {
+      w->cur = i;
+      if ((r = xfseek(&w->X, &ps->vl.offsets[first + i]))
+      ||  (r = ps->ordered ? ParseVNode(&w->X, &w->p)
+                           : parse_next_vnode(&w->X, &w->p)))
+        break;
+    }
+
+    pthread_mutex_lock(&ps->lock);
+    ps->nfilled[slot] = i;
+    ps->status[slot]  = r;
+    ps->done[slot]    = 1;
+    ps->completed++;
+    if (r && !ps->ordered && !ps->error) ps->error = r;
+    pthread_cond_broadcast(&ps->done_cv);
+  }
+  pthread_mutex_unlock(&ps->lock);
+
+  /* In unordered mode, each worker has its own vnode batch */
+  if (!ps->ordered && (r = FlushVNodeBatch(&w->X, &w->p)))
+    w->error = handle_return(r, &w->X, 0, &w->p);
+  return 0;
+}
+
+
+/* Parse a seekable dump using nworkers threads.  The headers are parsed
+ * as usual; then the dump is scanned to find where each vnode starts,
+ * and the vnodes are divided among the workers, each of which opens
+ * its own copy of the dump using path (which must name the same file
+ * as X).  Standard input ("-") can't be opened more than once, so it
+ * is always parsed serially.
+ *
+ * Normally, vnodes are delivered to the caller's callbacks in order,
+ * by the calling thread, using X.  If DSFLAG_UNORDERED is set, then
+ * instead each worker calls the callbacks directly, using its own
+ * XFILE, so the callbacks must be prepared to run concurrently.
+ * Calls the parser makes to cb_error are always serialized, but errors
+ * reported by the callbacks themselves (for example, through a
+ * path_hashinfo) are not.  In either mode, a callback may return
+ * DSERR_DONE to stop early; when unordered, workers that are already
+ * in the middle of a vnode finish it first.
+ *
+ * This works only for seekable input, and not when printing or repair
+ * options are in effect, or for ordered delivery with cb_vnode_attrs
+ * or cb_data_chunk; in those cases, or if the dump looks odd, we
+ * quietly fall back on ParseDumpFile.
+ */
+afs_uint32 ParseDumpFileParallel(XFILE *X, char *path, dump_parser *p,
+                                 int nworkers)
+{
+  par_worker *workers = 0, *w;
+  par_state ps;
+  dump_parser hp;
+  afs_vnode *vp;
+  afs_uint32 r, r2, c, i;
+  int nw, slot, stop = 0;
+
+  if (nworkers < 2 || !path || !strcmp(path, "-")
+  ||  !(p->flags & DSFLAG_SEEK) || p->print_flags || p->repair_flags
+  ||  ((p->cb_vnode_attrs || p->cb_data_chunk)
+       && !(p->flags & DSFLAG_UNORDERED)))
+    return ParseDumpFile(X, p);
+
+  /* Parse the headers, stopping at the first vnode */
+  memset(&ps, 0, sizeof(ps));
+  ps.p = p;
+  ps.ordered = !(p->flags & DSFLAG_UNORDERED);
+  hp = *p;
+  hp.refcon         = (void *)&ps;
+  hp.cb_bckhdr      = p->cb_bckhdr  ? par_bckhdr  : 0;
+  hp.cb_dumphdr     = p->cb_dumphdr ? par_dumphdr : 0;
+  hp.cb_volhdr      = p->cb_volhdr  ? par_volhdr  : 0;
+  hp.cb_vnode_dir   = par_stop;
+  hp.cb_vnode_file  = par_stop;
+  hp.cb_vnode_link  = par_stop;
+  hp.cb_vnode_empty = par_stop;
+  hp.cb_vnode_wierd = par_stop;
+  hp.cb_file_data   = 0;
+  hp.cb_dir_data    = 0;
+  hp.cb_link_data   = 0;
+  hp.cb_dirent      = 0;
+  hp.cb_vnode_batch = 0;
+  hp.cb_vnode_attrs = 0;
+  hp.cb_data_chunk  = 0;
+  hp.batch          = 0;
+  if (r = ParseDumpFile(X, &hp)) return r;
+  p->vol_uniquifier = hp.vol_uniquifier;
+  if (!ps.have_first) return 0;
+
+  /* Find the vnodes */
+  if (r = xfseek(X, &ps.first)) return r;
+  if (ScanVNodeOffsets(X, p, &ps.vl.offsets, &ps.vl.count)) {
+    if (r = xfseek(X, &ps.first)) return r;
+    return ParseDumpFile(X, p);
+  }
+
+  /* Set up the workers and the reorder buffer */
+  ps.nchunks = (ps.vl.count + PAR_CHUNK - 1) / PAR_CHUNK;
+  if ((afs_uint32)nworkers > ps.nchunks) nworkers = ps.nchunks;
+  ps.nslots = nworkers * PAR_WINDOW;
+  pthread_mutex_init(&ps.lock, 0);
+  pthread_mutex_init(&ps.errlock, 0);
+  pthread_cond_init(&ps.work_cv, 0);
+  pthread_cond_init(&ps.done_cv, 0);
+
+  r = ENOMEM;
+  workers    = (par_worker *)calloc(nworkers, sizeof(par_worker));
+  ps.nfilled = (afs_uint32 *)calloc(ps.nslots, sizeof(afs_uint32));
+  ps.status  = (afs_uint32 *)calloc(ps.nslots, sizeof(afs_uint32));
+  ps.done    = (int *)calloc(ps.nslots, sizeof(int));
+  if (ps.ordered)
+    ps.vnodes = (afs_vnode *)malloc(ps.nslots * PAR_CHUNK * sizeof(afs_vnode));
+  if (!workers || !ps.nfilled || !ps.status || !ps.done
+  ||  (ps.ordered && !ps.vnodes))
+    goto out;
+
+  for (nw = 0; nw < nworkers; nw++) {
+    w = workers + nw;
+    w->ps = &ps;
+    if (r = xfopen(&w->X, O_RDONLY, path)) break;
+    w->p = *p;
+    w->p.last_good_vnode = 0;
+    w->p.batch = 0;
+    if (p->cb_error) {
+      w->p.err_refcon = (void *)&ps;
+      w->p.cb_error   = par_error;
+    }
+    if (ps.ordered) {
+      w->p.refcon         = (void *)w;
+      w->p.cb_vnode_dir   = par_capture;
+      w->p.cb_vnode_file  = par_capture;
+      w->p.cb_vnode_link  = par_capture;
+      w->p.cb_vnode_empty = par_capture;
+      w->p.cb_vnode_wierd = par_capture;
+      w->p.cb_file_data   = 0;
+      w->p.cb_dir_data    = 0;
+      w->p.cb_link_data   = 0;
+      w->p.cb_dirent      = 0;
+      w->p.cb_vnode_batch = 0;
+    }
+    if (r = pthread_create(&w->thread, 0, par_worker_main, (void *)w)) {
+      xfclose(&w->X);
+      break;
+    }
+  }
+  if (!nw) goto out;
+
+  /* Deliver the results, or just wait for the workers to finish */
+  r = 0;
+  if (ps.ordered) {
+    for (c = 0; c < ps.nchunks && !r && !stop; c++) {
+      slot = c % ps.nslots;
+      pthread_mutex_lock(&ps.lock);
+      while (!ps.done[slot]) pthread_cond_wait(&ps.done_cv, &ps.lock);
+      pthread_mutex_unlock(&ps.lock);
+
+      vp = ps.vnodes + slot * PAR_CHUNK;
+      for (i = 0; i < ps.nfilled[slot]; i++) {
+        if (!r) r = par_deliver(X, p, vp + i);
+        if (vp[i].field_mask & F_VNODE_LINK_TARGET)
+          free(vp[i].link_target);
+      }
+      if (r == DSERR_DONE) {
+        /* A callback asked us to stop early */
+        stop = 1;
+        r = 0;
+      } else if (r) {
+        r = handle_return(r, X, 0, p);
+      } else {
+        r = ps.status[slot];
+      }
+
+      pthread_mutex_lock(&ps.lock);
+      ps.done[slot] = 0;
+      ps.delivered++;
+      if ((r || stop) && !ps.error) ps.error = r ? r : DSERR_DONE;
+      pthread_cond_broadcast(&ps.work_cv);
+      pthread_mutex_unlock(&ps.lock);
+    }
+    /* Deliver whatever was batched, even after an error */
+    if ((r2 = FlushVNodeBatch(X, p)) && !r)
+      r = handle_return(r2, X, 0, p);
+  } else {
+    pthread_mutex_lock(&ps.lock);
+    while (!ps.error && ps.completed < ps.nchunks)
+      pthread_cond_wait(&ps.done_cv, &ps.lock);
+    r = (ps.error == DSERR_DONE) ? 0 : ps.error;
+    pthread_mutex_unlock(&ps.lock);
+  }
+
+  for (i = 0; i < (afs_uint32)nw; i++) {
+    pthread_join(workers[i].thread, 0);
+    discard_vnode_batch(&workers[i].p);
+    xfclose(&workers[i].X);
+    if (!r) r = workers[i].error;
+  }
+
+  /* Clean up anything that was parsed but never delivered */
+  if (ps.ordered) {
+    for (slot = 0; slot < ps.nslots; slot++) {
+      if (!ps.done[slot]) continue;
+      vp = ps.vnodes + slot * PAR_CHUNK;
+      for (i = 0; i < ps.nfilled[slot]; i++)
+        if (vp[i].field_mask & F_VNODE_LINK_TARGET)
+          free(vp[i].link_target);
+    }
+  }
+
+out:
+  discard_vnode_batch(p);
+  pthread_cond_destroy(&ps.work_cv);
+  pthread_cond_destroy(&ps.done_cv);
+  pthread_mutex_destroy(&ps.errlock);
+  pthread_mutex_destroy(&ps.lock);
+  if (workers)       free(workers);
+  if (ps.vnodes)     free(ps.vnodes);
+  if (ps.nfilled)    free(ps.nfilled);
+  if (ps.status)     free(ps.status);
+  if (ps.done)       free(ps.done);
+  if (ps.vl.offsets) free(ps.vl.offsets);
+  return r;
+}
@@ -34,10 +34,6 @@
 #include "internal.h"
 #include "stagehdr.h"
 
-static afs_uint32 parse_dumphdr  (XFILE *, unsigned char *, tagged_field *,
-                               afs_uint32, tag_parse_info *, void *, void *);
-static afs_uint32 parse_dumpend  (XFILE *, unsigned char *, tagged_field *,
-                               afs_uint32, tag_parse_info *, void *, void *);
 static afs_uint32 store_dumphdr  (XFILE *, unsigned char *, tagged_field *,
                                afs_uint32, tag_parse_info *, void *, void *);
 static afs_uint32 parse_dumptimes(XFILE *, unsigned char *, tagged_field *,
@@ -65,9 +61,9 @@ static tagged_field dumphdr_fields[] = {
 /* Parse a dump header, including its tagged attributes, and call the
  * dump-header callback, if one is defined.
  */
-static afs_uint32 parse_dumphdr(XFILE *X, unsigned char *tag, tagged_field *field,
-                             afs_uint32 value, tag_parse_info *pi,
-                             void *g_refcon, void *l_refcon)
+afs_uint32 parse_dumphdr(XFILE *X, unsigned char *tag, tagged_field *field,
+                      afs_uint32 value, tag_parse_info *pi,
+                      void *g_refcon, void *l_refcon)
 {
   dump_parser *p = (dump_parser *)g_refcon;
   afs_dump_header hdr;
@@ -181,9 +177,9 @@ static afs_uint32 parse_dumptimes(XFILE *X, unsigned char *tag,
 
 
 /* Parse a dump_end record */
-static afs_uint32 parse_dumpend(XFILE *X, unsigned char *tag, tagged_field *field,
-                             afs_uint32 value, tag_parse_info *pi,
-                             void *g_refcon, void *l_refcon)
+afs_uint32 parse_dumpend(XFILE *X, unsigned char *tag, tagged_field *field,
+                      afs_uint32 value, tag_parse_info *pi,
+                      void *g_refcon, void *l_refcon)
 {
   dump_parser *p = (dump_parser *)g_refcon;
 
@@ -205,10 +201,15 @@ afs_uint32 ParseDumpFile(XFILE *X, dump_parser *p)
 {
   tag_parse_info pi;
   unsigned char tag;
-  afs_uint32 r;
+  afs_uint32 r, r2;
 
   prep_pi(p, &pi);
   r = ParseTaggedData(X, top_fields, &tag, &pi, (void *)p, 0);
+
+  /* Deliver whatever was batched, even if we stopped on an error; if
+   * we did, that error is the one reported.
+   */
+  if ((r2 = FlushVNodeBatch(X, p)) && r == DSERR_DONE) r = r2;
   return handle_return(r, X, tag, p);
 }
 
@@ -244,6 +245,18 @@ afs_uint32 ParseVolumeHeader(XFILE *X, dump_parser *p)
 
 
 afs_uint32 ParseVNode(XFILE *X, dump_parser *p)
+{
+  afs_uint32 r;
+
+  r = parse_next_vnode(X, p);
+  return (r == DSERR_DONE) ? 0 : r;
+}
+
+
+/* Like ParseVNode, but if a callback asks us to stop early, return
+ * DSERR_DONE so the caller can tell that from an ordinary vnode.
+ */
+afs_uint32 parse_next_vnode(XFILE *X, dump_parser *p)
 {
   tag_parse_info pi;
   unsigned char tag;
@@ -253,6 +266,7 @@ afs_uint32 ParseVNode(XFILE *X, dump_parser *p)
   if (r = ReadByte(X, &tag)) return handle_return(r, X, tag, p);
   if (tag != TAG_VNODE) return handle_return(0, X, tag, p);
   r = parse_vnode(X, &tag, &top_fields[2], 0, &pi, (void *)p, 0);
-  if (!r && tag >= 1 && tag <= 4) r = DSERR_DONE;
+  if (r == DSERR_DONE) return r;
+  if (!r && tag >= 1 && tag <= 4) return 0;
   return handle_return(r, X, tag, p);
 }
@@ -30,6 +30,13 @@
 
 #include "dumpscan.h"
 #include "dumpscan_errs.h"
+#include "xf_errs.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define SKIP_MINBLOCK 512
+#define SKIP_MAXBLOCK 65536
 
 /* If a parser function is defined, it will be called after the data value
  * (if any) is read.  The parser is called as follows:
@@ -53,6 +60,75 @@
  * that the memory allocated for the value should not be freed.
  */
 
+/* Return the index of the first non-null byte in buf, or len if none */
+static afs_uint32 find_nonnull(unsigned char *buf, afs_uint32 len)
+{
+  afs_uint32 i = 0;
+#ifdef __SSE2__
+  __m128i zero = _mm_setzero_si128();
+  int mask;
+
+  for (; i + 16 <= len; i += 16) {
+    mask = _mm_movemask_epi8(_mm_cmpeq_epi8(
+             _mm_loadu_si128((__m128i *)(buf + i)), zero));
+    if (mask != 0xffff) {
+      for (mask = ~mask; !(mask & 1); mask >>= 1) i++;
+      return i;
+    }
+  }
+#endif
+  for (; i < len; i++)
+    if (buf[i]) return i;
+  return len;
+}
+
+
+/* Skip over a run of null bytes.  On entry, one null has already been
+ * read; on return, *tag holds the first non-null byte and *count is the
+ * number of bytes read after the first null, including that one.
+ * On seekable files, this reads ahead in blocks and seeks back to just
+ * after the non-null byte, so long runs don't take a call per byte.
+ */
+static afs_uint32 skip_nulls(XFILE *X, unsigned char *tag, int *count)
+{
+  unsigned char *buf = 0;
+  afs_uint32 r, i, size = SKIP_MINBLOCK;
+  u_int64 where, next;
+
+  *count = 0;
+  *tag = 0;
+  if (X->is_seekable && !X->passthru
+  &&  (buf = (unsigned char *)malloc(SKIP_MAXBLOCK))) {
+    for (;;) {
+      if (r = xftell(X, &where)) break;
+      if (r = xfread(X, buf, size)) {
+        /* Probably near the end of the file; finish up the slow way */
+        r = xfseek(X, &where);
+        break;
+      }
+      i = find_nonnull(buf, size);
+      if (i < size) {
+        *tag = buf[i];
+        *count += i + 1;
+        add64_32(next, where, i + 1);
+        free(buf);
+        return xfseek(X, &next);
+      }
+      *count += size;
+      if (size < SKIP_MAXBLOCK) size <<= 1;
+    }
+    free(buf);
+    if (r) return r;
+  }
+
+  while (!*tag) {
+    if (r = ReadByte(X, tag)) return r;
+    (*count)++;
+  }
+  return 0;
+}
+
+
 /* Parse a file containing tagged data and attributes **/
 afs_uint32 ParseTaggedData(XFILE *X, tagged_field *fields, unsigned char *tag,
                     tag_parse_info *pi, void *g_refcon, void *l_refcon)
@@ -105,11 +181,7 @@ afs_uint32 ParseTaggedData(XFILE *X, tagged_field *fields, unsigned char *tag,
       u_int64 where, tmp64a;
 
       if (r = xftell(X, &where)) return r;
-      
-      while (!*tag) {
-        if (r = ReadByte(X, tag)) return r;
-        count++;
-      }
+      if (r = skip_nulls(X, tag, &count)) return r;
       pi->shift_offset += count;
       cp64(pi->shift_start, where);
       if (pi->cb_error) {
@@ -31,6 +31,7 @@
 #include <sys/types.h>
 #include <netinet/in.h>
 #include <errno.h>
+#include <stddef.h>
 
 #include "dumpscan.h"
 #include "dumpscan_errs.h"
@@ -40,7 +41,6 @@
 #include <afs/acl.h>
 #include <afs/prs_fs.h>
 
-static afs_uint32 LastGoodVNode = 0;
 static afs_uint32 store_vnode(XFILE *, unsigned char *, tagged_field *, afs_uint32,
                            tag_parse_info *, void *, void *);
 static afs_uint32 parse_acl  (XFILE *, unsigned char *, tagged_field *, afs_uint32,
@@ -49,20 +49,28 @@ static afs_uint32 parse_vdata(XFILE *, unsigned char *, tagged_field *, afs_uint
                            tag_parse_info *, void *, void *);
 static afs_uint32 parse_vdata_large(XFILE *, unsigned char *, tagged_field *, afs_uint32,
                            tag_parse_info *, void *, void *);
+static afs_uint32 push_chunks(XFILE *, dump_parser *, afs_vnode *, char *);
 
-/** Field list for vnodes **/
+#define DATA_CHUNK_SIZE 65536  /* Largest chunk passed to cb_data_chunk */
+
+/* Does the caller want this field?  Fields with no mask bit are always
+ * wanted, since we need the type and size to parse the rest of the vnode.
+ */
+#define WANT_FIELD(p,f) (!(f) || !(p)->vnode_fields || ((p)->vnode_fields & (f)))
+
+/** Field list for vnodes.  refarg is the field's F_VNODE_* bit. **/
 static tagged_field vnode_fields[] = {
   { VTAG_TYPE,        DKIND_BYTE,    " VNode type:   ", store_vnode,       0, 0 },
-  { VTAG_NLINKS,      DKIND_INT16,   " Link count:   ", store_vnode,       0, 0 },
-  { VTAG_DVERS,       DKIND_INT32,   " Version:      ", store_vnode,       0, 0 },
-  { VTAG_CLIENT_DATE, DKIND_TIME,    " Client Date:  ", store_vnode,       0, 0 },
-  { VTAG_AUTHOR,      DKIND_INT32,   " Author:       ", store_vnode,       0, 0 },
-  { VTAG_OWNER,       DKIND_INT32,   " Owner:        ", store_vnode,       0, 0 },
-  { VTAG_GROUP,       DKIND_INT32,   " Group:        ", store_vnode,       0, 0 },
-  { VTAG_MODE,        DKIND_OCT16,   " UNIX mode:    ", store_vnode,       0, 0 },
-  { VTAG_PARENT,      DKIND_INT32,   " Parent:       ", store_vnode,       0, 0 },
-  { VTAG_SERVER_DATE, DKIND_TIME,    " Server Date:  ", store_vnode,       0, 0 },
-  { VTAG_ACL,         DKIND_SPECIAL, " xxxxxxxx ACL: ", parse_acl,         0, 0 },
+  { VTAG_NLINKS,      DKIND_INT16,   " Link count:   ", store_vnode,       0, F_VNODE_NLINKS },
+  { VTAG_DVERS,       DKIND_INT32,   " Version:      ", store_vnode,       0, F_VNODE_DVERS },
+  { VTAG_CLIENT_DATE, DKIND_TIME,    " Client Date:  ", store_vnode,       0, F_VNODE_CDATE },
+  { VTAG_AUTHOR,      DKIND_INT32,   " Author:       ", store_vnode,       0, F_VNODE_AUTHOR },
+  { VTAG_OWNER,       DKIND_INT32,   " Owner:        ", store_vnode,       0, F_VNODE_OWNER },
+  { VTAG_GROUP,       DKIND_INT32,   " Group:        ", store_vnode,       0, F_VNODE_GROUP },
+  { VTAG_MODE,        DKIND_OCT16,   " UNIX mode:    ", store_vnode,       0, F_VNODE_MODE },
+  { VTAG_PARENT,      DKIND_INT32,   " Parent:       ", store_vnode,       0, F_VNODE_PARENT },
+  { VTAG_SERVER_DATE, DKIND_TIME,    " Server Date:  ", store_vnode,       0, F_VNODE_SDATE },
+  { VTAG_ACL,         DKIND_SPECIAL, " xxxxxxxx ACL: ", parse_acl,         0, F_VNODE_ACL },
   { VTAG_DATA,        DKIND_SPECIAL, " Contents:     ", parse_vdata,       0, 0 },
   { VTAG_DATA_LARGE,  DKIND_SPECIAL, " Contents:     ", parse_vdata_large, 0, 0 },
   { 0,0,0,0,0,0 }};
@@ -73,19 +81,12 @@ static afs_uint32 resync_vnode(XFILE *X, dump_parser *p, afs_vnode *v,
 {
   u_int64 where, expected_where;
   afs_uint32 r;
-  int i;
 
   if (r = xftell(X, &expected_where)) return r;
   cp64(where, expected_where);
 
-  r = match_next_vnode(X, p, &where, v->vnode);
+  r = find_next_vnode(X, p, &where, v->vnode, start, limit);
   if (r && r != DSERR_FMT) return r;
-  if (r) for (i = -start; i < limit; i++) {
-    add64_32(where, expected_where, i);
-    r = match_next_vnode(X, p, &where, v->vnode);
-    if (!r) break;
-    if (r != DSERR_FMT) return r;
-  }
   if (r) {
     if (p->cb_error)
       (p->cb_error)(r, 1, p->err_refcon,
@@ -120,19 +121,24 @@ afs_uint32 parse_vnode(XFILE *X, unsigned char *tag, tagged_field *field,
   u_int64 where, offset2k;
   afs_vnode v;
   afs_uint32 r;
+  int deferred = 0;
+
 
+  /* Stop here if the caller only wants the headers */
+  if (p->flags & DSFLAG_HDRONLY) return DSERR_DONE;
 
   if (r = xftell(X, &where)) return r;
-  memset(&v, 0, sizeof(v));
+  /* The ACL is only used if F_VNODE_ACL is set, so don't bother clearing it */
+  memset(&v, 0, offsetof(afs_vnode, acl));
   sub64_32(v.offset, where, 1);
   if (r = ReadInt32(X, &v.vnode)) return r;
   if (r = ReadInt32(X, &v.vuniq)) return r;
 
   mk64(offset2k, 0, 2048);
-  if (!LastGoodVNode
+  if (!p->last_good_vnode
   || ((p->flags & DSFLAG_SEEK) && v.vnode == 1
        && lt64(v.offset, offset2k)))
-    LastGoodVNode = -1;
+    p->last_good_vnode = -1;
 
   if (p->print_flags & DSPRINT_ITEM) {
     printf("%s %d/%d [%s = 0x%s]\n", field->label, v.vnode, v.vuniq,
@@ -141,8 +147,25 @@ afs_uint32 parse_vnode(XFILE *X, unsigned char *tag, tagged_field *field,
 
   r = ParseTaggedData(X, vnode_fields, tag, pi, g_refcon, (void *)&v);
 
+  /* With no data tag, parse_vdata never ran, so cb_vnode_attrs and
+   * cb_data_chunk are called here instead.  There is no data for the
+   * former to dispose of, and the latter gets its one empty chunk.
+   */
+  if (!r && !(v.field_mask & F_VNODE_SIZE)) {
+    int disp = DSDATA_DEFAULT;
+
+    if (p->cb_vnode_attrs) r = (p->cb_vnode_attrs)(&v, &disp, p->refcon);
+    if (!r && p->cb_data_chunk) r = push_chunks(X, p, &v, 0);
+  }
+
+  /* If we stopped at the vnode data, we're done with the attributes */
+  if (r == DSERR_DONE && (p->flags & DSFLAG_DEFER)) {
+    deferred = 1;
+    r = 0;
+  }
+
   /* Try to resync, if requested */
-  if (!r && (p->repair_flags & DSFIX_VFSYNC)) {
+  if (!r && !deferred && (p->repair_flags & DSFIX_VFSYNC)) {
     afs_uint32 drop;
     u_int64 xwhere;
 
@@ -157,7 +180,7 @@ afs_uint32 parse_vnode(XFILE *X, unsigned char *tag, tagged_field *field,
        * the next one.  Otherwise, we throw it out, and start the search
        * at the starting point of this vnode.
        */
-      drop = r = match_next_vnode(X, p, &v.offset, LastGoodVNode);
+      drop = r = match_next_vnode(X, p, &v.offset, p->last_good_vnode);
       if (r && r != DSERR_FMT) goto out;
       if (!r) {
         add64_32(where, v.offset, 1);
@@ -177,7 +200,7 @@ afs_uint32 parse_vnode(XFILE *X, unsigned char *tag, tagged_field *field,
       if (r = xfseek(X, &where)) goto out;
     }
   }
-  LastGoodVNode = v.vnode;
+  p->last_good_vnode = v.vnode;
 
   if (!r) {
     if (v.field_mask & F_VNODE_TYPE)
@@ -199,16 +222,93 @@ afs_uint32 parse_vnode(XFILE *X, unsigned char *tag, tagged_field *field,
         else xfseek(X, &where);
       }
     }
+    if (!r && p->cb_vnode_batch) r = batch_vnode(X, p, &v);
   }
 
+  if (!r && deferred) r = DSERR_DONE;
+
 out:
   if (v.field_mask & F_VNODE_LINK_TARGET)
     free(v.link_target);
+  if (v.field_mask & F_VNODE_BUFFER)
+    free(v.data);
+
+  return r;
+}
+
+
+/* Deliver the vnodes in the current batch */
+static afs_uint32 deliver_batch(XFILE *X, dump_parser *p)
+{
+  u_int64 where;
+  afs_uint32 r;
 
+  r = xftell(X, &where);
+  if (!r) r = (p->cb_vnode_batch)(p->batch, X, p->refcon);
+  if (p->flags & DSFLAG_SEEK) {
+    if (!r) r = xfseek(X, &where);
+    else xfseek(X, &where);
+  }
+  p->batch->count = 0;
   return r;
 }
 
 
+/* Add a vnode to the current batch, delivering the batch if it is full */
+afs_uint32 batch_vnode(XFILE *X, dump_parser *p, afs_vnode *v)
+{
+  vnode_batch *b = p->batch;
+  afs_uint32 i;
+
+  if (!b) {
+    b = p->batch = (vnode_batch *)malloc(sizeof(vnode_batch));
+    if (!b) return ENOMEM;
+    b->count = 0;
+  }
+
+  i = b->count++;
+  b->field_mask[i]  = v->field_mask;
+  b->vnode[i]       = v->vnode;
+  b->vuniq[i]       = v->vuniq;
+  b->type[i]        = v->type;
+  b->nlinks[i]      = v->nlinks;
+  b->mode[i]        = v->mode;
+  b->parent[i]      = v->parent;
+  b->datavers[i]    = v->datavers;
+  b->author[i]      = v->author;
+  b->owner[i]       = v->owner;
+  b->group[i]       = v->group;
+  b->client_date[i] = v->client_date;
+  b->server_date[i] = v->server_date;
+  cp64(b->size[i],     v->size);
+  cp64(b->offset[i],   v->offset);
+  cp64(b->d_offset[i], v->d_offset);
+
+  if (b->count < VNODE_BATCH_SIZE) return 0;
+  return deliver_batch(X, p);
+}
+
+
+/* Deliver any vnodes remaining in the current batch, and free it */
+afs_uint32 FlushVNodeBatch(XFILE *X, dump_parser *p)
+{
+  afs_uint32 r = 0;
+
+  if (p->batch && p->batch->count && p->cb_vnode_batch)
+    r = deliver_batch(X, p);
+  discard_vnode_batch(p);
+  return r;
+}
+
+
+/* Throw away the current batch, if any */
+void discard_vnode_batch(dump_parser *p)
+{
+  if (p->batch) free(p->batch);
+  p->batch = 0;
+}
+
+
 /* Store data in a vnode */
 static afs_uint32 store_vnode(XFILE *X, unsigned char *tag, tagged_field *field,
                            afs_uint32 value, tag_parse_info *pi,
@@ -219,6 +319,7 @@ static afs_uint32 store_vnode(XFILE *X, unsigned char *tag, tagged_field *field,
   time_t when;
   afs_uint32 r = 0;
 
+  if (!WANT_FIELD(p, field->refarg)) return 0;
   switch (field->tag) {
   case VTAG_TYPE:
     v->field_mask |= F_VNODE_TYPE;
@@ -348,6 +449,10 @@ static afs_uint32 parse_acl(XFILE *X, unsigned char *tag, tagged_field *field,
   afs_vnode *v = (afs_vnode *)l_refcon;
   afs_uint32 r, i, n;
 
+  if (!WANT_FIELD(p, field->refarg)) {
+    if (r = xfskip(X, SIZEOF_LARGEDISKVNODE - SIZEOF_SMALLDISKVNODE)) return r;
+    return ReadByte(X, tag);
+  }
   if (r = xfread(X, v->acl, SIZEOF_LARGEDISKVNODE - SIZEOF_SMALLDISKVNODE))
     return r;
 
@@ -375,6 +480,37 @@ static afs_uint32 parse_acl(XFILE *X, unsigned char *tag, tagged_field *field,
 }
 
 
+/* Pass vnode data to cb_data_chunk, either from mem or from the input */
+static afs_uint32 push_chunks(XFILE *X, dump_parser *p, afs_vnode *v, char *mem)
+{
+  u_int64 offset, left;
+  afs_uint32 r = 0, n;
+  char *buf = 0;
+
+  mk64(offset, 0, 0);
+  if (zero64(v->size))
+    return (p->cb_data_chunk)(v, mem, 0, &offset, 1, p->refcon);
+
+  n = (hi64(v->size) || lo64(v->size) > DATA_CHUNK_SIZE)
+    ? DATA_CHUNK_SIZE : lo64(v->size);
+  if (!mem && !(buf = (char *)malloc(n))) return ENOMEM;
+
+  cp64(left, v->size);
+  while (!zero64(left)) {
+    n = (hi64(left) || lo64(left) > DATA_CHUNK_SIZE)
+      ? DATA_CHUNK_SIZE : lo64(left);
+    if (mem) buf = mem + lo64(offset);
+    else if (r = xfread(X, buf, n)) break;
+    sub64_32(left, left, n);
+    r = (p->cb_data_chunk)(v, buf, n, &offset, zero64(left), p->refcon);
+    if (r) break;
+    add64_32(offset, offset, n);
+  }
+  if (!mem) free(buf);
+  return r;
+}
+
+
 /* Parse or skip over the vnode data */
 static afs_uint32 parse_vdata(XFILE *X, unsigned char *tag, tagged_field *field,
                            afs_uint32 value, tag_parse_info *pi,
@@ -386,7 +522,7 @@ static afs_uint32 parse_vdata(XFILE *X, unsigned char *tag, tagged_field *field,
   afs_uint32 r;
   afs_uint32 tmp32;
   u_int64 tmp64;
-  int used = 0;
+  int used = 0, disp = DSDATA_DEFAULT;
 
   if (r = ReadInt32(X, &tmp32)) return r;
   v->field_mask |= F_VNODE_SIZE;
@@ -404,38 +540,89 @@ static afs_uint32 parse_vdata(XFILE *X, unsigned char *tag, tagged_field *field,
       printf("bytes at %s (0x%s)\n",
              decimate_int64(&v->d_offset, 0), hexify_int64(&v->d_offset, 0));
     }
-    
-    switch (v->type) {
-      case vSymlink:
-        v->link_target = (char *)malloc(get64(v->size) + 1);
-        if (v->link_target) {
-          if (r = xfread(X, v->link_target, get64(v->size))) return r;
-          v->link_target[get64(v->size)] = 0;
-          v->field_mask |= F_VNODE_LINK_TARGET;
-          used++;
-          if (p->print_flags & DSPRINT_VNODE)
-            printf("Target:       %s\n", v->link_target);
-        } else {
-          /* Call the callback here, because it's non-fatal */
-          if (p->cb_error)
-            (p->cb_error)(ENOMEM, 0, p->err_refcon,
-                          "Out of memory reading symlink");
-        }
-        break;
+  } else if (p->print_flags & DSPRINT_VNODE) {
+    printf("%sEmpty\n", field->label);
+  }
 
-      case vDirectory:
-        if (p->cb_dirent || (p->print_flags & DSPRINT_DIR)) {
-          if (r = parse_directory(X, p, v, get64(v->size), 0)) return r;
-          used++;
-        }
+  /* Leave the data where it is, for the caller to read */
+  if (p->flags & DSFLAG_DEFER) return DSERR_DONE;
+
+  /* Let the caller decide what to do with the data */
+  if (p->cb_vnode_attrs && (r = (p->cb_vnode_attrs)(v, &disp, p->refcon)))
+    return r;
+
+  if (v->field_mask & F_VNODE_DATA) switch (disp) {
+    case DSDATA_DEFAULT:
+      switch (v->type) {
+        case vSymlink:
+          if (!WANT_FIELD(p, F_VNODE_LINK_TARGET)) break;
+          v->link_target = (char *)malloc(get64(v->size) + 1);
+          if (v->link_target) {
+            if (r = xfread(X, v->link_target, get64(v->size))) return r;
+            v->link_target[get64(v->size)] = 0;
+            v->field_mask |= F_VNODE_LINK_TARGET;
+            used++;
+            if (p->print_flags & DSPRINT_VNODE)
+              printf("Target:       %s\n", v->link_target);
+          } else {
+            /* Call the callback here, because it's non-fatal */
+            if (p->cb_error)
+              (p->cb_error)(ENOMEM, 0, p->err_refcon,
+                            "Out of memory reading symlink");
+          }
+          break;
+
+        case vDirectory:
+          if (p->cb_dirent || (p->print_flags & DSPRINT_DIR)) {
+            if (r = parse_directory(X, p, v, get64(v->size), 0)) return r;
+            used++;
+          }
+          break;
+      }
+      break;
+
+    case DSDATA_BUFFER:
+      /* Too big to buffer, so pass it on as if streaming; non-fatal */
+      if (hi64(v->size) || lo64(v->size) == 0xffffffff) {
+        if (p->cb_error)
+          (p->cb_error)(EFBIG, 0, p->err_refcon,
+                        "Vnode %d is too big to buffer; streaming it instead",
+                        v->vnode);
+        disp = DSDATA_STREAM;
         break;
+      }
+      if (!(v->data = (char *)malloc(lo64(v->size) + 1))) return ENOMEM;
+      v->field_mask |= F_VNODE_BUFFER;
+      if (r = xfread(X, v->data, lo64(v->size))) return r;
+      v->data[lo64(v->size)] = 0;
+      used++;
+      break;
+
+    case DSDATA_DIR:
+      if (r = parse_directory(X, p, v, get64(v->size), 0)) return r;
+      used++;
+      break;
+  }
+
+  /* Push the data to the chunk callback, from memory if we have it */
+  if (p->cb_data_chunk && disp != DSDATA_SKIP) {
+    if (v->field_mask & F_VNODE_BUFFER)
+      r = push_chunks(X, p, v, v->data);
+    else if (v->field_mask & F_VNODE_LINK_TARGET)
+      r = push_chunks(X, p, v, v->link_target);
+    else if (!used) {
+      r = push_chunks(X, p, v, 0);
+      used++;
+    } else if (p->flags & DSFLAG_SEEK) {
+      if (r = xfseek(X, &v->d_offset)) return r;
+      r = push_chunks(X, p, v, 0);
     }
-  } else if (p->print_flags & DSPRINT_VNODE) {
-    printf("%sEmpty\n", field->label);
+    if (r) return r;
   }
 
   cb = 0;
-  if (v->field_mask & F_VNODE_TYPE) {
+  if ((v->field_mask & F_VNODE_TYPE)
+  &&  (disp == DSDATA_DEFAULT || disp == DSDATA_STREAM || disp == DSDATA_DIR)) {
     switch (v->type) {
       case vFile:      cb = p->cb_file_data;  break;
       case vDirectory: cb = p->cb_dir_data;   break;
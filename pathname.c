@@ -29,51 +29,266 @@
 /* pathname.c - Pathname lookup and traversal */
 
 #include <errno.h>
+#include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "dumpscan.h"
 #include "dumpscan_errs.h"
 
-/* Hash function for a vnode */
-#define BUCKET_SIZE 32
-#define vnode_hash(phi,vnode) ((vnode) & ((1 << (phi)->hash_size) - 1))
+/* Protects the directory path cache in every path_hashinfo */
+static pthread_mutex_t path_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Vnode numbers are dense, with directories odd and files even, so each
+ * kind gets a table indexed by vnode >> 1.  Vnodes whose index is beyond
+ * what the volume's file count makes plausible go in a third table,
+ * allocated densely and found through an open hash on vnode number.
+ */
+#define VT_FILES     0
+#define VT_DIRS      1
+#define VT_SPARSE    2
+#define DENSE_SLACK  65536
+
+/* A vnode's place in the tables; VF(s, field) is one of its fields */
+typedef struct {
+  vnode_table *t;
+  afs_uint32 i;
+} vslot;
+#define VF(s, f) ((s).t->f[(s).i])
+
+
+/* Make room for at least need slots in a table */
+static int grow_table(vnode_table *t, afs_uint32 need, afs_uint32 limit,
+                      int paths, int vnodes)
+{
+  afs_uint32 size, old = t->size;
+  void *x;
+
+  size = old ? old * 2 : 1024;
+  if (size < need) size = need;
+  if (limit && size > limit) size = limit;
+
+#define GROW(field) \
+  if (!(x = realloc(t->field, size * sizeof(*t->field)))) return ENOMEM; \
+  t->field = x; \
+  memset(t->field + old, 0, (size - old) * sizeof(*t->field))
+
+  GROW(present);
+  GROW(parent);
+  GROW(v_offset);
+  GROW(d_offset);
+  GROW(d_size);
+  GROW(name);
+  GROW(name_dir);
+  if (paths) {
+    GROW(path[0]);
+    GROW(path[1]);
+  }
+  if (vnodes) {
+    GROW(vnode);
+  }
+#undef GROW
+  t->size = size;
+  return 0;
+}
 
 
-static vhash_ent *get_vhash_ent(path_hashinfo *phi, afs_uint32 vnode, int make)
+static void free_table(vnode_table *t)
 {
-  int key = vnode_hash(phi, vnode);
-  vhash_ent *vhe;
-
-  for (vhe = phi->hash_table[key];
-       vhe && vhe->vnode != vnode;
-       vhe = vhe->next);
-  if (make && !vhe) {
-    vhe = (vhash_ent *)malloc(sizeof(vhash_ent));
-    if (vhe) {
-      memset(vhe, 0, sizeof(vhash_ent));
-      vhe->vnode = vnode;
-      vhe->next = phi->hash_table[key];
-      phi->hash_table[key] = vhe;
+  if (t->present)  free(t->present);
+  if (t->parent)   free(t->parent);
+  if (t->v_offset) free(t->v_offset);
+  if (t->d_offset) free(t->d_offset);
+  if (t->d_size)   free(t->d_size);
+  if (t->name)     free(t->name);
+  if (t->name_dir) free(t->name_dir);
+  if (t->path[0])  free(t->path[0]);
+  if (t->path[1])  free(t->path[1]);
+  if (t->vnode)    free(t->vnode);
+}
+
+
+/* Find a vnode in the sparse table, making it if asked */
+static int find_sparse(path_hashinfo *phi, afs_uint32 vnode, int make,
+                       vslot *s)
+{
+  vnode_table *t = &phi->tables[VT_SPARSE];
+  afs_uint32 *table, size, h, i, x;
+
+  for (h = vnode & (phi->sparse_hash_size - 1);
+       phi->sparse_hash_size && (x = phi->sparse_hash[h]);
+       h = (h + 1) & (phi->sparse_hash_size - 1))
+    if (t->vnode[x - 1] == vnode) {
+      s->t = t;
+      s->i = x - 1;
+      return 1;
+    }
+  if (!make) return 0;
+
+  if (phi->n_sparse == t->size && grow_table(t, 0, 0, 1, 1)) return 0;
+  if (2 * (phi->n_sparse + 1) > phi->sparse_hash_size) {
+    size = phi->sparse_hash_size ? phi->sparse_hash_size * 2 : 256;
+    if (!(table = (afs_uint32 *)malloc(size * sizeof(afs_uint32)))) return 0;
+    memset(table, 0, size * sizeof(afs_uint32));
+    for (i = 0; i < phi->n_sparse; i++) {
+      for (h = t->vnode[i] & (size - 1); table[h]; h = (h + 1) & (size - 1));
+      table[h] = i + 1;
     }
+    if (phi->sparse_hash) free(phi->sparse_hash);
+    phi->sparse_hash = table;
+    phi->sparse_hash_size = size;
+  }
+  for (h = vnode & (phi->sparse_hash_size - 1);
+       phi->sparse_hash[h];
+       h = (h + 1) & (phi->sparse_hash_size - 1));
+  i = phi->n_sparse++;
+  phi->sparse_hash[h] = i + 1;
+  t->vnode[i] = vnode;
+  t->present[i] = 1;
+  s->t = t;
+  s->i = i;
+  return 1;
+}
+
+
+/* Find a vnode, making it if asked.  Returns 0 if the vnode isn't
+ * there, or if it should have been made but we're out of memory.
+ */
+static int find_vnode(path_hashinfo *phi, afs_uint32 vnode, int make,
+                      vslot *s)
+{
+  vnode_table *t = &phi->tables[(vnode & 1) ? VT_DIRS : VT_FILES];
+  afs_uint32 i = vnode >> 1;
+
+  if (i > phi->dense_max) return find_sparse(phi, vnode, make, s);
+  if (i >= t->size || !t->present[i]) {
+    if (!make) return 0;
+    if (i >= t->size && grow_table(t, i + 1, phi->dense_max + 1, vnode & 1, 0))
+      return 0;
+    t->present[i] = 1;
   }
-  return vhe;
+  s->t = t;
+  s->i = i;
+  return 1;
+}
+
+
+/* Set the limit on dense table indices, given the volume's file count */
+static void set_dense_max(path_hashinfo *phi, afs_uint32 nfiles)
+{
+  phi->n_vnodes = nfiles;
+  phi->dense_max = (nfiles < DENSE_SLACK ? nfiles : DENSE_SLACK) + nfiles
+                 + DENSE_SLACK;
+}
+
+
+/* Add a name to the name pool, if it isn't there already.
+ * Returns its offset in the pool, or 0 if we're out of memory.
+ */
+static afs_uint32 intern_name(path_hashinfo *phi, char *name)
+{
+  afs_uint32 *table, hval, slot, off, size, i;
+  int l = strlen(name) + 1;
+  char *x;
+
+  if (2 * (phi->n_names + 1) > phi->name_hash_size) {
+    size = phi->name_hash_size ? phi->name_hash_size * 2 : 1024;
+    table = (afs_uint32 *)malloc(size * sizeof(afs_uint32));
+    if (!table) return 0;
+    memset(table, 0, size * sizeof(afs_uint32));
+    for (i = 0; i < phi->name_hash_size; i++) {
+      if (!(off = phi->name_hash[i])) continue;
+      for (hval = 0, x = phi->names + off; *x; x++)
+        hval = (hval * 173) + (unsigned char)*x;
+      for (slot = hval & (size - 1); table[slot]; slot = (slot + 1) & (size - 1));
+      table[slot] = off;
+    }
+    if (phi->name_hash) free(phi->name_hash);
+    phi->name_hash = table;
+    phi->name_hash_size = size;
+  }
+
+  for (hval = 0, x = name; *x; x++)
+    hval = (hval * 173) + (unsigned char)*x;
+  for (slot = hval & (phi->name_hash_size - 1);
+       (off = phi->name_hash[slot]);
+       slot = (slot + 1) & (phi->name_hash_size - 1))
+    if (!strcmp(phi->names + off, name)) return off;
+
+  if (!phi->names_len) phi->names_len = 1;   /* Offset 0 means no name */
+  if (phi->names_len + l > phi->names_max) {
+    for (size = phi->names_max ? phi->names_max : 4096;
+         phi->names_len + l > size;
+         size *= 2);
+    if (!(x = (char *)realloc(phi->names, size))) return 0;
+    phi->names = x;
+    phi->names_max = size;
+  }
+  off = phi->names_len;
+  memcpy(phi->names + off, name, l);
+  phi->names_len += l;
+  phi->name_hash[slot] = off;
+  phi->n_names++;
+  return off;
+}
+
+
+/* Remember another name of a file with more than one link */
+static afs_uint32 add_link(path_hashinfo *phi, afs_uint32 vnode,
+                           afs_uint32 dvnum, afs_uint32 name)
+{
+  path_link *x;
+
+  if (phi->n_links == phi->max_links) {
+    phi->max_links = phi->max_links ? phi->max_links * 2 : 64;
+    x = (path_link *)realloc(phi->links, phi->max_links * sizeof(path_link));
+    if (!x) return ENOMEM;
+    phi->links = x;
+  }
+  phi->links[phi->n_links].vnode = vnode;
+  phi->links[phi->n_links].dir   = dvnum;
+  phi->links[phi->n_links].name  = name;
+  phi->n_links++;
+  phi->links_sorted = 0;
+  return 0;
+}
+
+
+/* Note the name a vnode has in directory dvnum.  A directory lookup
+ * finds the first entry for a vnode, so that one wins within a directory;
+ * but like the parent link, a later directory replaces an earlier one.
+ * Names a file loses this way are kept, for Path_BuildLinks.
+ */
+static afs_uint32 set_name(path_hashinfo *phi, vslot s, afs_uint32 vnode,
+                           afs_uint32 dvnum, char *name)
+{
+  afs_uint32 off, r;
+
+  if (!VF(s, name) || (vnode & 1)) {
+    if (VF(s, name) && VF(s, name_dir) == dvnum) return 0;
+    if (!(VF(s, name) = intern_name(phi, name))) return ENOMEM;
+    VF(s, name_dir) = dvnum;
+    return 0;
+  }
+
+  if (!(off = intern_name(phi, name))) return ENOMEM;
+  if (VF(s, name_dir) == dvnum) {
+    if (off == VF(s, name)) return 0;
+    return add_link(phi, vnode, dvnum, off);
+  }
+  if (r = add_link(phi, vnode, VF(s, name_dir), VF(s, name))) return r;
+  VF(s, name) = off;
+  VF(s, name_dir) = dvnum;
+  return 0;
 }
 
 
 static afs_uint32 volhdr_cb(afs_vol_header *hdr, XFILE *X, void *refcon)
 {
   path_hashinfo *phi = (path_hashinfo *)refcon;
-  int nfiles, hsize;
 
   if (hdr->field_mask & F_VOLHDR_NFILES) {
-    nfiles = phi->n_vnodes = hdr->nfiles;
-    for (phi->hash_size = 1;
-         nfiles > BUCKET_SIZE;
-         phi->hash_size++, nfiles >>= 1);
-    hsize = (1 << phi->hash_size);
-    phi->hash_table = (vhash_ent **)malloc(hsize * sizeof(vhash_ent *));
-    if (!phi->hash_table) return ENOMEM;
-    memset(phi->hash_table, 0, hsize * sizeof(vhash_ent *));
+    set_dense_max(phi, hdr->nfiles);
     return 0;
   } else {
     if (phi->p->cb_error)
@@ -84,25 +299,28 @@ static afs_uint32 volhdr_cb(afs_vol_header *hdr, XFILE *X, void *refcon)
 }
 
 
+static afs_uint32 no_volhdr(path_hashinfo *phi)
+{
+  if (phi->p->cb_error)
+    (phi->p->cb_error)(DSERR_FMT, 1, phi->p->err_refcon,
+                       "No volume header in dump???");
+  return DSERR_FMT;
+}
+
+
 static afs_uint32 vnode_keep(afs_vnode *v, XFILE *X, void *refcon)
 {
   path_hashinfo *phi = (path_hashinfo *)refcon;
-  vhash_ent *vhe;
+  vslot s;
 
-  if (!phi->hash_table) {
-    if (phi->p->cb_error)
-      (phi->p->cb_error)(DSERR_FMT, 1, phi->p->refcon,
-                         "No volume header in dump???");
-    return DSERR_FMT;
-  }
-  vhe = get_vhash_ent(phi, v->vnode, 1);
-  if (!vhe) return ENOMEM;
-  cp64(vhe->v_offset, v->offset);
+  if (!phi->dense_max) return no_volhdr(phi);
+  if (!find_vnode(phi, v->vnode, 1, &s)) return ENOMEM;
+  cp64(VF(s, v_offset), v->offset);
   if (v->field_mask & F_VNODE_PARENT)
-    vhe->parent = v->parent;
+    VF(s, parent) = v->parent;
   if (v->field_mask & F_VNODE_DATA) {
-    cp64(vhe->d_offset, v->d_offset);
-    cp64(vhe->d_size, v->size);
+    cp64(VF(s, d_offset), v->d_offset);
+    cp64(VF(s, d_size), v->size);
   }
   if ((v->field_mask & F_VNODE_TYPE) && v->type == vDirectory)
     phi->n_dirs++;
@@ -112,6 +330,33 @@ static afs_uint32 vnode_keep(afs_vnode *v, XFILE *X, void *refcon)
 }
 
 
+/* Same as vnode_keep, for a whole batch of vnodes at once */
+static afs_uint32 batch_keep(vnode_batch *b, XFILE *X, void *refcon)
+{
+  path_hashinfo *phi = (path_hashinfo *)refcon;
+  afs_uint32 i, mask;
+  vslot s;
+
+  if (!phi->dense_max) return no_volhdr(phi);
+  for (i = 0; i < b->count; i++) {
+    if (!find_vnode(phi, b->vnode[i], 1, &s)) return ENOMEM;
+    mask = b->field_mask[i];
+    cp64(VF(s, v_offset), b->offset[i]);
+    if (mask & F_VNODE_PARENT)
+      VF(s, parent) = b->parent[i];
+    if (mask & F_VNODE_DATA) {
+      cp64(VF(s, d_offset), b->d_offset[i]);
+      cp64(VF(s, d_size), b->size[i]);
+    }
+    if ((mask & F_VNODE_TYPE) && b->type[i] == vDirectory)
+      phi->n_dirs++;
+    else
+      phi->n_files++;
+  }
+  return 0;
+}
+
+
 static afs_uint32 vnode_stop(afs_vnode *v, XFILE *X, void *refcon)
 {
   path_hashinfo *phi = (path_hashinfo *)refcon;
@@ -124,23 +369,27 @@ static afs_uint32 vnode_stop(afs_vnode *v, XFILE *X, void *refcon)
 }
 
 
-static afs_uint32 dirent_cb(afs_vnode *v, afs_dir_entry *de,
+/* Record a directory entry.  This is a cb_dirent callback, and may be
+ * used as such (with the path_hashinfo as refcon) to build up pathname
+ * info while doing something else with the dump; see Path_Init.
+ */
+afs_uint32 Path_AddEntry(afs_vnode *v, afs_dir_entry *de,
                          XFILE *X, void *refcon)
 {
   path_hashinfo *phi = (path_hashinfo *)refcon;
-  vhash_ent *vhe;
+  vslot s;
 
-  if (!phi->hash_table) {
+  if (!phi->dense_max) {
     if (phi->p->cb_error)
-      (phi->p->cb_error)(DSERR_FMT, 1, phi->p->refcon,
+      (phi->p->cb_error)(DSERR_FMT, 1, phi->p->err_refcon,
                          "No volume header in dump???");
     return DSERR_FMT;
   }
   if (!strcmp(de->name, ".") || !strcmp(de->name, "..")) return 0;
-  vhe = get_vhash_ent(phi, de->vnode, 1);
-  if (!vhe) return ENOMEM;
-  vhe->parent = v->vnode;
-  return 0;
+  if (!find_vnode(phi, v->vnode, 1, &s)) return ENOMEM;
+  if (!find_vnode(phi, de->vnode, 1, &s)) return ENOMEM;
+  VF(s, parent) = v->vnode;
+  return set_name(phi, s, de->vnode, v->vnode, de->name);
 }
 
 
@@ -150,19 +399,19 @@ static afs_uint32 dirent_cb(afs_vnode *v, afs_dir_entry *de,
 afs_uint32 Path_PreScan(XFILE *X, path_hashinfo *phi, int full)
 {
   dump_parser my_p, *p = phi->p;
+  afs_uint32 r;
 
   memset(phi, 0, sizeof(path_hashinfo));
   phi->p = p;
+  if (r = DirCache_Init(&phi->dcache, 0)) return r;
   memset(&my_p, 0, sizeof(my_p));
   my_p.refcon       = (void *)phi;
   my_p.cb_volhdr    = volhdr_cb;
-  my_p.cb_vnode_dir = vnode_keep;
   if (full) {
-    my_p.cb_vnode_file  = vnode_keep;
-    my_p.cb_vnode_link  = vnode_keep;
-    my_p.cb_vnode_empty = vnode_keep;
-    my_p.cb_vnode_wierd = vnode_keep;
+    /* Every vnode is kept the same way, so take them in batches */
+    my_p.cb_vnode_batch = batch_keep;
   } else {
+    my_p.cb_vnode_dir   = vnode_keep;
     my_p.cb_vnode_file  = vnode_stop;
     my_p.cb_vnode_link  = vnode_stop;
     my_p.cb_vnode_empty = vnode_stop;
@@ -170,104 +419,373 @@ afs_uint32 Path_PreScan(XFILE *X, path_hashinfo *phi, int full)
   }
   my_p.err_refcon   = p->err_refcon;
   my_p.cb_error     = p->cb_error;
-  my_p.cb_dirent    = dirent_cb;
+  my_p.cb_dirent    = Path_AddEntry;
   my_p.flags        = p->flags;
   my_p.print_flags  = p->print_flags;
   my_p.repair_flags = p->repair_flags;
+  my_p.vnode_fields = F_VNODE_TYPE | F_VNODE_PARENT | F_VNODE_SIZE
+                    | F_VNODE_DATA;
 
   return ParseDumpFile(X, &my_p);
 }
 
 
-/* Free the hash table in a path_hashinfo */
+/* Start a path_hashinfo with nothing in it, for a volume with the
+ * given number of files.  Entries can then be added with Path_AddEntry,
+ * for example while streaming through a dump that can't be prescanned.
+ */
+afs_uint32 Path_Init(path_hashinfo *phi, afs_uint32 nfiles)
+{
+  dump_parser *p = phi->p;
+
+  memset(phi, 0, sizeof(path_hashinfo));
+  phi->p = p;
+  set_dense_max(phi, nfiles);
+  return DirCache_Init(&phi->dcache, 0);
+}
+
+
+/* Fill in a path_hashinfo from a dump index, instead of prescanning the
+ * dump.  The result is the same as a full prescan.
+ */
+afs_uint32 Path_FromIndex(path_hashinfo *phi, dump_index *di)
+{
+  dump_parser *p = phi->p;
+  index_vnode iv;
+  vslot s;
+  afs_uint32 i, j, vnum, r;
+  char *name;
+
+  memset(phi, 0, sizeof(path_hashinfo));
+  phi->p = p;
+  if (r = DirCache_Init(&phi->dcache, 0)) return r;
+  set_dense_max(phi, di->n_vnodes);
+
+  /* As in a prescan, a vnode's own parent field wins over the
+   * directory it was found in, so do the directory entries first.
+   */
+  for (i = 0; i < di->n_vnodes; i++) {
+    if (r = DumpIndex_Get(di, i, &iv)) return r;
+    for (j = 0; j < iv.n_entries; j++) {
+      r = DumpIndex_Entry(di, iv.first_entry + j, &name, &vnum, 0);
+      if (r) return r;
+      if (!find_vnode(phi, vnum, 1, &s)) return ENOMEM;
+      VF(s, parent) = iv.vnode;
+      if (r = set_name(phi, s, vnum, iv.vnode, name)) return r;
+    }
+  }
+  for (i = 0; i < di->n_vnodes; i++) {
+    if (r = DumpIndex_Get(di, i, &iv)) return r;
+    if (!find_vnode(phi, iv.vnode, 1, &s)) return ENOMEM;
+    cp64(VF(s, v_offset), iv.v_offset);
+    if (iv.parent) VF(s, parent) = iv.parent;
+    cp64(VF(s, d_offset), iv.d_offset);
+    cp64(VF(s, d_size), iv.d_size);
+    if (iv.type == vDirectory) phi->n_dirs++;
+    else phi->n_files++;
+  }
+  return 0;
+}
+
+
+/* Free the vnode tables in a path_hashinfo */
 void Path_FreeHashTable(path_hashinfo *phi)
 {
-  int i, size;
-  vhash_ent *vhe, *next_vhe;
-
-  if (phi->hash_table) {
-    size = (1 << phi->hash_size);
-    for (i = 0; i < size; i++)
-      for (vhe = phi->hash_table[i]; vhe; vhe = next_vhe) {
-        next_vhe = vhe->next;
-        free(vhe);
-      }
-    free(phi->hash_table);
+  free_table(&phi->tables[VT_FILES]);
+  free_table(&phi->tables[VT_DIRS]);
+  free_table(&phi->tables[VT_SPARSE]);
+  if (phi->sparse_hash) free(phi->sparse_hash);
+  if (phi->dcache) DirCache_Free(phi->dcache);
+  if (phi->names) free(phi->names);
+  if (phi->name_hash) free(phi->name_hash);
+  if (phi->paths) free(phi->paths);
+  if (phi->links) free(phi->links);
+}
+
+
+/* Look up an entry in directory dvnum, through the directory cache
+ * if there is one.  Works like DirectoryLookup.
+ */
+static afs_uint32 lookup_dir(XFILE *X, path_hashinfo *phi, afs_uint32 dvnum,
+                             vslot ds, char **name, afs_uint32 *vnode)
+{
+  afs_uint32 r;
+
+  if (phi->dcache)
+    return DirCache_Lookup(phi->dcache, X, phi->p, dvnum, &VF(ds, d_offset),
+                           get64(VF(ds, d_size)), name, vnode, 0);
+  if (r = xfseek(X, &VF(ds, d_offset))) {
+    if (phi->p->cb_error)
+      (phi->p->cb_error)(r, 1, phi->p->err_refcon,
+                         "Unable to seek to directory %d", dvnum);
+    return r;
   }
+  return DirectoryLookup(X, phi->p, get64(VF(ds, d_size)), name, vnode, 0);
 }
 
 
-/* Follow a pathname to the vnode it represents */
-afs_uint32 Path_Follow(XFILE *X, path_hashinfo *phi,
-                    char *path, vhash_ent *his_vhe)
+/* One step along a path: look up name in directory dvnum */
+static afs_uint32 follow_step(XFILE *X, path_hashinfo *phi, afs_uint32 dvnum,
+                              char *name, afs_uint32 *vnum)
 {
-  vhash_ent *vhe;
-  char *name;
-  afs_uint32 r, vnum = 1;
+  vslot s;
+  afs_uint32 r;
 
-  if (*path == '/') path++;
-  name = strtok(path, "/");
+  if (!(dvnum & 1)) {
+    if (phi->p->cb_error)
+      (phi->p->cb_error)(ENOTDIR, 1, phi->p->err_refcon,
+                         "Not a directory vnode");
+    return ENOTDIR;
+  }
+  if (!find_vnode(phi, dvnum, 0, &s)) {
+    if (phi->p->cb_error)
+      (phi->p->cb_error)(DSERR_FMT, 1, phi->p->err_refcon,
+                         "Vnode %d not found in hash table", dvnum);
+    return DSERR_FMT;
+  }
+  if (zero64(VF(s, d_offset))) {
+    if (phi->p->cb_error)
+      (phi->p->cb_error)(DSERR_FMT, 1, phi->p->err_refcon,
+                         "Directory vnode %d is incomplete", dvnum);
+    return DSERR_FMT;
+  }
+  *vnum = 0;
+  if (r = lookup_dir(X, phi, dvnum, s, &name, vnum)) return r;
+  if (!*vnum) {
+    if (phi->p->cb_error)
+      (phi->p->cb_error)(ENOENT, 1, phi->p->err_refcon,
+                         "No such vnode");
+    return ENOENT;
+  }
+  return 0;
+}
 
-  for (name = strtok(path, "/"); name; name = strtok(0, "/")) {
-    if (!(vnum & 1)) {
-      if (phi->p->cb_error)
-        (phi->p->cb_error)(ENOTDIR, 1, phi->p->err_refcon,
-                           "Not a directory vnode");
-      return ENOTDIR;
+
+/* A path to be followed, split into components.  The components are
+ * separated by nulls, so comparing two with memcmp puts them in trie
+ * order: everything under a directory sorts together, right after it.
+ */
+typedef struct {
+  char *comps;
+  int len, ncomps, index;
+} follow_req;
+
+static int cmp_follow_req(const void *a, const void *b)
+{
+  const follow_req *x = (const follow_req *)a, *y = (const follow_req *)b;
+  int r;
+
+  r = memcmp(x->comps, y->comps, x->len < y->len ? x->len : y->len);
+  if (r) return r;
+  return x->len - y->len;
+}
+
+
+/* Follow many pathnames at once.  The paths are sorted into a trie and
+ * walked depth-first, so each directory is looked up in once for all
+ * the paths that pass through it, and a directory's entries need only
+ * be read once while it stays in the directory cache.  codes[i] gets
+ * the result of following paths[i], and his_vhe[i] (if his_vhe is not
+ * null) the vnode it leads to, as for Path_Follow.  The return value
+ * is nonzero only if something other than a bad path went wrong.
+ */
+afs_uint32 Path_FollowMany(XFILE *X, path_hashinfo *phi, int n,
+                           char **paths, vhash_ent *his_vhe,
+                           afs_uint32 *codes)
+{
+  follow_req *reqs, *rq, *prev = 0;
+  afs_uint32 *stack = 0, r = 0, code = 0, vnum;
+  char *buf, *src, *dst, **comp = 0;
+  int i, j, k, total = 0, maxcomps = 0, depth = 0, fail = -1;
+  int tmp_cache = 0;
+  vslot s;
+
+  if (n <= 0) return 0;
+  for (i = 0; i < n; i++) total += strlen(paths[i]) + 1;
+  reqs = (follow_req *)malloc(n * sizeof(follow_req));
+  buf = (char *)malloc(total);
+  if (!reqs || !buf) {
+    if (reqs) free(reqs);
+    if (buf) free(buf);
+    return ENOMEM;
+  }
+
+  /* Split each path into its components, ignoring extra slashes */
+  for (dst = buf, i = 0; i < n; i++) {
+    rq = reqs + i;
+    rq->comps = dst;
+    rq->ncomps = 0;
+    rq->index = i;
+    for (src = paths[i]; *src; ) {
+      while (*src == '/') src++;
+      if (!*src) break;
+      while (*src && *src != '/') *dst++ = *src++;
+      *dst++ = 0;
+      rq->ncomps++;
+    }
+    rq->len = dst - rq->comps;
+    if (rq->ncomps > maxcomps) maxcomps = rq->ncomps;
+  }
+  qsort(reqs, n, sizeof(follow_req), cmp_follow_req);
+
+  /* stack[k] is the vnode reached after k components of the last path */
+  stack = (afs_uint32 *)malloc((maxcomps + 1) * sizeof(afs_uint32));
+  comp = (char **)malloc((maxcomps + 1) * sizeof(char *));
+  if (!stack || !comp) {
+    r = ENOMEM;
+    goto out;
+  }
+  stack[0] = 1;
+
+  /* Without a cache, a directory would be read for every lookup in it */
+  if (n > 1 && !phi->dcache) {
+    if (r = DirCache_Init(&phi->dcache, 0)) goto out;
+    tmp_cache = 1;
+  }
+
+  for (rq = reqs; rq < reqs + n; prev = rq++) {
+    /* How much of the last path does this one share? */
+    for (k = 0, src = rq->comps; k < rq->ncomps; k++, src += strlen(src) + 1)
+      comp[k] = src;
+    for (j = 0, src = prev ? prev->comps : 0;
+         prev && j < rq->ncomps && j < prev->ncomps && !strcmp(src, comp[j]);
+         j++, src += strlen(src) + 1);
+
+    if (fail >= 0 && j > fail) {
+      /* Under a component that couldn't be found; already reported */
+      codes[rq->index] = code;
+      continue;
+    }
+    if (depth > j) depth = j;
+    fail = -1;
+    code = 0;
+    for (k = depth; k < rq->ncomps; k++) {
+      if (code = follow_step(X, phi, stack[k], comp[k], &vnum)) break;
+      stack[k + 1] = vnum;
     }
-    vhe = get_vhash_ent(phi, vnum, 0);
-    if (!vhe) {
+    depth = k;
+    if (code) {
+      fail = k;
+      codes[rq->index] = code;
+      continue;
+    }
+
+    vnum = stack[depth];
+    if (!find_vnode(phi, vnum, 0, &s)) {
       if (phi->p->cb_error)
         (phi->p->cb_error)(DSERR_FMT, 1, phi->p->err_refcon,
                            "Vnode %d not found in hash table", vnum);
-      return DSERR_FMT;
+      codes[rq->index] = DSERR_FMT;
+      continue;
     }
-    if (zero64(vhe->d_offset)) {
-      if (phi->p->cb_error)
-        (phi->p->cb_error)(DSERR_FMT, 1, phi->p->err_refcon,
-                           "Directory vnode %d is incomplete", vnum);
-      return DSERR_FMT;
+    codes[rq->index] = 0;
+    if (his_vhe) {
+      vhash_ent *vhe = his_vhe + rq->index;
+
+      memset(vhe, 0, sizeof(vhash_ent));
+      vhe->vnode  = vnum;
+      vhe->parent = VF(s, parent);
+      cp64(vhe->v_offset, VF(s, v_offset));
+      cp64(vhe->d_offset, VF(s, d_offset));
+      cp64(vhe->d_size,   VF(s, d_size));
     }
-    if (r = xfseek(X, &vhe->d_offset)) {
-      if (phi->p->cb_error)
-        (phi->p->cb_error)(r, 1, phi->p->err_refcon,
-                           "Unable to seek to directory %d", vnum);
-      return r;
+  }
+
+out:
+  if (tmp_cache) {
+    DirCache_Free(phi->dcache);
+    phi->dcache = 0;
+  }
+  if (comp) free(comp);
+  if (stack) free(stack);
+  free(buf);
+  free(reqs);
+  return r;
+}
+
+
+/* Follow a pathname to the vnode it represents */
+afs_uint32 Path_Follow(XFILE *X, path_hashinfo *phi,
+                    char *path, vhash_ent *his_vhe)
+{
+  afs_uint32 r, code;
+
+  if (r = Path_FollowMany(X, phi, 1, &path, his_vhe, &code)) return r;
+  return code;
+}
+
+
+/* Return a copy of the cached path of a directory, or NULL if none */
+static char *cached_path(path_hashinfo *phi, vslot s, int fast)
+{
+  char *path = 0;
+
+  pthread_mutex_lock(&path_lock);
+  if (VF(s, path[fast])) {
+    path = (char *)malloc(strlen(phi->paths + VF(s, path[fast])) + 1);
+    if (path) strcpy(path, phi->paths + VF(s, path[fast]));
+  }
+  pthread_mutex_unlock(&path_lock);
+  return path;
+}
+
+
+/* Remember the first len bytes of path as the path of a directory */
+static void cache_path(path_hashinfo *phi, vslot s, int fast,
+                       char *path, int len)
+{
+  afs_uint32 size;
+  char *x;
+
+  pthread_mutex_lock(&path_lock);
+  if (!VF(s, path[fast])) {
+    if (!phi->paths_len) phi->paths_len = 1;   /* Offset 0 means no path */
+    for (size = phi->paths_max ? phi->paths_max : 4096;
+         phi->paths_len + len + 1 > size;
+         size *= 2);
+    if (size == phi->paths_max) x = phi->paths;
+    else if (x = (char *)realloc(phi->paths, size)) {
+      phi->paths = x;
+      phi->paths_max = size;
     }
-    vnum = 0;
-    r = DirectoryLookup(X, phi->p, get64(vhe->d_size), &name, &vnum, 0);
-    if (r) return r;
-    if (!vnum) {
-      if (phi->p->cb_error)
-        (phi->p->cb_error)(ENOENT, 1, phi->p->err_refcon,
-                           "No such vnode");
-      return ENOENT;
+    if (x) {
+      memcpy(phi->paths + phi->paths_len, path, len);
+      phi->paths[phi->paths_len + len] = 0;
+      VF(s, path[fast]) = phi->paths_len;
+      phi->paths_len += len + 1;
     }
   }
-  vhe = get_vhash_ent(phi, vnum, 0);
-  if (!vhe) {
-    if (phi->p->cb_error)
-      (phi->p->cb_error)(DSERR_FMT, 1, phi->p->err_refcon,
-                         "Vnode %d not found in hash table", vnum);
-    return DSERR_FMT;
-  }
-  if (his_vhe) *his_vhe = *vhe;
-  return 0;
+  pthread_mutex_unlock(&path_lock);
 }
 
 
+typedef struct {
+  afs_uint32 vnode;          /* Vnode this component names */
+  vslot s;                   /* Where that vnode is kept */
+  char *name;                /* Its name, or NULL for a fast path */
+  int owned;                 /* Whether name must be freed */
+} path_comp;
+
+
+/* Construct the pathname of a vnode, by walking up the tree until we
+ * reach the root or a directory whose path we already know.  Paths of
+ * directories along the way are remembered, so a file's path usually
+ * costs one lookup in its parent plus a copy of the parent's path.
+ * With fast set, vnode numbers are used in place of names.
+ */
 afs_uint32 Path_Build(XFILE *X, path_hashinfo *phi, afs_uint32 vnode,
                    char **his_path, int fast)
 {
-  vhash_ent *vhe;
-  char *name, *path = 0, fastbuf[12];
-  char *x, *y;
-  afs_uint32 parent, r;
-  int nl, pl = 0;
+  vslot s, ps;
+  path_comp *comps = 0, *c;
+  char *name, *known, *prefix = 0, *path, fastbuf[12];
+  afs_uint32 parent, r = 0;
+  int ncomps = 0, maxcomps = 0, pl, i;
 
+  fast = !!fast;
   if (vnode == 1) {
     *his_path = (char *)malloc(2);
-    if (!his_path) {
+    if (!*his_path) {
       if (phi->p->cb_error)
         (phi->p->cb_error)(ENOMEM, 1, phi->p->err_refcon,
                            "No memory for pathname of vnode 1");
@@ -278,98 +796,207 @@ afs_uint32 Path_Build(XFILE *X, path_hashinfo *phi, afs_uint32 vnode,
   }
 
   *his_path = 0;
-  vhe = get_vhash_ent(phi, vnode, 0);
-  if (!vhe) {
+  if (!find_vnode(phi, vnode, 0, &s)) {
     if (phi->p->cb_error)
       (phi->p->cb_error)(DSERR_FMT, 1, phi->p->err_refcon,
                          "Vnode %d not found in hash table", vnode);
     return DSERR_FMT;
   }
   while (vnode != 1) {
+    /* Stop at a directory whose path we know */
+    if ((vnode & 1) && (prefix = cached_path(phi, s, fast))) break;
+
     /* Find the parent */
-    if (!vhe->parent) {
+    if (!VF(s, parent)) {
       if (phi->p->cb_error)
         (phi->p->cb_error)(DSERR_FMT, 1, phi->p->err_refcon,
                            "Vnode %d has no parent?", vnode);
-      if (path) free(path);
-      return DSERR_FMT;
+      r = DSERR_FMT;
+      goto out;
     }
-    parent = vhe->parent;
-    vhe = get_vhash_ent(phi, parent, 0);
+    parent = VF(s, parent);
+    known = (VF(s, name) && VF(s, name_dir) == parent)
+          ? phi->names + VF(s, name) : 0;
     if (phi->p->print_flags & DSPRINT_DEBUG)
       fprintf(stderr, "Searching for vnode %d in parent %d\n", vnode, parent);
-    if (!vhe) {
+    if (!find_vnode(phi, parent, 0, &ps)) {
       if (phi->p->cb_error)
         (phi->p->cb_error)(DSERR_FMT, 1, phi->p->err_refcon,
                            "Vnode %d not found in hash table", parent);
-      if (path) free(path);
-      return DSERR_FMT;
+      r = DSERR_FMT;
+      goto out;
     }
 
-    if (fast) {
-      /* Make up a path component from the vnode number */
-      sprintf(fastbuf, "%d", vnode);
-      name = fastbuf;
-    } else {
+    name = known;
+    if (!fast && !known) {
       /* Do a reverse-lookup in the parent directory */
-      if (zero64(vhe->d_offset)) {
+      if (zero64(VF(ps, d_offset))) {
         if (phi->p->cb_error)
           (phi->p->cb_error)(DSERR_FMT, 1, phi->p->err_refcon,
                              "Directory vnode %d is incomplete", parent);
-        if (path) free(path);
-        return DSERR_FMT;
+        r = DSERR_FMT;
+        goto out;
       }
-      if (r = xfseek(X, &vhe->d_offset)) {
-        if (phi->p->cb_error)
-          (phi->p->cb_error)(errno, 1, phi->p->err_refcon,
-                             "Unable to seek to directory %d", parent);
-        if (path) free(path);
-        return r;
-      }
-
-      name = 0;
-      r = DirectoryLookup(X, phi->p, get64(vhe->d_size), &name, &vnode, 0);
-      if (r) return r;
+      if (r = lookup_dir(X, phi, parent, ps, &name, &vnode)) goto out;
       if (!name) {
         if (phi->p->cb_error)
           (phi->p->cb_error)(DSERR_FMT, 1, phi->p->err_refcon,
                              "No entry for vnode %d in directory %d",
                              vnode, parent);
-        if (path) free(path);
-        return ENOENT;
+        r = ENOENT;
+        goto out;
       }
     }
 
-    nl = strlen(name);
-    if (path) {
-      path = (char *)realloc(path, nl + pl + 2);
-      if (!path) {
-        if (phi->p->cb_error)
-          (phi->p->cb_error)(ENOMEM, 1, phi->p->err_refcon,
-                             "No memory for pathname of vnode 1");
-        return ENOMEM;
-      }
-      x = path + pl;
-      y = x + nl + 1;
-      while (x >= path) *y-- = *x--;
-      path[0] = '/';
-      for (x = name, y = path + 1; *x;) *y++ = *x++;
-      pl += nl + 1;
-    } else {
-      path = (char *)malloc(nl + 2);
-      if (!path) {
-        if (phi->p->cb_error)
-          (phi->p->cb_error)(ENOMEM, 1, phi->p->err_refcon,
-                             "No memory for pathname of vnode 1");
-        return ENOMEM;
+    if (ncomps == maxcomps) {
+      maxcomps = maxcomps ? maxcomps * 2 : 16;
+      c = (path_comp *)realloc(comps, maxcomps * sizeof(path_comp));
+      if (!c) {
+        if (!fast && !known) free(name);
+        r = ENOMEM;
+        break;
       }
-      path[0] = '/';
-      strcpy(path + 1, name);
-      pl = nl + 1;
+      comps = c;
     }
-    if (!fast) free(name);
+    comps[ncomps].vnode = vnode;
+    comps[ncomps].s     = s;
+    comps[ncomps].name  = fast ? 0 : name;
+    comps[ncomps].owned = !fast && !known;
+    ncomps++;
     vnode = parent;
+    s = ps;
+  }
+
+  /* Put it together, from the top down */
+  pl = prefix ? strlen(prefix) : 0;
+  for (i = 0; !r && i < ncomps; i++) {
+    if (comps[i].name) pl += strlen(comps[i].name) + 1;
+    else pl += sprintf(fastbuf, "%d", comps[i].vnode) + 1;
+  }
+  if (r || !(path = (char *)malloc(pl + 1))) {
+    if (phi->p->cb_error)
+      (phi->p->cb_error)(ENOMEM, 1, phi->p->err_refcon,
+                         "No memory for pathname of vnode %d",
+                         ncomps ? comps[0].vnode : vnode);
+    r = ENOMEM;
+    goto out;
+  }
+  pl = prefix ? strlen(strcpy(path, prefix)) : 0;
+  for (i = ncomps - 1; i >= 0; i--) {
+    if (comps[i].name) pl += sprintf(path + pl, "/%s", comps[i].name);
+    else pl += sprintf(path + pl, "/%d", comps[i].vnode);
+    if (comps[i].vnode & 1) cache_path(phi, comps[i].s, fast, path, pl);
   }
   *his_path = path;
+
+out:
+  for (i = 0; i < ncomps; i++)
+    if (comps[i].owned) free(comps[i].name);
+  if (comps) free(comps);
+  if (prefix) free(prefix);
+  return r;
+}
+
+
+static int cmp_links(const void *a, const void *b)
+{
+  const path_link *x = (const path_link *)a, *y = (const path_link *)b;
+
+  if (x->vnode != y->vnode) return (x->vnode < y->vnode) ? -1 : 1;
+  if (x->dir != y->dir) return (x->dir < y->dir) ? -1 : 1;
+  return (x->name < y->name) ? -1 : (x->name > y->name);
+}
+
+
+/* Add the path of vnode's entry in directory dvnum to a list of paths,
+ * unless it is already there.
+ */
+static afs_uint32 add_link_path(XFILE *X, path_hashinfo *phi,
+                                afs_uint32 vnode, afs_uint32 dvnum,
+                                char *name, int fast, char ***paths, int *n)
+{
+  char *dpath, *path, **x, fastbuf[12];
+  afs_uint32 r;
+  int i;
+
+  if (r = Path_Build(X, phi, dvnum, &dpath, fast)) return r;
+  if (fast) {
+    sprintf(fastbuf, "%d", vnode);
+    name = fastbuf;
+  }
+  if (!(path = (char *)malloc(strlen(dpath) + strlen(name) + 2))) {
+    free(dpath);
+    return ENOMEM;
+  }
+  sprintf(path, "%s/%s", strcmp(dpath, "/") ? dpath : "", name);
+  free(dpath);
+
+  for (i = 0; i < *n; i++)
+    if (!strcmp((*paths)[i], path)) break;
+  if (i < *n) {
+    free(path);
+    return 0;
+  }
+  if (!(x = (char **)realloc(*paths, (*n + 1) * sizeof(char *)))) {
+    free(path);
+    return ENOMEM;
+  }
+  *paths = x;
+  (*paths)[(*n)++] = path;
+  return 0;
+}
+
+
+/* Build the paths of every name a file has.  *his_paths gets an array
+ * of *count paths, the first being the one Path_Build gives; the array
+ * and each path in it must be freed.  With fast set, vnode numbers are
+ * used in place of names, as with Path_Build.
+ */
+afs_uint32 Path_BuildLinks(XFILE *X, path_hashinfo *phi, afs_uint32 vnode,
+                           char ***his_paths, int *count, int fast)
+{
+  char **paths;
+  afs_uint32 lo, hi, mid, r;
+  path_link *l;
+  vslot s;
+  int n = 1;
+
+  *his_paths = 0;
+  *count = 0;
+  if (!(paths = (char **)malloc(sizeof(char *)))) return ENOMEM;
+  if (r = Path_Build(X, phi, vnode, &paths[0], fast)) {
+    free(paths);
+    return r;
+  }
+
+  if (find_vnode(phi, vnode, 0, &s) && VF(s, name))
+    r = add_link_path(X, phi, vnode, VF(s, name_dir),
+                      phi->names + VF(s, name), fast, &paths, &n);
+
+  /* Other names are kept in a list, sorted when first needed */
+  pthread_mutex_lock(&path_lock);
+  if (!phi->links_sorted) {
+    qsort(phi->links, phi->n_links, sizeof(path_link), cmp_links);
+    phi->links_sorted = 1;
+  }
+  pthread_mutex_unlock(&path_lock);
+  for (lo = 0, hi = phi->n_links; lo < hi; ) {
+    mid = (lo + hi) / 2;
+    if (phi->links[mid].vnode < vnode) lo = mid + 1;
+    else hi = mid;
+  }
+  for (l = phi->links + lo; !r && l < phi->links + phi->n_links; l++) {
+    if (l->vnode != vnode) break;
+    r = add_link_path(X, phi, vnode, l->dir, phi->names + l->name, fast,
+                      &paths, &n);
+  }
+
+  if (r) {
+    while (n--) free(paths[n]);
+    free(paths);
+    return r;
+  }
+  *his_paths = paths;
+  *count = n;
   return 0;
 }
@@ -0,0 +1,480 @@
+/*
+ * CMUCS AFStools
+ * dumpscan - routines for scanning and manipulating AFS volume dumps
+ *
+ * Copyright (c) 1998, 2001 Carnegie Mellon University
+ * All Rights Reserved.
+ * 
+ * Permission to use, copy, modify and distribute this software and its
+ * documentation is hereby granted, provided that both the copyright
+ * notice and this permission notice appear in all copies of the
+ * software, derivative works or modified versions, and any portions
+ * thereof, and that both notices appear in supporting documentation.
+ *
+ * CARNEGIE MELLON ALLOWS FREE USE OF THIS SOFTWARE IN ITS "AS IS"
+ * CONDITION.  CARNEGIE MELLON DISCLAIMS ANY LIABILITY OF ANY KIND FOR
+ * ANY DAMAGES WHATSOEVER RESULTING FROM THE USE OF THIS SOFTWARE.
+ *
+ * Carnegie Mellon requests users of this software to return to
+ *
+ *  Software Distribution Coordinator  or  Software_Distribution@CS.CMU.EDU
+ *  School of Computer Science
+ *  Carnegie Mellon University
+ *  Pittsburgh PA 15213-3890
+ *
+ * any improvements or extensions that they make and grant Carnegie Mellon
+ * the rights to redistribute these changes.
+ */
+
+/* pathsel.c - Select vnodes by path, pattern, or number
+ *
+ * Checking each vnode's path against every name a user asked for costs
+ * vnodes times names, which hurts when restoring thousands of files.  A
+ * path_selector compiles the request once instead: paths go into a trie
+ * of components, vnode numbers into a hash set, and patterns (shell
+ * globs or POSIX extended regular expressions) into include and exclude
+ * lists.  The selector also remembers directories under which nothing
+ * can be selected, so callers can skip their contents without building
+ * their paths at all.
+ *
+ * A vnode is selected if its path, or the path of a directory above it,
+ * is one that was requested or matches an include pattern, and neither
+ * it nor any directory above it matches an exclude pattern.  Directories
+ * above a requested path are selected too, so that there is somewhere to
+ * put it.  A directory that only might lead to a pattern match is not
+ * selected, but reported as such, so that callers can wait to make it
+ * until something is put in it.  Globs are matched a component at a
+ * time, so '*' never matches '/'; one that starts with '/' must match
+ * from the root, and any other can match starting at any directory.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fnmatch.h>
+#include <regex.h>
+
+#include "dumpscan.h"
+
+#define MAXCOMPS 64          /* Path components handled without malloc */
+
+typedef struct {
+  afs_uint32 *slots;         /* Open hash; 0 is an empty slot */
+  afs_uint32 size, count;
+} vnode_set;
+
+typedef struct {
+  afs_uint32 parent;         /* Index of parent node */
+  afs_uint32 name;           /* Offset into names */
+  int selected;              /* A requested path ends here */
+} trie_node;
+
+typedef struct sel_pattern {
+  struct sel_pattern *next;
+  int flags;                 /* PSEL_* */
+  int anchored;              /* Glob starts at the root */
+  int ncomps;                /* Glob components */
+  char **comps;
+  char *text;
+  regex_t re;
+} sel_pattern;
+
+struct path_selector {
+  trie_node *nodes;          /* Node 0 is the root */
+  afs_uint32 n_nodes, max_nodes;
+  afs_uint32 *children;      /* Open hash on (parent, name); 0 is empty */
+  afs_uint32 children_size;
+  char *names;
+  afs_uint32 names_len, names_max;
+  vnode_set vnodes;          /* Selected by number */
+  vnode_set pruned;          /* Directories with nothing selectable below */
+  sel_pattern *includes, *excludes;
+  int n_paths;               /* Requested paths */
+  int open_includes;         /* Includes that might match below anything */
+};
+
+
+static afs_uint32 hash_vnode(afs_uint32 vnode)
+{
+  return vnode * 2654435761U;
+}
+
+
+static int set_find(vnode_set *vs, afs_uint32 vnode)
+{
+  afs_uint32 h, x;
+
+  if (!vs->size) return 0;
+  for (h = hash_vnode(vnode) & (vs->size - 1); x = vs->slots[h];
+       h = (h + 1) & (vs->size - 1))
+    if (x == vnode) return 1;
+  return 0;
+}
+
+
+static afs_uint32 set_add(vnode_set *vs, afs_uint32 vnode)
+{
+  afs_uint32 *old = vs->slots, oldsize = vs->size, h, i;
+
+  if (!vnode || set_find(vs, vnode)) return 0;
+  if (2 * (vs->count + 1) > vs->size) {
+    vs->size = vs->size ? vs->size * 2 : 256;
+    if (!(vs->slots = (afs_uint32 *)calloc(vs->size, sizeof(afs_uint32)))) {
+      vs->slots = old;
+      vs->size = oldsize;
+      return ENOMEM;
+    }
+    for (i = 0; i < oldsize; i++) {
+      if (!old[i]) continue;
+      for (h = hash_vnode(old[i]) & (vs->size - 1); vs->slots[h];
+           h = (h + 1) & (vs->size - 1));
+      vs->slots[h] = old[i];
+    }
+    if (old) free(old);
+  }
+  for (h = hash_vnode(vnode) & (vs->size - 1); vs->slots[h];
+       h = (h + 1) & (vs->size - 1));
+  vs->slots[h] = vnode;
+  vs->count++;
+  return 0;
+}
+
+
+static afs_uint32 hash_child(afs_uint32 parent, char *name, int len)
+{
+  afs_uint32 h = hash_vnode(parent + 1);
+
+  while (len--) h = h * 31 + (unsigned char)*name++;
+  return h;
+}
+
+
+/* Find the trie node for a component under parent, making it if asked.
+ * Returns its index, or 0 if there is none (or no memory for it).
+ */
+static afs_uint32 trie_child(path_selector *sel, afs_uint32 parent,
+                             char *name, int len, int make)
+{
+  afs_uint32 h, x, size, i, *table;
+  trie_node *n;
+  char *s;
+
+  for (h = hash_child(parent, name, len) & (sel->children_size - 1);
+       sel->children_size && (x = sel->children[h]);
+       h = (h + 1) & (sel->children_size - 1)) {
+    s = sel->names + sel->nodes[x].name;
+    if (sel->nodes[x].parent == parent && !strncmp(s, name, len) && !s[len])
+      return x;
+  }
+  if (!make) return 0;
+
+  if (sel->n_nodes == sel->max_nodes) {
+    sel->max_nodes *= 2;
+    n = (trie_node *)realloc(sel->nodes, sel->max_nodes * sizeof(trie_node));
+    if (!n) return 0;
+    sel->nodes = n;
+  }
+  if (sel->names_len + len + 1 > sel->names_max) {
+    while (sel->names_len + len + 1 > sel->names_max) sel->names_max *= 2;
+    if (!(s = (char *)realloc(sel->names, sel->names_max))) return 0;
+    sel->names = s;
+  }
+  if (2 * sel->n_nodes > sel->children_size) {
+    size = sel->children_size * 2;
+    if (!(table = (afs_uint32 *)calloc(size, sizeof(afs_uint32)))) return 0;
+    for (i = 1; i < sel->n_nodes; i++) {
+      s = sel->names + sel->nodes[i].name;
+      for (h = hash_child(sel->nodes[i].parent, s, strlen(s)) & (size - 1);
+           table[h]; h = (h + 1) & (size - 1));
+      table[h] = i;
+    }
+    free(sel->children);
+    sel->children = table;
+    sel->children_size = size;
+  }
+
+  x = sel->n_nodes++;
+  sel->nodes[x].parent = parent;
+  sel->nodes[x].name = sel->names_len;
+  sel->nodes[x].selected = 0;
+  memcpy(sel->names + sel->names_len, name, len);
+  sel->names[sel->names_len + len] = 0;
+  sel->names_len += len + 1;
+  for (h = hash_child(parent, name, len) & (sel->children_size - 1);
+       sel->children[h]; h = (h + 1) & (sel->children_size - 1));
+  sel->children[h] = x;
+  return x;
+}
+
+
+afs_uint32 PathSel_Init(path_selector **selp)
+{
+  path_selector *sel;
+
+  if (!(sel = (path_selector *)calloc(1, sizeof(path_selector))))
+    return ENOMEM;
+  sel->max_nodes = 64;
+  sel->names_max = 1024;
+  sel->children_size = 256;
+  sel->nodes = (trie_node *)malloc(sel->max_nodes * sizeof(trie_node));
+  sel->names = (char *)malloc(sel->names_max);
+  sel->children = (afs_uint32 *)calloc(sel->children_size, sizeof(afs_uint32));
+  if (!sel->nodes || !sel->names || !sel->children) {
+    PathSel_Free(sel);
+    return ENOMEM;
+  }
+  sel->n_nodes = 1;
+  sel->nodes[0].parent = 0;
+  sel->nodes[0].name = 0;
+  sel->nodes[0].selected = 0;
+  sel->names[0] = 0;
+  sel->names_len = 1;
+  *selp = sel;
+  return 0;
+}
+
+
+/* Select a path and everything under it */
+afs_uint32 PathSel_AddPath(path_selector *sel, char *path)
+{
+  afs_uint32 node = 0;
+  char *x;
+
+  for (;;) {
+    while (*path == '/') path++;
+    if (!*path) break;
+    for (x = path; *x && *x != '/'; x++);
+    if (!(node = trie_child(sel, node, path, x - path, 1))) return ENOMEM;
+    path = x;
+  }
+  sel->nodes[node].selected = 1;
+  sel->n_paths++;
+  return 0;
+}
+
+
+/* Select a vnode by number */
+afs_uint32 PathSel_AddVnode(path_selector *sel, afs_uint32 vnode)
+{
+  return set_add(&sel->vnodes, vnode);
+}
+
+
+/* Add an include or exclude pattern.  Returns EINVAL if it is bad. */
+afs_uint32 PathSel_AddPattern(path_selector *sel, char *pattern, int flags)
+{
+  sel_pattern *p;
+  char *x;
+  int i;
+
+  if (!(p = (sel_pattern *)calloc(1, sizeof(sel_pattern)))) return ENOMEM;
+  p->flags = flags;
+  if (!(p->text = (char *)malloc(strlen(pattern) + 1))) {
+    free(p);
+    return ENOMEM;
+  }
+  strcpy(p->text, pattern);
+
+  if (flags & PSEL_REGEX) {
+    if (regcomp(&p->re, pattern, REG_EXTENDED | REG_NOSUB)) {
+      free(p->text);
+      free(p);
+      return EINVAL;
+    }
+  } else {
+    /* Split it into components, in place */
+    p->anchored = (*pattern == '/');
+    for (x = p->text; *x; x++) if (*x == '/') p->ncomps++;
+    if (!(p->comps = (char **)malloc((p->ncomps + 1) * sizeof(char *)))) {
+      free(p->text);
+      free(p);
+      return ENOMEM;
+    }
+    for (i = 0, x = p->text; *x; ) {
+      while (*x == '/') *x++ = 0;
+      if (!*x) break;
+      p->comps[i++] = x;
+      while (*x && *x != '/') x++;
+    }
+    p->ncomps = i;
+  }
+
+  if (flags & PSEL_EXCLUDE) {
+    p->next = sel->excludes;
+    sel->excludes = p;
+  } else {
+    p->next = sel->includes;
+    sel->includes = p;
+    if ((flags & PSEL_REGEX) || !p->anchored) sel->open_includes++;
+  }
+  return 0;
+}
+
+
+/* Match a glob against a path's components.  Returns 1 if it matches
+ * the path or a directory above it.  If it doesn't, *lead is set if it
+ * might match something below the path.
+ */
+static int match_glob(sel_pattern *p, char **comps, int ncomps, int *lead)
+{
+  int start, i;
+
+  if (!p->ncomps) return 1;
+  for (start = 0; start < ncomps; start++) {
+    for (i = 0; i < p->ncomps && start + i < ncomps; i++)
+      if (fnmatch(p->comps[i], comps[start + i], 0)) break;
+    if (i == p->ncomps) return 1;
+    if (start + i == ncomps) *lead = 1;
+    if (p->anchored) break;
+  }
+  return 0;
+}
+
+
+/* Match a regex against a path and the directories above it */
+static int match_regex(sel_pattern *p, char *path, char **comps, int ncomps)
+{
+  int i, r;
+
+  for (i = 1; i < ncomps; i++) {
+    comps[i][-1] = 0;
+    r = regexec(&p->re, path, 0, 0, 0);
+    comps[i][-1] = '/';
+    if (!r) return 1;
+  }
+  return !regexec(&p->re, path, 0, 0, 0);
+}
+
+
+/* Switch a path between "/a/b" form and separate components */
+static void split_comps(char **comps, int ncomps, int sep)
+{
+  int i;
+
+  for (i = 1; i < ncomps; i++) comps[i][-1] = sep;
+}
+
+
+static int match_pattern(sel_pattern *p, char *path, char **comps,
+                         int ncomps, int *lead)
+{
+  int r;
+
+  if (p->flags & PSEL_REGEX) return match_regex(p, path, comps, ncomps);
+  split_comps(comps, ncomps, 0);
+  r = match_glob(p, comps, ncomps, lead);
+  split_comps(comps, ncomps, '/');
+  return r;
+}
+
+
+/* Should a vnode be used?  Returns 0 if not, 2 if it was selected by
+ * number, 1 if it was selected by its path (which may be null if the
+ * caller doesn't have it), or 3 for a directory that isn't selected but
+ * might have something selected below it.  A directory that can't is
+ * remembered, for PathSel_Skip.
+ */
+int PathSel_Match(path_selector *sel, afs_uint32 vnode, char *path)
+{
+  char *buf, *x, *cbuf[MAXCOMPS], **comps, sbuf[1024];
+  int ncomps = 0, l, use = 0, lead = 0, i;
+  afs_uint32 node, child;
+  sel_pattern *p;
+
+  if (set_find(&sel->vnodes, vnode)) return 2;
+  if (!path)
+    return !sel->n_paths && !sel->includes && !sel->vnodes.count;
+  if (!strcmp(path, "/")) return 1;
+
+  /* Copy the path as "/a/b", and find its components */
+  l = strlen(path) + 1;
+  buf = (l < (int)sizeof(sbuf)) ? sbuf : (char *)malloc(l + 1);
+  comps = (l / 2 + 1 <= MAXCOMPS) ? cbuf
+        : (char **)malloc((l / 2 + 1) * sizeof(char *));
+  if (!buf || !comps) {
+    if (buf && buf != sbuf) free(buf);
+    return 1;
+  }
+  for (x = buf; *path; ) {
+    while (*path == '/') path++;
+    if (!*path) break;
+    *x++ = '/';
+    comps[ncomps++] = x;
+    while (*path && *path != '/') *x++ = *path++;
+  }
+  *x = 0;
+
+  /* Excluded? */
+  for (p = sel->excludes; p; p = p->next)
+    if (match_pattern(p, buf, comps, ncomps, &lead)) goto out;
+
+  if (!sel->n_paths && !sel->includes && !sel->vnodes.count) {
+    use = 1;
+    goto out;
+  }
+
+  /* Under a requested path, or above one? */
+  split_comps(comps, ncomps, 0);
+  node = 0;
+  for (i = 0; i < ncomps && !sel->nodes[node].selected; i++) {
+    if (!(child = trie_child(sel, node, comps[i], strlen(comps[i]), 0)))
+      break;
+    node = child;
+  }
+  split_comps(comps, ncomps, '/');
+  if (sel->nodes[node].selected || i == ncomps) {
+    use = 1;
+    goto out;
+  }
+
+  /* Matched by a pattern, or might lead to a match? */
+  lead = 0;
+  for (p = sel->includes; p; p = p->next)
+    if (use = match_pattern(p, buf, comps, ncomps, &lead)) goto out;
+  if ((vnode & 1) && (lead || sel->open_includes)) use = 3;
+
+out:
+  if ((vnode & 1) && !use) set_add(&sel->pruned, vnode);
+  if (buf != sbuf) free(buf);
+  if (comps != cbuf) free(comps);
+  return use;
+}
+
+
+/* Can a vnode be passed over without building its path?  True if its
+ * directory (if known) was not selected and it wasn't selected by number.
+ */
+int PathSel_Skip(path_selector *sel, afs_uint32 vnode, afs_uint32 parent)
+{
+  if (!parent || !set_find(&sel->pruned, parent)) return 0;
+  if (set_find(&sel->vnodes, vnode)) return 0;
+  if (vnode & 1) set_add(&sel->pruned, vnode);
+  return 1;
+}
+
+
+void PathSel_Free(path_selector *sel)
+{
+  sel_pattern *p;
+
+  while (p = sel->includes) {
+    sel->includes = p->next;
+    if (p->flags & PSEL_REGEX) regfree(&p->re);
+    if (p->comps) free(p->comps);
+    free(p->text);
+    free(p);
+  }
+  while (p = sel->excludes) {
+    sel->excludes = p->next;
+    if (p->flags & PSEL_REGEX) regfree(&p->re);
+    if (p->comps) free(p->comps);
+    free(p->text);
+    free(p);
+  }
+  if (sel->vnodes.slots) free(sel->vnodes.slots);
+  if (sel->pruned.slots) free(sel->pruned.slots);
+  if (sel->children) free(sel->children);
+  if (sel->names) free(sel->names);
+  if (sel->nodes) free(sel->nodes);
+  free(sel);
+}
@@ -68,7 +68,7 @@ afs_uint32 ReadInt32(XFILE *X, afs_uint32 *val)
  */
 afs_uint32 ReadString(XFILE *X, unsigned char **val)
 {
-  static unsigned char buf[BUFSIZE];
+  unsigned char buf[BUFSIZE];
   unsigned char *result = 0;
   afs_uint32 r;
   int i, l = 0;
@@ -0,0 +1,228 @@
+/*
+ * CMUCS AFStools
+ * dumpscan - routines for scanning and manipulating AFS volume dumps
+ *
+ * Copyright (c) 1998, 2001 Carnegie Mellon University
+ * All Rights Reserved.
+ * 
+ * Permission to use, copy, modify and distribute this software and its
+ * documentation is hereby granted, provided that both the copyright
+ * notice and this permission notice appear in all copies of the
+ * software, derivative works or modified versions, and any portions
+ * thereof, and that both notices appear in supporting documentation.
+ *
+ * CARNEGIE MELLON ALLOWS FREE USE OF THIS SOFTWARE IN ITS "AS IS"
+ * CONDITION.  CARNEGIE MELLON DISCLAIMS ANY LIABILITY OF ANY KIND FOR
+ * ANY DAMAGES WHATSOEVER RESULTING FROM THE USE OF THIS SOFTWARE.
+ *
+ * Carnegie Mellon requests users of this software to return to
+ *
+ *  Software Distribution Coordinator  or  Software_Distribution@CS.CMU.EDU
+ *  School of Computer Science
+ *  Carnegie Mellon University
+ *  Pittsburgh PA 15213-3890
+ *
+ * any improvements or extensions that they make and grant Carnegie Mellon
+ * the rights to redistribute these changes.
+ */
+
+/* tarfile.c - Write volume contents as a POSIX (pax) tar stream */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "dumpscan.h"
+
+#define TARBLOCK 512
+
+/* Offsets of ustar header fields */
+#define TH_NAME       0
+#define TH_MODE     100
+#define TH_UID      108
+#define TH_GID      116
+#define TH_SIZE     124
+#define TH_MTIME    136
+#define TH_CHKSUM   148
+#define TH_TYPE     156
+#define TH_LINKNAME 157
+#define TH_MAGIC    257
+#define TH_PREFIX   345
+
+static char zeros[TARBLOCK];
+
+
+/* Store a number in octal, NUL-terminated.
+ * Returns 0 if it doesn't fit, so it must go in a pax header instead.
+ */
+static int put_octal(char *field, int width, afs_uint32 value)
+{
+  int i;
+
+  field[--width] = 0;
+  for (i = width - 1; i >= 0; i--, value >>= 3)
+    field[i] = '0' + (value & 7);
+  return !value;
+}
+
+
+/* Add a "len key=value\n" record to a pax extended header */
+static afs_uint32 pax_add(char **buf, int *len, char *key, char *value)
+{
+  char *x, tmp[16];
+  int n, digits, rlen;
+
+  /* The length includes its own digits */
+  n = strlen(key) + strlen(value) + 3;
+  for (digits = 1, rlen = n + 1; sprintf(tmp, "%d", rlen) != digits; )
+    rlen = n + (digits = strlen(tmp));
+
+  if (!(x = (char *)realloc(*buf, *len + rlen + 1))) return ENOMEM;
+  *buf = x;
+  sprintf(x + *len, "%d %s=%s\n", rlen, key, value);
+  *len += rlen;
+  return 0;
+}
+
+
+static void finish_header(char *hdr)
+{
+  afs_uint32 sum = 0;
+  int i;
+
+  memcpy(hdr + TH_MAGIC, "ustar\00000", 8);
+  memset(hdr + TH_CHKSUM, ' ', 8);
+  for (i = 0; i < TARBLOCK; i++) sum += (unsigned char)hdr[i];
+  put_octal(hdr + TH_CHKSUM, 7, sum);
+}
+
+
+/* Put a name in the name (and maybe prefix) field of a header.
+ * Returns 0 if it doesn't fit.
+ */
+static int put_name(char *hdr, char *name)
+{
+  int len = strlen(name);
+  char *x;
+
+  if (len <= 100) {
+    memcpy(hdr + TH_NAME, name, len);
+    return 1;
+  }
+
+  /* Split at a slash, with up to 155 bytes before it and 100 after */
+  for (x = name + len - 101; x = strchr(x, '/'); x++) {
+    if (x - name > 155) break;
+    if (x == name || !x[1]) continue;
+    memcpy(hdr + TH_PREFIX, name, x - name);
+    memcpy(hdr + TH_NAME, x + 1, len - (x - name) - 1);
+    return 1;
+  }
+  memcpy(hdr + TH_NAME, name, 100);
+  return 0;
+}
+
+
+/* Write a tar header for a vnode.  path is where it goes, relative to
+ * the top of the archive; directories get a trailing slash added.  For
+ * symlinks, linktarget is the link's contents.  For files, linktarget
+ * makes this a hard link to that path, which must already be in the
+ * archive; no data follows.  Anything that doesn't fit in a ustar
+ * header goes in a pax extended header before it.
+ */
+afs_uint32 Tar_Header(XFILE *X, afs_vnode *v, char *path, char *linktarget)
+{
+  char hdr[TARBLOCK], num[24], *name, *pax = 0;
+  afs_uint32 mode, r = 0;
+  int len, paxlen = 0;
+
+  len = strlen(path);
+  if (!(name = (char *)malloc(len + 2))) return ENOMEM;
+  strcpy(name, path);
+  if (v->type == vDirectory && (!len || path[len - 1] != '/'))
+    strcpy(name + len, "/");
+
+  memset(hdr, 0, sizeof(hdr));
+  if (!put_name(hdr, name)) r = pax_add(&pax, &paxlen, "path", name);
+
+  if (v->field_mask & F_VNODE_MODE) mode = v->mode & 07777;
+  else mode = (v->type == vFile) ? 0644 : 0755;
+  put_octal(hdr + TH_MODE, 8, mode);
+  if (!put_octal(hdr + TH_UID, 8, v->owner) && !r) {
+    sprintf(num, "%lu", (unsigned long)v->owner);
+    r = pax_add(&pax, &paxlen, "uid", num);
+  }
+  if (!put_octal(hdr + TH_GID, 8, v->group) && !r) {
+    sprintf(num, "%lu", (unsigned long)v->group);
+    r = pax_add(&pax, &paxlen, "gid", num);
+  }
+  put_octal(hdr + TH_MTIME, 12, v->client_date);
+
+  switch (v->type) {
+    case vFile:
+      hdr[TH_TYPE] = linktarget ? '1' : '0';
+      if (linktarget)
+        put_octal(hdr + TH_SIZE, 12, 0);
+      else if (hi64(v->size) && !r)
+        r = pax_add(&pax, &paxlen, "size", decimate_int64(&v->size, num));
+      else
+        put_octal(hdr + TH_SIZE, 12, lo64(v->size));
+      break;
+
+    case vDirectory:
+      hdr[TH_TYPE] = '5';
+      put_octal(hdr + TH_SIZE, 12, 0);
+      break;
+
+    case vSymlink:
+      hdr[TH_TYPE] = '2';
+      put_octal(hdr + TH_SIZE, 12, 0);
+      break;
+  }
+  if (linktarget && v->type != vDirectory) {
+    len = strlen(linktarget);
+    if (len <= 100) memcpy(hdr + TH_LINKNAME, linktarget, len);
+    else if (!r) r = pax_add(&pax, &paxlen, "linkpath", linktarget);
+  }
+  finish_header(hdr);
+
+  if (!r && pax) {
+    char phdr[TARBLOCK];
+
+    memset(phdr, 0, sizeof(phdr));
+    strcpy(phdr + TH_NAME, "././@PaxHeader");
+    put_octal(phdr + TH_MODE, 8, 0644);
+    put_octal(phdr + TH_UID, 8, 0);
+    put_octal(phdr + TH_GID, 8, 0);
+    put_octal(phdr + TH_SIZE, 12, paxlen);
+    put_octal(phdr + TH_MTIME, 12, v->client_date);
+    phdr[TH_TYPE] = 'x';
+    finish_header(phdr);
+    if (!(r = xfwrite(X, phdr, TARBLOCK))
+    &&  !(r = xfwrite(X, pax, paxlen)) && paxlen % TARBLOCK)
+      r = xfwrite(X, zeros, TARBLOCK - paxlen % TARBLOCK);
+  }
+  if (!r) r = xfwrite(X, hdr, TARBLOCK);
+  if (pax) free(pax);
+  free(name);
+  return r;
+}
+
+
+/* Pad a member's data out to a whole number of blocks */
+afs_uint32 Tar_Pad(XFILE *X, u_int64 *size)
+{
+  afs_uint32 n = lo64(*size) % TARBLOCK;
+
+  if (!n) return 0;
+  return xfwrite(X, zeros, TARBLOCK - n);
+}
+
+
+/* Mark the end of the archive */
+afs_uint32 Tar_End(XFILE *X)
+{
+  afs_uint32 r;
+
+  if (r = xfwrite(X, zeros, TARBLOCK)) return r;
+  return xfwrite(X, zeros, TARBLOCK);
+}
@@ -29,6 +29,9 @@
 /* util.c - Useful utilities */
 
 #include <errno.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "xf_errs.h"
 #include "dumpscan.h"
@@ -162,3 +165,150 @@ int match_next_vnode(XFILE *X, dump_parser *p, u_int64 *where, afs_uint32 vnode)
     return DSERR_FMT;
   }
 }
+
+
+/* Bytes needed to decide whether a location matches a vnode:
+ * tag, vnode, uniquifier, tag, and either a vnode number or the
+ * dump end magic number.
+ */
+#define MATCH_LEN 14
+#define GET_INT32(b) (((afs_uint32)(b)[0] << 24) | ((afs_uint32)(b)[1] << 16) \
+                      | ((afs_uint32)(b)[2] << 8) | (afs_uint32)(b)[3])
+
+/* Like match_next_vnode, but on data already in memory.
+ * buf must hold at least MATCH_LEN bytes.
+ */
+static int match_vnode_buf(dump_parser *p, unsigned char *buf,
+                           afs_uint32 vnode)
+{
+  afs_uint32 x, y, z;
+
+  switch (buf[0]) {
+  case 3:  /* A vnode? */
+    x = GET_INT32(buf + 1);
+    y = GET_INT32(buf + 5);
+    if ( !((vnode & 1) && !(x & 1) && x < vnode)
+    &&   !((vnode & 1) == (x & 1) && x > vnode))
+      return DSERR_FMT;
+    if (x > vnode && x - vnode > 10000) return DSERR_FMT;
+    if ((int)y < 0 || y > p->vol_uniquifier)  return DSERR_FMT;
+
+    switch (buf[9]) {
+    case 3:   /* Another vnode? - Only if this is a non-directory */
+      if (x & 1) return DSERR_FMT;
+      z = GET_INT32(buf + 10);
+      if ( !((x & 1) && !(z & 1) && z < x)
+      &&   !((x & 1) == (z & 1) && z > x))
+        return DSERR_FMT;
+      return 0;
+
+    case 4:   /* Dump end - Only if this is a non-directory */
+      if (x & 1) return DSERR_FMT;
+      if (GET_INT32(buf + 10) != DUMPENDMAGIC) return DSERR_FMT;
+      return 0;
+
+    case 't': /* Vnode type byte */
+      if ((buf[10] == vFile || buf[10] == vSymlink) && !(x & 1)) return 0;
+      if (buf[10] == vDirectory && (x & 1)) return 0;
+      return DSERR_FMT;
+
+    default:
+      return DSERR_FMT;
+    }
+
+  case 4:  /* A dump end? */
+    if (GET_INT32(buf + 1) != DUMPENDMAGIC) return DSERR_FMT;
+    return 0;
+
+  default:
+    return DSERR_FMT;
+  }
+}
+
+
+/* Return the index of the first vnode or dump-end tag byte in buf[0..n),
+ * or n if there is none.  len is the number of bytes actually in buf.
+ */
+static afs_uint32 next_candidate(unsigned char *buf, afs_uint32 i,
+                                 afs_uint32 n, afs_uint32 len)
+{
+#ifdef __SSE2__
+  __m128i t3 = _mm_set1_epi8(3), t4 = _mm_set1_epi8(4), b;
+  int mask;
+
+  while (i < n && i + 16 <= len) {
+    b = _mm_loadu_si128((__m128i *)(buf + i));
+    mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(b, t3),
+                                          _mm_cmpeq_epi8(b, t4)));
+    if (mask) {
+      while (!(mask & 1)) { mask >>= 1; i++; }
+      return (i < n) ? i : n;
+    }
+    i += 16;
+  }
+#endif
+  for (; i < n; i++)
+    if (buf[i] == 3 || buf[i] == 4) return i;
+  return n;
+}
+
+
+/* Search for the next vnode (or dump end) near *where.  The candidates
+ * are tried in the same order resync has always used - *where itself,
+ * then each offset from *where - before up to *where + after - and the
+ * first match is left in *where.  The whole range is read once and
+ * checked in memory; if it runs past the end of the file, we fall back
+ * to checking each candidate with match_next_vnode.
+ * Returns 0 if found, DSERR_FMT if not, something else on error
+ */
+/*** THIS FUNCTION INTENDED FOR INTERNAL USE ONLY ***/
+int find_next_vnode(XFILE *X, dump_parser *p, u_int64 *where,
+                    afs_uint32 vnode, int before, int after)
+{
+  u_int64 expected, base;
+  unsigned char *buf;
+  afs_uint32 r, i, n, len;
+  int j;
+
+  cp64(expected, *where);
+  if (!hi64(expected) && lo64(expected) < (afs_uint32)before)
+    before = lo64(expected);
+  sub64_32(base, expected, before);
+  n = before + after;
+  len = n + MATCH_LEN - 1;
+
+  if (!(buf = (unsigned char *)malloc(len))) return ENOMEM;
+  if (r = xfseek(X, &base)) {
+    free(buf);
+    return r;
+  }
+  r = xfread(X, buf, len);
+  if (!r) {
+    if ((afs_uint32)before < n && !match_vnode_buf(p, buf + before, vnode)) {
+      free(buf);
+      return 0;
+    }
+    for (i = next_candidate(buf, 0, n, len); i < n;
+         i = next_candidate(buf, i + 1, n, len)) {
+      if (!match_vnode_buf(p, buf + i, vnode)) {
+        add64_32(*where, base, i);
+        free(buf);
+        return 0;
+      }
+    }
+    free(buf);
+    return DSERR_FMT;
+  }
+  free(buf);
+  if (r != ERROR_XFILE_EOF) return r;
+
+  /* Too close to the end of the file; do it the slow way */
+  r = match_next_vnode(X, p, where, vnode);
+  if (r != DSERR_FMT) return r;
+  for (j = -before; j < after; j++) {
+    add64_32(*where, expected, j);
+    r = match_next_vnode(X, p, where, vnode);
+    if (r != DSERR_FMT) return r;
+  }
+  return r;
+}